@@ -56,7 +56,8 @@ void logSetColorize(bool enabled);
 bool logColorized(void);
 
 // Adds a prefix to the head of all messages. The string must be valid until
-// logSetPrefix is called again with a NULL parameter.
+// logSetPrefix is called again with a NULL parameter. The prefix only applies
+// to messages logged by the calling thread.
 void logSetPrefix(const char* prefix);
 const char* logPrefix(void);
 
@@ -102,6 +102,11 @@ int netEnumInterfaces(netIfCallback callback, netContext* ctx, void* userData);
 // new interfaces.
 int netCreateVethPair(const char* intfName1, const char* intfName2, netContext* ctx1, netContext* ctx2, const macAddr* addr1, const macAddr* addr2, int mtu, bool sync);
 
+// Deletes an interface. If the interface is one end of a virtual Ethernet
+// pair, the other end is deleted as well. Returns ENODEV if the interface does
+// not exist (if sync is true).
+int netDeleteInterface(netContext* ctx, const char* name, bool sync);
+
 // Returns the interface index for an interface. On error, returns -1 and sets
 // err (if provided) to the error code.
 int netGetInterfaceIndex(netContext* ctx, const char* name, int* err);
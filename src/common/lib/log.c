@@ -47,7 +47,7 @@ static logCallback logFunc;
 static FILE* logStream;
 static bool closeLog;
 static bool useColors;
-static const char* ___logPrefix;
+static __thread const char* ___logPrefix;
 LogLevel ___logThreshold;
 
 void logSetStream(FILE* output) {
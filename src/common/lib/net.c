@@ -63,6 +63,7 @@
 #include <sys/mount.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <unistd.h>
 
@@ -79,7 +80,7 @@
 #include "net.inl"
 
 #define NET_NS_DIR        "/var/run/netns"
-#define CURRENT_NS_FILE   "/proc/self/ns/net"
+#define CURRENT_NS_FMT    "/proc/self/task/%ld/ns/net"
 #define INIT_NS_FILE      "/proc/1/ns/net"
 #define PSCHED_PARAM_FILE "/proc/net/psched"
 
@@ -91,8 +92,9 @@
 
 const int IP4_DEFAULT_MTU = ETH_DATA_LEN;
 
-static char namespacePrefix[PATH_MAX];
-static double pschedTicksPerMs = 1.0;
+// Namespaces are bound to threads, so all module state is per-thread
+static __thread char namespacePrefix[PATH_MAX];
+static __thread double pschedTicksPerMs = 1.0;
 
 #if INTERFACE_BUF_LEN != IFNAMSIZ
 #error "Mismatch between internal interface name buffer length and the buffer length for this kernel."
@@ -242,9 +244,12 @@ int netOpenNamespaceInPlace(netContext* ctx, bool reusing, const char* name, boo
 
 		// Bind mount the new namespace. This prevents it from closing until it
 		// is explicitly unmounted; there is no need to keep a dedicated process
-		// bound to it.
+		// bound to it. We refer to the namespace of the calling thread, since
+		// other threads may be in different namespaces.
+		char currentNsPath[PATH_MAX];
+		snprintf(currentNsPath, PATH_MAX, CURRENT_NS_FMT, (long)syscall(SYS_gettid));
 		errno = 0;
-		if (mount(CURRENT_NS_FILE, netNsPath, "none", MS_BIND, NULL) != 0) {
+		if (mount(currentNsPath, netNsPath, "none", MS_BIND, NULL) != 0) {
 			lprintf(LogError, "Failed to bind new network namespace file '%s': %s\n", netNsPath, strerror(errno));
 			goto abort;
 		}
@@ -681,6 +686,24 @@ int netCreateVethPair(const char* intfName1, const char* intfName2, netContext*
 	return nlSendMessage(nl, sync, NULL, NULL);
 }
 
+int netDeleteInterface(netContext* ctx, const char* name, bool sync) {
+	lprintf(LogDebug, "Deleting interface %p:'%s'\n", ctx, name);
+
+	nlContext* nl = &ctx->nl;
+	nlInitMessage(nl, RTM_DELLINK, (sync ? NLM_F_ACK : 0));
+
+	struct ifinfomsg ifi = { .ifi_family = AF_UNSPEC, .ifi_type = 0, .ifi_index = 0, .ifi_flags = 0, .ifi_change = 0 };
+	nlBufferAppend(nl, &ifi, sizeof(ifi));
+
+	nlPushAttr(nl, IFLA_IFNAME);
+	{
+		nlBufferAppend(nl, name, strlen(name) + 1);
+	}
+	nlPopAttr(nl);
+
+	return nlSendMessage(nl, sync, NULL, NULL);
+}
+
 static void initIfReq(struct ifreq* ifr) {
 	// The kernel ignores unnecessary fields, so this is only useful for debug
 	// builds that are being profiled for pointers to unallocated data
@@ -43,15 +43,15 @@
 #endif
 
 // Raw buffer used to hold the message being constructed or received. We share a
-// buffer for all contexts. Even if we did not do this, the module is already
-// not thread-safe because of namespaces being bound to the process. This way,
-// we don't need large buffers for each context.
-static union {
+// buffer for all contexts used by a thread. Since the active network namespace
+// is also a per-thread property, threads that each call nlInit can use the
+// module independently. This way, we don't need large buffers for each context.
+static __thread union {
 	void* data;
 	struct nlmsghdr* nlmsg;
 } msgBuffer;
-static size_t msgBufferCap;
-static size_t msgBufferLen;
+static __thread size_t msgBufferCap;
+static __thread size_t msgBufferLen;
 
 void nlInit(void) {
 	flexBufferInit(&msgBuffer.data, &msgBufferLen, &msgBufferCap);
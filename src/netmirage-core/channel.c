@@ -0,0 +1,386 @@
+/*******************************************************************************
+ * Copyright © 2018 Nik Unger, Ian Goldberg, Qatar University, and the Qatar
+ * Foundation for Education, Science and Community Development.
+ *
+ * This file is part of NetMirage.
+ *
+ * NetMirage is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * NetMirage is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Affero General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with NetMirage. If not, see <http://www.gnu.org/licenses/>.
+ *******************************************************************************/
+#define _GNU_SOURCE // Needed for Linux-specific functionality
+
+#include "channel.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <errno.h>
+#include <linux/futex.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "mem.h"
+
+typedef struct {
+	uint32_t code;
+	uint32_t len;
+} chHeader;
+
+// Parts larger than this are not copied into the buffer
+static const size_t ChCopyLimit = 1024;
+
+// Writers flush themselves once they have buffered this many bytes. This
+// matches the default capacity of a Linux pipe.
+static const size_t ChFlushThreshold = 64 * 1024;
+
+static const size_t ChReadSize = 64 * 1024;
+
+#define CH_MAX_IOV 16
+
+// Rings use free-running 64-bit positions, so the data area is indexed modulo
+// its capacity. Each side only writes its own position. A side that runs out of
+// data (or space) advertises that it is waiting and sleeps on a futex, and the
+// other side only issues a wakeup when it sees the advertisement. The shared
+// variables are padded to avoid false sharing between the two processes.
+struct chRing {
+	uint64_t writePos;
+	uint32_t closed;
+	char pad0[52];
+	uint64_t readPos;
+	char pad1[56];
+	uint32_t dataSeq;
+	uint32_t consumerWaiting;
+	char pad2[56];
+	uint32_t spaceSeq;
+	uint32_t producerWaiting;
+	char pad3[56];
+	size_t capacity; // Always a power of two
+	size_t mapSize;
+	char data[];
+};
+
+// Sleeping sides periodically wake up to check whether their peer has died
+static const long ChRingPollNs = 100 * 1000 * 1000;
+
+static bool writevAll(int fd, struct iovec* iov, int count) {
+	while (count > 0) {
+		ssize_t written = writev(fd, iov, count);
+		if (written <= 0) return false;
+		size_t remaining = (size_t)written;
+		while (count > 0 && remaining >= iov->iov_len) {
+			remaining -= iov->iov_len;
+			++iov;
+			--count;
+		}
+		if (count > 0) {
+			iov->iov_base = (char*)iov->iov_base + remaining;
+			iov->iov_len -= remaining;
+		}
+	}
+	return true;
+}
+
+void* chNewShared(size_t size) {
+#ifdef SYS_memfd_create
+	int fd = (int)syscall(SYS_memfd_create, "netmirage-shm", 0);
+	if (fd == -1) {
+		lprintf(LogDebug, "Could not create shared memory file: %s\n", strerror(errno));
+		return NULL;
+	}
+	if (ftruncate(fd, (off_t)size) != 0) {
+		lprintf(LogDebug, "Could not resize shared memory file: %s\n", strerror(errno));
+		close(fd);
+		return NULL;
+	}
+	void* map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd); // The mapping keeps the memory alive
+	if (map == MAP_FAILED) {
+		lprintf(LogDebug, "Could not map shared memory: %s\n", strerror(errno));
+		return NULL;
+	}
+	return map; // New shared memory files are filled with zeros
+#else
+	return NULL;
+#endif
+}
+
+void chFreeShared(void* block, size_t size) {
+	munmap(block, size);
+}
+
+chRing* chNewRing(size_t capacity) {
+	size_t ringCap = 4096;
+	while (ringCap < capacity) emulSize(ringCap, 2, &ringCap);
+	size_t mapSize;
+	eaddSize(sizeof(chRing), ringCap, &mapSize);
+
+	chRing* ring = chNewShared(mapSize);
+	if (ring == NULL) return NULL;
+	ring->capacity = ringCap;
+	ring->mapSize = mapSize;
+	return ring;
+}
+
+void chFreeRing(chRing* ring) {
+	chFreeShared(ring, ring->mapSize);
+}
+
+static void chFutexWake(uint32_t* addr) {
+	syscall(SYS_futex, addr, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+// Sleeps until *addr no longer contains val or the poll interval elapses
+static void chFutexWait(uint32_t* addr, uint32_t val) {
+	struct timespec timeout = { 0, ChRingPollNs };
+	syscall(SYS_futex, addr, FUTEX_WAIT, val, &timeout, NULL, 0);
+}
+
+// Determines whether the process at the other end of a pipe still exists
+static bool chPeerAlive(int fd) {
+	struct pollfd pfd;
+	pfd.fd = fd;
+	pfd.events = 0;
+	pfd.revents = 0;
+	if (poll(&pfd, 1, 0) < 0) return true;
+	return (pfd.revents & (POLLHUP | POLLERR | POLLNVAL)) == 0;
+}
+
+static bool chRingWrite(chRing* ring, int fd, const void* data, size_t len) {
+	const char* p = data;
+	uint64_t writePos = ring->writePos;
+	while (len > 0) {
+		uint64_t readPos = __atomic_load_n(&ring->readPos, __ATOMIC_ACQUIRE);
+		size_t space = ring->capacity - (size_t)(writePos - readPos);
+		if (space == 0) {
+			__atomic_store_n(&ring->producerWaiting, 1, __ATOMIC_SEQ_CST);
+			uint32_t seq = __atomic_load_n(&ring->spaceSeq, __ATOMIC_SEQ_CST);
+			if (__atomic_load_n(&ring->readPos, __ATOMIC_SEQ_CST) == readPos) {
+				if (!chPeerAlive(fd)) return false;
+				chFutexWait(&ring->spaceSeq, seq);
+			}
+			__atomic_store_n(&ring->producerWaiting, 0, __ATOMIC_RELAXED);
+			continue;
+		}
+
+		size_t chunk = (len < space ? len : space);
+		size_t offset = (size_t)writePos & (ring->capacity - 1);
+		size_t firstPart = ring->capacity - offset;
+		if (firstPart > chunk) firstPart = chunk;
+		memcpy(&ring->data[offset], p, firstPart);
+		memcpy(ring->data, p + firstPart, chunk - firstPart);
+		p += chunk;
+		len -= chunk;
+		writePos += chunk;
+
+		__atomic_store_n(&ring->writePos, writePos, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&ring->consumerWaiting, __ATOMIC_SEQ_CST)) {
+			__atomic_add_fetch(&ring->dataSeq, 1, __ATOMIC_SEQ_CST);
+			chFutexWake(&ring->dataSeq);
+		}
+	}
+	return true;
+}
+
+// Reads at least one byte (and at most maxLen bytes) from the ring. Returns 0
+// if the writer has shut down or died.
+static size_t chRingRead(chRing* ring, int fd, void* dest, size_t maxLen) {
+	uint64_t readPos = ring->readPos;
+	while (true) {
+		uint64_t writePos = __atomic_load_n(&ring->writePos, __ATOMIC_ACQUIRE);
+		if (writePos != readPos) {
+			size_t avail = (size_t)(writePos - readPos);
+			size_t chunk = (maxLen < avail ? maxLen : avail);
+			size_t offset = (size_t)readPos & (ring->capacity - 1);
+			size_t firstPart = ring->capacity - offset;
+			if (firstPart > chunk) firstPart = chunk;
+			memcpy(dest, &ring->data[offset], firstPart);
+			memcpy((char*)dest + firstPart, ring->data, chunk - firstPart);
+
+			__atomic_store_n(&ring->readPos, readPos + chunk, __ATOMIC_SEQ_CST);
+			if (__atomic_load_n(&ring->producerWaiting, __ATOMIC_SEQ_CST)) {
+				__atomic_add_fetch(&ring->spaceSeq, 1, __ATOMIC_SEQ_CST);
+				chFutexWake(&ring->spaceSeq);
+			}
+			return chunk;
+		}
+
+		__atomic_store_n(&ring->consumerWaiting, 1, __ATOMIC_SEQ_CST);
+		uint32_t seq = __atomic_load_n(&ring->dataSeq, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&ring->writePos, __ATOMIC_SEQ_CST) == readPos) {
+			if (__atomic_load_n(&ring->closed, __ATOMIC_SEQ_CST) || !chPeerAlive(fd)) {
+				// Make sure that we did not miss anything written just before
+				// the writer went away
+				if (__atomic_load_n(&ring->writePos, __ATOMIC_SEQ_CST) == readPos) {
+					__atomic_store_n(&ring->consumerWaiting, 0, __ATOMIC_RELAXED);
+					return 0;
+				}
+			} else {
+				chFutexWait(&ring->dataSeq, seq);
+			}
+		}
+		__atomic_store_n(&ring->consumerWaiting, 0, __ATOMIC_RELAXED);
+	}
+}
+
+void chWriterInit(chWriter* writer, int fd, chRing* ring) {
+	writer->fd = fd;
+	writer->ring = ring;
+	flexBufferInit((void**)&writer->buf, &writer->len, &writer->cap);
+}
+
+void chWriterFree(chWriter* writer) {
+	flexBufferFree((void**)&writer->buf, &writer->len, &writer->cap);
+}
+
+bool chWriteFrame(chWriter* writer, uint32_t code, const struct iovec* parts, int partCount) {
+	chHeader header;
+	header.code = code;
+	header.len = 0;
+	bool copyAll = true;
+	for (int i = 0; i < partCount; ++i) {
+		eadd32(header.len, (uint32_t)parts[i].iov_len, &header.len);
+		if (parts[i].iov_len > ChCopyLimit) copyAll = false;
+	}
+	if (partCount + 1 > CH_MAX_IOV) copyAll = true;
+
+	flexBufferGrow((void**)&writer->buf, writer->len, &writer->cap, sizeof(chHeader), 1);
+	flexBufferAppend(writer->buf, &writer->len, &header, sizeof(chHeader), 1);
+
+	if (copyAll) {
+		flexBufferGrow((void**)&writer->buf, writer->len, &writer->cap, header.len, 1);
+		for (int i = 0; i < partCount; ++i) {
+			flexBufferAppend(writer->buf, &writer->len, parts[i].iov_base, parts[i].iov_len, 1);
+		}
+		if (writer->len >= ChFlushThreshold) return chFlush(writer);
+		return true;
+	}
+
+	if (writer->ring != NULL) {
+		bool success = chFlush(writer);
+		for (int i = 0; success && i < partCount; ++i) {
+			success = chRingWrite(writer->ring, writer->fd, parts[i].iov_base, parts[i].iov_len);
+		}
+		return success;
+	}
+
+	// Gather the buffered frames and the large body parts into a single write
+	struct iovec iov[CH_MAX_IOV];
+	iov[0].iov_base = writer->buf;
+	iov[0].iov_len = writer->len;
+	for (int i = 0; i < partCount; ++i) {
+		iov[i+1] = parts[i];
+	}
+	writer->len = 0;
+	return writevAll(writer->fd, iov, partCount + 1);
+}
+
+bool chFlush(chWriter* writer) {
+	if (writer->len == 0) return true;
+	if (writer->ring != NULL) {
+		size_t len = writer->len;
+		writer->len = 0;
+		return chRingWrite(writer->ring, writer->fd, writer->buf, len);
+	}
+	struct iovec iov;
+	iov.iov_base = writer->buf;
+	iov.iov_len = writer->len;
+	writer->len = 0;
+	return writevAll(writer->fd, &iov, 1);
+}
+
+bool chPending(const chWriter* writer) {
+	return writer->len > 0;
+}
+
+bool chShutdown(chWriter* writer) {
+	bool success = chFlush(writer);
+	if (writer->ring != NULL) {
+		__atomic_store_n(&writer->ring->closed, 1, __ATOMIC_SEQ_CST);
+		__atomic_add_fetch(&writer->ring->dataSeq, 1, __ATOMIC_SEQ_CST);
+		chFutexWake(&writer->ring->dataSeq);
+	}
+	return success;
+}
+
+void chReaderInit(chReader* reader, int fd, chRing* ring) {
+	reader->fd = fd;
+	reader->ring = ring;
+	reader->start = 0;
+	reader->end = 0;
+	flexBufferInit((void**)&reader->buf, NULL, &reader->cap);
+}
+
+void chReaderFree(chReader* reader) {
+	flexBufferFree((void**)&reader->buf, NULL, &reader->cap);
+	reader->start = 0;
+	reader->end = 0;
+}
+
+// Returns the number of bytes needed for the next frame to be complete, or 0 if
+// a complete frame is buffered
+static size_t chMissingBytes(const chReader* reader) {
+	size_t avail = reader->end - reader->start;
+	if (avail < sizeof(chHeader)) return sizeof(chHeader) - avail;
+	chHeader header;
+	memcpy(&header, &reader->buf[reader->start], sizeof(chHeader));
+	size_t needed = sizeof(chHeader) + header.len;
+	return (avail < needed ? needed - avail : 0);
+}
+
+bool chHasFrame(const chReader* reader) {
+	return chMissingBytes(reader) == 0;
+}
+
+bool chReadFrame(chReader* reader, uint32_t* code, const void** body, size_t* len) {
+	size_t missing;
+	while ((missing = chMissingBytes(reader)) > 0) {
+		// Move the partial frame to the front of the buffer to make room
+		if (reader->start > 0) {
+			memmove(reader->buf, &reader->buf[reader->start], reader->end - reader->start);
+			reader->end -= reader->start;
+			reader->start = 0;
+		}
+		size_t request = (missing > ChReadSize ? missing : ChReadSize);
+		flexBufferGrow((void**)&reader->buf, reader->end, &reader->cap, request, 1);
+
+		if (reader->ring != NULL) {
+			size_t readBytes = chRingRead(reader->ring, reader->fd, &reader->buf[reader->end], reader->cap - reader->end);
+			if (readBytes == 0) return false;
+			reader->end += readBytes;
+		} else {
+			ssize_t readBytes = read(reader->fd, &reader->buf[reader->end], reader->cap - reader->end);
+			if (readBytes <= 0) return false;
+			reader->end += (size_t)readBytes;
+		}
+	}
+
+	chHeader header;
+	memcpy(&header, &reader->buf[reader->start], sizeof(chHeader));
+	*code = header.code;
+	*len = header.len;
+	*body = &reader->buf[reader->start + sizeof(chHeader)];
+	reader->start += sizeof(chHeader) + header.len;
+	if (reader->start == reader->end) {
+		reader->start = 0;
+		reader->end = 0;
+	}
+	return true;
+}
@@ -0,0 +1,112 @@
+/*******************************************************************************
+ * Copyright © 2018 Nik Unger, Ian Goldberg, Qatar University, and the Qatar
+ * Foundation for Education, Science and Community Development.
+ *
+ * This file is part of NetMirage.
+ *
+ * NetMirage is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * NetMirage is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Affero General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with NetMirage. If not, see <http://www.gnu.org/licenses/>.
+ *******************************************************************************/
+#pragma once
+
+// This module implements a simple framing protocol between processes. Frames
+// consist of a small header followed by a variable-length body. Writers
+// accumulate many frames in a buffer and deliver them all at once when flushed,
+// and readers fetch as much data as is available in bulk. The functions are not
+// thread-safe; each writer and reader should only be used by a single thread.
+//
+// Data is transferred either through a pipe or through a ring buffer in shared
+// memory. Rings avoid copying data through the kernel and only require system
+// calls when one side is waiting for the other. When a ring is used, the pipe
+// is still needed to detect when the other process has died.
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <sys/uio.h>
+
+typedef struct chRing chRing;
+
+typedef struct {
+	int fd;
+	chRing* ring;
+	char* buf;
+	size_t len;
+	size_t cap;
+} chWriter;
+
+typedef struct {
+	int fd;
+	chRing* ring;
+	char* buf;
+	size_t start; // Offset of the first unconsumed byte
+	size_t end;   // Offset after the last received byte
+	size_t cap;
+} chReader;
+
+// Allocates a zeroed block of memory that remains shared with child processes
+// created using fork. Returns NULL if shared memory is not available.
+void* chNewShared(size_t size);
+
+// Unmaps a shared block from the calling process.
+void chFreeShared(void* block, size_t size);
+
+// Creates a single-producer, single-consumer ring in shared memory with room
+// for at least capacity bytes. The ring remains shared with child processes
+// created using fork. Returns NULL if shared memory is not available, in which
+// case the caller should fall back to pipes.
+chRing* chNewRing(size_t capacity);
+
+// Unmaps a ring from the calling process.
+void chFreeRing(chRing* ring);
+
+// Initializes a writer for the given file descriptor. If ring is not NULL, data
+// is transferred through the ring and the descriptor is only used to detect
+// whether the reader is still alive. The descriptor and ring remain owned by the
+// caller.
+void chWriterInit(chWriter* writer, int fd, chRing* ring);
+
+// Releases the buffers of a writer without flushing it.
+void chWriterFree(chWriter* writer);
+
+// Appends a frame to the writer. The body of the frame is the concatenation of
+// the given parts. Small parts are copied into the buffer, while large parts are
+// written directly from the caller's memory. The writer may flush itself if the
+// buffer grows large. Returns false if the descriptor could not be written.
+bool chWriteFrame(chWriter* writer, uint32_t code, const struct iovec* parts, int partCount);
+
+// Writes all buffered frames to the descriptor. Returns false on failure.
+bool chFlush(chWriter* writer);
+
+// Returns true if the writer contains frames that have not been flushed.
+bool chPending(const chWriter* writer);
+
+// Flushes the writer and informs the reader that no more frames will follow.
+// The caller should close the descriptor afterwards.
+bool chShutdown(chWriter* writer);
+
+// Initializes a reader. The parameters have the same meaning as for
+// chWriterInit.
+void chReaderInit(chReader* reader, int fd, chRing* ring);
+
+// Releases the buffers of a reader.
+void chReaderFree(chReader* reader);
+
+// Reads the next frame, blocking if a complete frame has not been received yet.
+// On success, body points to the frame body, which remains valid until the next
+// call on the reader. Returns false if the descriptor was closed or failed.
+bool chReadFrame(chReader* reader, uint32_t* code, const void** body, size_t* len);
+
+// Returns true if a complete frame can be read without blocking.
+bool chHasFrame(const chReader* reader);
@@ -482,6 +482,14 @@ static xmlSAXHandler graphHandlers = {
 	fatalError: &showXmlError,
 };
 
+// Determines the proper return value given a set of parsing errors
+static int reportErrors(const GraphParserState* state, int libXmlResult) {
+	if (state->userError != 0) return state->userError;
+	if (libXmlResult != 0) return libXmlResult;
+	if (state->dead) return 1;
+	return 0;
+}
+
 int gmlParse(FILE* input, NewNodeFunc newNode, NewLinkFunc newLink, void* userData, const char* clientType, const char* weightKey) {
 #ifdef LIBXML_PUSH_ENABLED
 	GraphParserState state;
@@ -524,21 +532,13 @@ int gmlParse(FILE* input, NewNodeFunc newNode, NewLinkFunc newLink, void* userDa
 	if (error) {
 		lprintf(LogError, "Failed to parse the GraphML file (error: %d). The document may be malformed.", error);
 	}
-	return error;
+	return reportErrors(&state, error);
 #else
 	lprintln(LogError, "Reading GraphML content in this mode is not supported because libxml was compiled without push parser support");
 	return -1;
 #endif
 }
 
-// Determines the proper return value given a set of parsing errors
-static int reportErrors(const GraphParserState* state, int libXmlResult) {
-	if (state->userError != 0) return state->userError;
-	if (libXmlResult != 0) return libXmlResult;
-	if (state->dead) return 1;
-	return 0;
-}
-
 int gmlParseFile(const char* filename, NewNodeFunc newNode, NewLinkFunc newLink, void* userData, const char* clientType, const char* weightKey) {
 	GraphParserState state;
 	initGraphParserState(&state, newNode, newLink, userData, clientType, weightKey);
@@ -0,0 +1,261 @@
+/*******************************************************************************
+ * Copyright © 2018 Nik Unger, Ian Goldberg, Qatar University, and the Qatar
+ * Foundation for Education, Science and Community Development.
+ *
+ * This file is part of NetMirage.
+ *
+ * NetMirage is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * NetMirage is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Affero General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with NetMirage. If not, see <http://www.gnu.org/licenses/>.
+ *******************************************************************************/
+#define _GNU_SOURCE // Needed for fileno and fsync
+
+#include "journal.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "mem.h"
+
+#define JOURNAL_FILE "setup.journal"
+#define MAX_KEY_LEN 31
+
+// Blobs are stored in files named after the journal and their key. Each file
+// begins with a checksum of the data that follows.
+#define BLOB_SEPARATOR "."
+#define BLOB_TEMP_SUFFIX ".tmp"
+
+typedef struct {
+	char key[MAX_KEY_LEN+1];
+	uint64_t value;
+	uint64_t check;
+} jnRecord;
+
+struct setupJournal {
+	FILE* file;
+	char* path;
+
+	// The number of distinct keys is small, so we use a simple array. Bulk
+	// data is stored in separate blob files (see jnPutBlob) rather than in
+	// many records.
+	jnRecord* records;
+	size_t recordCount;
+	size_t recordCap;
+};
+
+// 64-bit FNV-1a
+uint64_t jnCheck(uint64_t check, const void* data, size_t len) {
+	for (const unsigned char* c = data; len > 0; ++c, --len) {
+		check ^= *c;
+		check *= 1099511628211u;
+	}
+	return check;
+}
+
+static jnRecord* jnFind(const setupJournal* journal, const char* key) {
+	for (size_t i = 0; i < journal->recordCount; ++i) {
+		if (strcmp(journal->records[i].key, key) == 0) return &journal->records[i];
+	}
+	return NULL;
+}
+
+static void jnStore(setupJournal* journal, const char* key, uint64_t value, uint64_t check) {
+	jnRecord* record = jnFind(journal, key);
+	if (record == NULL) {
+		flexBufferGrow((void**)&journal->records, journal->recordCount, &journal->recordCap, 1, sizeof(jnRecord));
+		record = &journal->records[journal->recordCount++];
+		strcpy(record->key, key);
+	}
+	record->value = value;
+	record->check = check;
+}
+
+// Reads the records of an existing journal. A truncated last line (from an
+// interrupted write) is discarded so that new records start on a fresh line.
+// Returns 0 on success or an error code otherwise.
+static int jnLoad(setupJournal* journal) {
+	char line[MAX_KEY_LEN+64];
+	long validEnd = 0;
+	while (fgets(line, sizeof(line), journal->file) != NULL) {
+		char key[MAX_KEY_LEN+1];
+		uint64_t value, check;
+		if (strchr(line, '\n') == NULL) break;
+		if (sscanf(line, "%31s %lu %lx", key, &value, &check) != 3) break;
+		jnStore(journal, key, value, check);
+		validEnd = ftell(journal->file);
+	}
+	errno = 0;
+	if (ftruncate(fileno(journal->file), validEnd) != 0 || fseek(journal->file, 0, SEEK_END) != 0) {
+		int err = (errno != 0 ? errno : 1);
+		lprintf(LogError, "Could not repair the setup journal '%s': %s\n", journal->path, strerror(err));
+		return err;
+	}
+	lprintf(LogDebug, "Loaded %lu setup journal entries from '%s'\n", journal->recordCount, journal->path);
+	return 0;
+}
+
+// Deletes the blob files that belong to the journal in a directory
+static void jnDeleteBlobs(const char* directory) {
+	DIR* dir = opendir(directory);
+	if (dir == NULL) return;
+	const char* prefix = JOURNAL_FILE BLOB_SEPARATOR;
+	struct dirent* entry;
+	while ((entry = readdir(dir)) != NULL) {
+		if (strncmp(entry->d_name, prefix, strlen(prefix)) != 0) continue;
+		char* path;
+		newSprintf(&path, "%s/%s", directory, entry->d_name);
+		if (unlink(path) != 0) {
+			lprintf(LogWarning, "Could not delete the setup journal data '%s': %s\n", path, strerror(errno));
+		}
+		free(path);
+	}
+	closedir(dir);
+}
+
+setupJournal* jnOpen(const char* directory, bool resume, int* err) {
+	setupJournal* journal = emalloc(sizeof(setupJournal));
+	newSprintf(&journal->path, "%s/" JOURNAL_FILE, directory);
+	flexBufferInit((void**)&journal->records, &journal->recordCount, &journal->recordCap);
+
+	if (!resume) jnDeleteBlobs(directory);
+	errno = 0;
+	journal->file = fopen(journal->path, resume ? "r+e" : "we");
+	if (journal->file == NULL) {
+		int openErr = errno;
+		if (!resume || openErr != ENOENT) {
+			lprintf(LogError, "Could not open the setup journal '%s': %s\n", journal->path, strerror(openErr));
+		}
+		if (err != NULL) *err = openErr;
+		jnClose(journal);
+		return NULL;
+	}
+	if (resume) {
+		int loadErr = jnLoad(journal);
+		if (loadErr != 0) {
+			if (err != NULL) *err = loadErr;
+			jnClose(journal);
+			return NULL;
+		}
+	}
+	return journal;
+}
+
+void jnClose(setupJournal* journal) {
+	if (journal->file != NULL) fclose(journal->file);
+	flexBufferFree((void**)&journal->records, &journal->recordCount, &journal->recordCap);
+	free(journal->path);
+	free(journal);
+}
+
+int jnDelete(const char* directory) {
+	char* path;
+	newSprintf(&path, "%s/" JOURNAL_FILE, directory);
+	int err = 0;
+	errno = 0;
+	if (unlink(path) != 0 && errno != ENOENT) {
+		err = errno;
+		lprintf(LogWarning, "Could not delete the setup journal '%s': %s\n", path, strerror(err));
+	}
+	free(path);
+	jnDeleteBlobs(directory);
+	return err;
+}
+
+bool jnGet(const setupJournal* journal, const char* key, uint64_t* value, uint64_t* check) {
+	const jnRecord* record = jnFind(journal, key);
+	if (record == NULL) return false;
+	*value = record->value;
+	*check = record->check;
+	return true;
+}
+
+int jnPut(setupJournal* journal, const char* key, uint64_t value, uint64_t check) {
+	if (strlen(key) > MAX_KEY_LEN) {
+		lprintf(LogError, "BUG: setup journal key '%s' is too long\n", key);
+		return 1;
+	}
+	lprintf(LogDebug, "Setup journal: %s = %lu\n", key, value);
+	jnStore(journal, key, value, check);
+
+	errno = 0;
+	if (fprintf(journal->file, "%s %lu %016lx\n", key, value, check) < 0 ||
+	    fflush(journal->file) != 0 ||
+	    fsync(fileno(journal->file)) != 0) {
+		int err = (errno != 0 ? errno : 1);
+		lprintf(LogError, "Could not write to the setup journal '%s': %s\n", journal->path, strerror(err));
+		return err;
+	}
+	return 0;
+}
+
+int jnPutBlob(setupJournal* journal, const char* key, const void* data, size_t len, uint64_t check) {
+	char* path;
+	char* tempPath;
+	newSprintf(&path, "%s" BLOB_SEPARATOR "%s", journal->path, key);
+	newSprintf(&tempPath, "%s" BLOB_TEMP_SUFFIX, path);
+
+	// The blob is completely on disk before the record that refers to it
+	int err = 0;
+	uint64_t dataCheck = jnCheck(JN_CHECK_INIT, data, len);
+	errno = 0;
+	FILE* file = fopen(tempPath, "we");
+	if (file == NULL ||
+	    fwrite(&dataCheck, sizeof(dataCheck), 1, file) != 1 ||
+	    (len > 0 && fwrite(data, len, 1, file) != 1) ||
+	    fflush(file) != 0 ||
+	    fsync(fileno(file)) != 0) {
+		err = (errno != 0 ? errno : 1);
+	}
+	if (file != NULL && fclose(file) != 0 && err == 0) err = errno;
+	if (err == 0 && rename(tempPath, path) != 0) err = errno;
+	if (err != 0) {
+		lprintf(LogError, "Could not write the setup journal data '%s': %s\n", path, strerror(err));
+		unlink(tempPath);
+	} else {
+		err = jnPut(journal, key, len, check);
+	}
+	free(tempPath);
+	free(path);
+	return err;
+}
+
+bool jnGetBlob(const setupJournal* journal, const char* key, void** data, size_t* len, uint64_t* check) {
+	uint64_t value;
+	if (!jnGet(journal, key, &value, check)) return false;
+
+	char* path;
+	newSprintf(&path, "%s" BLOB_SEPARATOR "%s", journal->path, key);
+	*len = (size_t)value;
+	*data = eamalloc(*len, 1, 1); // The extra byte keeps empty blobs distinct from NULL
+	uint64_t dataCheck;
+	bool valid = false;
+	FILE* file = fopen(path, "re");
+	if (file != NULL &&
+	    fread(&dataCheck, sizeof(dataCheck), 1, file) == 1 &&
+	    (*len == 0 || fread(*data, *len, 1, file) == 1) &&
+	    fgetc(file) == EOF) {
+		valid = (dataCheck == jnCheck(JN_CHECK_INIT, *data, *len));
+	}
+	if (file != NULL) fclose(file);
+	if (!valid) {
+		lprintf(LogError, "The setup journal data '%s' is missing or damaged\n", path);
+		free(*data);
+		*data = NULL;
+	}
+	free(path);
+	return valid;
+}
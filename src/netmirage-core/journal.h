@@ -0,0 +1,68 @@
+/*******************************************************************************
+ * Copyright © 2018 Nik Unger, Ian Goldberg, Qatar University, and the Qatar
+ * Foundation for Education, Science and Community Development.
+ *
+ * This file is part of NetMirage.
+ *
+ * NetMirage is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * NetMirage is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Affero General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with NetMirage. If not, see <http://www.gnu.org/licenses/>.
+ *******************************************************************************/
+#pragma once
+
+// This module records the progress of a network setup so that an interrupted
+// setup can be resumed. The journal is a small text file stored in the Open
+// vSwitch directory. Each record associates a key with a value and a checksum
+// of the inputs that produced it. Records are flushed to disk as they are
+// written, and later records replace earlier ones with the same key. Larger
+// blocks of data are stored in separate files next to the journal.
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct setupJournal setupJournal;
+
+#define JN_CHECK_INIT UINT64_C(14695981039346656037)
+
+// Mixes data into a checksum, starting from JN_CHECK_INIT
+uint64_t jnCheck(uint64_t check, const void* data, size_t len);
+
+// Opens the journal in the given directory. If resume is true, the existing
+// records are loaded, and ENOENT is returned silently if there is no journal.
+// Otherwise, any existing journal is discarded. Returns NULL on error and sets
+// err (if not NULL) to the error code.
+setupJournal* jnOpen(const char* directory, bool resume, int* err);
+
+void jnClose(setupJournal* journal);
+
+// Deletes the journal in the given directory, if there is one. Returns 0 on
+// success or an error code otherwise.
+int jnDelete(const char* directory);
+
+// Looks up the latest record for a key. Returns false if there is none.
+bool jnGet(const setupJournal* journal, const char* key, uint64_t* value, uint64_t* check);
+
+// Appends a record and waits until it is stored on disk. Returns 0 on success
+// or an error code otherwise.
+int jnPut(setupJournal* journal, const char* key, uint64_t value, uint64_t check);
+
+// Stores a block of data in its own file next to the journal, and then records
+// its length under a key as for jnPut. The data reaches the disk with a single
+// flush, which is much cheaper than storing it in many records. Returns 0 on
+// success or an error code otherwise.
+int jnPutBlob(setupJournal* journal, const char* key, const void* data, size_t len, uint64_t check);
+
+// Loads a block of data stored with jnPutBlob. Returns false if there is no
+// record for the key, or if the data is missing or damaged (which is logged).
+// Otherwise, data is set to a new buffer of len bytes that the caller frees.
+bool jnGetBlob(const setupJournal* journal, const char* key, void** data, size_t* len, uint64_t* check);
@@ -55,6 +55,15 @@ enum {
 	AcOvsDir = 256,
 	AcOvsSchema,
 	AcClientNode,
+	AcWorkerThreads,
+	AcDefaultRoutes,
+	AcClientOrder,
+	AcReduce,
+	AcPrune,
+	AcResume,
+	AcRouteCache,
+	AcRouteCacheSize,
+	AcUpdateWeights,
 } ArgCodes;
 
 // Divisors for GraphML bandwidths
@@ -107,8 +116,10 @@ static error_t parseArg(int key, char* arg, struct argp_state* state, unsigned i
 	case 'd': args.params.destroyOnly = true; break;
 	case 'k': args.params.keepOldNetworks = true; break;
 	case 'f': args.params.srcFile = arg; break;
+	case AcResume: args.params.resume = true; break;
 	case AcOvsDir: args.params.ovsDir = arg; break;
 	case AcOvsSchema: args.params.ovsSchema = arg; break;
+	case AcWorkerThreads: args.params.workerThreads = true; break;
 
 	case 'i': {
 		args.params.edgeNodeDefaults.intfSpecified = true;
@@ -223,7 +234,24 @@ static error_t parseArg(int key, char* arg, struct argp_state* state, unsigned i
 	}
 	case 'w': args.gmlParams.weightKey = arg; break;
 	case AcClientNode: args.gmlParams.clientType = arg; break;
-	case '2': args.gmlParams.twoPass = true; break;
+	case '2': args.gmlParams.unsorted = true; break;
+	case AcDefaultRoutes: args.gmlParams.defaultRoutes = true; break;
+	case AcReduce: args.gmlParams.reduceTopology = true; break;
+	case AcPrune: args.gmlParams.pruneTopology = true; break;
+	case AcRouteCache: args.gmlParams.routeCacheDir = arg; break;
+	case AcRouteCacheSize: args.gmlParams.routeCacheSize = (uint64_t)(1024.0 * 1024.0 * strtod(arg, NULL)); break;
+	case AcUpdateWeights: args.gmlParams.weightUpdateFile = arg; break;
+	case AcClientOrder: {
+		const char* options[] = {"id", "tree", NULL};
+		ClientOrder orders[] = {ClientOrderId, ClientOrderTree};
+		long index = matchArg(arg, options);
+		if (index < 0) {
+			fprintf(stderr, "Unknown client order '%s'\n", arg);
+			return EINVAL;
+		}
+		args.gmlParams.clientOrder = orders[index];
+		break;
+	}
 
 	default: return ARGP_ERR_UNKNOWN;
 	}
@@ -263,13 +291,31 @@ static bool readSetupEdges(GKeyFile* file) {
 	return true;
 }
 
+// Returns true if --worker-threads (or an unambiguous abbreviation of it)
+// appears on the command line. The workers are started before any user input is
+// parsed, so this option has to be found before the full argument parsing.
+static bool argsRequestWorkerThreads(int argc, char** argv) {
+	static const char* option = "--worker-threads";
+	static const size_t minLen = 4; // "--wo" is the shortest unique prefix
+	for (int i = 1; i < argc; ++i) {
+		const char* arg = argv[i];
+		if (strcmp(arg, "--") == 0) break;
+		size_t len = strlen(arg);
+		if (len >= minLen && strncmp(arg, option, len) == 0) return true;
+	}
+	return false;
+}
+
 int main(int argc, char** argv) {
 	appInit("NetMirage Core", getVersion());
 
 	// Launch worker processes so that we can drop our privileges as quickly as
-	// possible (note that we have not handled any user input at this point)
-	if (setupInit() != 0) {
-		lprintln(LogError, "Failed to start worker processes. Elevation may be required.");
+	// possible (note that we have not handled any user input at this point).
+	// Thread workers can only be requested on the command line, since they
+	// must be chosen before the setup file is read.
+	bool workerThreads = argsRequestWorkerThreads(argc, argv);
+	if (setupInit(workerThreads) != 0) {
+		lprintln(LogError, "Failed to start workers. Elevation may be required.");
 		logCleanup();
 		return 1;
 	}
@@ -281,6 +327,7 @@ int main(int argc, char** argv) {
 	struct argp_option generalOptions[] = {
 			{ "destroy",      'd', NULL,   OPTION_ARG_OPTIONAL, "If specified, any previous virtual network created by the program will be destroyed and the program terminates without creating a new network.", 0 },
 			{ "keep",         'k', NULL,   OPTION_ARG_OPTIONAL, "If specified, previous virtual networks created by the program are not destroyed before setting up new ones. Note that --destroy takes priority.", 0 },
+			{ "resume",       AcResume, NULL, OPTION_ARG_OPTIONAL, "If specified, a network setup that was interrupted by an error is continued from the progress journal in the Open vSwitch directory, rather than being destroyed and set up again. The topology and configuration must be the same as in the interrupted run. If there is nothing to resume, a new network is set up.", 0 },
 			{ "file",         'f', "FILE", 0,                   "The GraphML file containing the network topology. If omitted, the topology is read from stdin.", 0 },
 			{ "setup-file",   's', "FILE", 0,                   "The file containing setup information about edge nodes and emulator interfaces. This file is a key-value file (similar to an .ini file). Every group whose name begins with \"edge\" or \"node\" denotes the configuration for an edge node. The keys and values permitted in an edge node group are the same as those in an --edge-node argument. There may also be an \"emulator\" group. This group may contain any of the long names for command arguments. Note that any file paths specified in the setup file are relative to the current working directory (not the file location). Any arguments passed on the command line override the defaults and those set in the setup file. By default, the program attempts to read setup information from " DEFAULT_SETUP_FILE ".", 0 },
 
@@ -300,7 +347,8 @@ int main(int argc, char** argv) {
 			{ "ovs-dir",      AcOvsDir,    "DIR",            0, "Directory for storing temporary Open vSwitch files, such as the flow database and management sockets (default: \"" DEFAULT_OVS_DIR "\").", 4 },
 			{ "ovs-schema",   AcOvsSchema, "FILE",           0, "Path to the OVSDB schema definition for Open vSwitch (default: \"/usr/share/openvswitch/vswitch.ovsschema\").", 4 },
 
-			{ "mem",          'm', "MiB",    0, "Approximate maximum memory use, specified in MiB. The program may use more than this amount if needed.", 5 },
+			{ "mem",          'm', "MiB",    0, "Approximate maximum memory use, specified in MiB. The program may use more than this amount if needed, but it will not attempt to plan routes for a topology whose routing matrix is larger than this amount.", 5 },
+			{ "worker-threads", AcWorkerThreads, NULL, OPTION_ARG_OPTIONAL, "If specified, workers run as threads of the main process, each with its own active network namespace, rather than as separate processes. This avoids the cost of transferring work to other processes, but administrative privileges are no longer isolated from the parsing of the topology. This option is only accepted on the command line, not in the setup file.", 5 },
 
 			// File-specific options get priorities [50 - 99]
 
@@ -310,7 +358,14 @@ int main(int argc, char** argv) {
 			{ "units",        'u',          "{shadow,modelnet,KiB,Kb}", 0,                   "Specifies the bandwidth units used in the input file. Shadow uses KiB/s (the default), whereas ModelNet uses Kbit/s." },
 			{ "weight",       'w',          "KEY",                      0,                   "Edge parameter to use for computing shortest paths for static routes. Must be a key used in the GraphML file (default: \"latency\")." },
 			{ "client-node",  AcClientNode, "TYPE",                     0,                   "Type of client nodes. Nodes in the GraphML file whose \"type\" attribute matches this value will be clients. If omitted, all nodes are clients." },
-			{ "two-pass",     '2',          NULL,                       OPTION_ARG_OPTIONAL, "This option must be specified if the GraphML file does not place all <node> tags before all <edge> tags. This option doubles the data retrieved from disk." },
+			{ "two-pass",     '2',          NULL,                       OPTION_ARG_OPTIONAL, "This option must be specified if the GraphML file does not place all <node> tags before all <edge> tags. The file is still read only once, but the edges are buffered in memory until all nodes are known." },
+			{ "reduce",       AcReduce,     NULL,                       OPTION_ARG_OPTIONAL, "If specified, the topology is simplified before it is emulated. Links without latency, jitter, loss, or routing weight are removed by merging their endpoints, and chains of non-client nodes with exactly two neighbors are replaced by single links with the combined characteristics. This reduces the number of namespaces and links, but the removed nodes do not exist in the emulated network." },
+			{ "prune",        AcPrune,      NULL,                       OPTION_ARG_OPTIONAL, "If specified, nodes and links that are not part of a shortest path between two clients are not emulated. Traffic between clients follows the same routes, but the removed nodes do not exist in the emulated network. If several equally short paths exist, only one of them is kept." },
+			{ "default-routes", AcDefaultRoutes, NULL,                  OPTION_ARG_OPTIONAL, "If specified, each node forwards traffic through its most common next hop by default, and only the other destinations receive explicit routes. This greatly reduces the size of the routing tables, but packets for addresses that do not belong to any client are forwarded (until their TTL expires) rather than rejected." },
+			{ "client-order", AcClientOrder, "{id,tree}",               0,                   "Order in which client nodes receive adjacent subnets. \"id\" follows the order of the nodes in the GraphML file. \"tree\" groups clients that are close to each other in the topology, which allows more routes to be aggregated. Default: \"id\"." },
+			{ "route-cache",  AcRouteCache, "DIR",                      0,                   "Directory in which planned routes are cached. If a later run uses the same topology, weights, and clients, the routes are loaded from the cache instead of being planned again. By default, routes are not cached." },
+			{ "route-cache-size", AcRouteCacheSize, "MiB",              0,                   "Maximum size of the route cache, specified in MiB. The least recently used routes are removed to stay within this limit (default: 1024)." },
+			{ "update-weights", AcUpdateWeights, "FILE",                0,                   "Changes the routing weights of links in a network that was already set up with the same topology and configuration, and installs only the routes that changed. Each line of FILE contains the GraphML identifiers of the two nodes joined by a link, followed by its new weight (e.g., \"n1 n2 15.5\"); lines starting with '#' are ignored. Other link characteristics, such as latency, are not changed. Updates are recorded in the progress journal, so later updates build on them. Implies --resume, but fails if there is no network to update. Cannot be combined with --reduce or --prune." },
 			{ NULL },
 	};
 	struct argp_option defaultDoc[] = { { "\n These options provide program documentation:", 0, NULL, OPTION_DOC | OPTION_NO_USAGE }, { NULL } };
@@ -331,18 +386,38 @@ int main(int argc, char** argv) {
 	args.params.softMemCap = 2LL * 1024LL * 1024LL * 1024LL;
 	args.params.destroyOnly = false;
 	args.params.keepOldNetworks = false;
+	args.params.resume = false;
+	args.params.requireResume = false;
 	args.params.quiet = false;
 	args.params.rootIsInitNs = false;
+	args.params.workerThreads = false;
 	ip4GetSubnet(DEFAULT_CLIENTS_SUBNET, &args.params.edgeNodeDefaults.globalVSubnet);
 	args.gmlParams.bandwidthDivisor = ShadowDivisor;
 	args.gmlParams.weightKey = "latency";
-	args.gmlParams.twoPass = false;
+	args.gmlParams.unsorted = false;
+	args.gmlParams.reduceTopology = false;
+	args.gmlParams.pruneTopology = false;
+	args.gmlParams.defaultRoutes = false;
+	args.gmlParams.clientOrder = ClientOrderId;
+	args.gmlParams.routeCacheDir = NULL;
+	args.gmlParams.routeCacheSize = 1024LL * 1024LL * 1024LL;
+	args.gmlParams.weightUpdateFile = NULL;
 
 	int err = 0;
 
 	err = appParseArgs(&parseArg, &readSetupEdges, &argp, "emulator", NULL, 's', 'l', 'v', argc, argv);
 	if (err != 0) goto cleanup;
 
+	if (args.params.workerThreads && !workerThreads) {
+		lprintln(LogWarning, "The worker-threads option is only accepted on the command line; workers are running as processes");
+	}
+
+	if (args.gmlParams.weightUpdateFile != NULL) {
+		// Updates apply to the network recorded in the journal
+		args.params.resume = true;
+		args.params.requireResume = true;
+	}
+
 	lprintf(LogInfo, "Starting NetMirage Core %s\n", getVersion());
 
 	lprintln(LogInfo, "Loading edge node configuration");
@@ -356,8 +431,12 @@ int main(int argc, char** argv) {
 
 	if (err != 0) {
 		lprintf(LogError, "A fatal error occurred: code %d\n", err);
-		lprintln(LogWarning, "Attempting to destroy partially-constructed network");
-		destroyNetwork();
+		if (setupCanResume()) {
+			lprintln(LogWarning, "The partially-constructed network was kept. After fixing the problem, run the program again with --resume to continue the setup, or with --destroy to remove the network.");
+		} else {
+			lprintln(LogWarning, "Attempting to destroy partially-constructed network");
+			destroyNetwork();
+		}
 	} else {
 		lprintln(LogInfo, "All operations completed successfully");
 	}
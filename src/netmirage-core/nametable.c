@@ -0,0 +1,171 @@
+/*******************************************************************************
+ * Copyright © 2018 Nik Unger, Ian Goldberg, Qatar University, and the Qatar
+ * Foundation for Education, Science and Community Development.
+ *
+ * This file is part of NetMirage.
+ *
+ * NetMirage is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * NetMirage is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Affero General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with NetMirage. If not, see <http://www.gnu.org/licenses/>.
+ *******************************************************************************/
+#include "nametable.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mem.h"
+
+typedef struct {
+	uint32_t hash;
+	nodeId id; // INVALID_NODE_ID for empty slots
+} ntSlot;
+
+struct nameTable {
+	// Names are copied into blocks that are never moved or resized. The start
+	// of each block holds a pointer to the previous block.
+	char* block;
+	size_t blockUsed;
+	size_t blockSize;
+
+	const char** names; // Indexed by identifier
+	size_t nameCap;
+	nodeId nameCount;
+
+	ntSlot* slots;
+	size_t slotCount; // Always a power of 2
+};
+
+static const size_t BlockSize = 64 * 1024;
+static const size_t InitialSlots = 1024;
+
+// 32-bit FNV-1a
+static uint32_t ntHash(const char* name) {
+	uint32_t hash = 2166136261u;
+	for (const unsigned char* c = (const unsigned char*)name; *c != '\0'; ++c) {
+		hash ^= *c;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+static ntSlot* ntAllocSlots(size_t count) {
+	ntSlot* slots = eamalloc(count, sizeof(ntSlot), 0);
+	for (size_t i = 0; i < count; ++i) {
+		slots[i].id = INVALID_NODE_ID;
+	}
+	return slots;
+}
+
+nameTable* ntNewTable(void) {
+	nameTable* table = emalloc(sizeof(nameTable));
+	table->block = NULL;
+	table->blockUsed = 0;
+	table->blockSize = 0;
+	flexBufferInit((void**)&table->names, NULL, &table->nameCap);
+	table->nameCount = 0;
+	table->slotCount = InitialSlots;
+	table->slots = ntAllocSlots(table->slotCount);
+	return table;
+}
+
+void ntFreeTable(nameTable* table) {
+	while (table->block != NULL) {
+		char* prev;
+		memcpy(&prev, table->block, sizeof(char*));
+		free(table->block);
+		table->block = prev;
+	}
+	flexBufferFree((void**)&table->names, NULL, &table->nameCap);
+	free(table->slots);
+	free(table);
+}
+
+// Returns the slot containing the name, or the empty slot where it belongs
+static ntSlot* ntFindSlot(const nameTable* table, const char* name, uint32_t hash) {
+	size_t mask = table->slotCount - 1;
+	for (size_t i = hash & mask;; i = (i + 1) & mask) {
+		ntSlot* slot = &table->slots[i];
+		if (slot->id == INVALID_NODE_ID) return slot;
+		if (slot->hash == hash && strcmp(table->names[slot->id], name) == 0) return slot;
+	}
+}
+
+// Doubles the number of slots. The stored hashes avoid touching the names.
+static void ntGrowSlots(nameTable* table) {
+	size_t oldCount = table->slotCount;
+	ntSlot* oldSlots = table->slots;
+	emulSize(oldCount, 2, &table->slotCount);
+	table->slots = ntAllocSlots(table->slotCount);
+	size_t mask = table->slotCount - 1;
+	for (size_t i = 0; i < oldCount; ++i) {
+		if (oldSlots[i].id == INVALID_NODE_ID) continue;
+		size_t j = oldSlots[i].hash & mask;
+		while (table->slots[j].id != INVALID_NODE_ID) j = (j + 1) & mask;
+		table->slots[j] = oldSlots[i];
+	}
+	free(oldSlots);
+}
+
+static const char* ntCopyName(nameTable* table, const char* name) {
+	size_t len = strlen(name) + 1;
+	if (table->block == NULL || table->blockSize - table->blockUsed < len) {
+		size_t size = sizeof(char*) + len;
+		if (size < BlockSize) size = BlockSize;
+		char* block = emalloc(size);
+		memcpy(block, &table->block, sizeof(char*));
+		table->block = block;
+		table->blockUsed = sizeof(char*);
+		table->blockSize = size;
+	}
+	char* copy = &table->block[table->blockUsed];
+	memcpy(copy, name, len);
+	table->blockUsed += len;
+	return copy;
+}
+
+bool ntFind(const nameTable* table, const char* name, nodeId* id) {
+	ntSlot* slot = ntFindSlot(table, name, ntHash(name));
+	if (slot->id == INVALID_NODE_ID) return false;
+	*id = slot->id;
+	return true;
+}
+
+nodeId ntIntern(nameTable* table, const char* name, bool* added) {
+	uint32_t hash = ntHash(name);
+	ntSlot* slot = ntFindSlot(table, name, hash);
+	if (slot->id != INVALID_NODE_ID) {
+		*added = false;
+		return slot->id;
+	}
+	if (table->nameCount >= MAX_NODE_ID) abort();
+
+	// Keep the load factor at or below 1/2
+	if (((size_t)table->nameCount + 1) * 2 > table->slotCount) {
+		ntGrowSlots(table);
+		slot = ntFindSlot(table, name, hash);
+	}
+
+	nodeId id = table->nameCount++;
+	const char* copy = ntCopyName(table, name);
+	flexBufferGrow((void**)&table->names, id, &table->nameCap, 1, sizeof(const char*));
+	table->names[id] = copy;
+	slot->hash = hash;
+	slot->id = id;
+	*added = true;
+	return id;
+}
+
+const char* ntName(const nameTable* table, nodeId id) {
+	return table->names[id];
+}
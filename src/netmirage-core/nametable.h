@@ -0,0 +1,47 @@
+/*******************************************************************************
+ * Copyright © 2018 Nik Unger, Ian Goldberg, Qatar University, and the Qatar
+ * Foundation for Education, Science and Community Development.
+ *
+ * This file is part of NetMirage.
+ *
+ * NetMirage is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * NetMirage is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Affero General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with NetMirage. If not, see <http://www.gnu.org/licenses/>.
+ *******************************************************************************/
+#pragma once
+
+// This module maps the string names of nodes in a topology file to compact
+// node identifiers. Names are copied into large, bump-allocated blocks and
+// indexed by a flat open-addressing hash table, which keeps the per-name
+// overhead small for topologies with millions of nodes.
+
+#include <stdbool.h>
+
+#include "topology.h"
+
+typedef struct nameTable nameTable;
+
+nameTable* ntNewTable(void);
+void ntFreeTable(nameTable* table);
+
+// Looks up the identifier for a name. Returns true if the name is known, in
+// which case id is set. Otherwise, returns false.
+bool ntFind(const nameTable* table, const char* name, nodeId* id);
+
+// Returns the identifier for a name. If the name is not known yet, it is
+// assigned the next identifier in sequence (starting from 0) and added is set
+// to true. Otherwise, added is set to false.
+nodeId ntIntern(nameTable* table, const char* name, bool* added);
+
+// Returns the name associated with an identifier. The string remains valid
+// until the table is freed.
+const char* ntName(const nameTable* table, nodeId id);
@@ -0,0 +1,52 @@
+/*******************************************************************************
+ * Copyright © 2018 Nik Unger, Ian Goldberg, Qatar University, and the Qatar
+ * Foundation for Education, Science and Community Development.
+ *
+ * This file is part of NetMirage.
+ *
+ * NetMirage is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * NetMirage is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Affero General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with NetMirage. If not, see <http://www.gnu.org/licenses/>.
+ *******************************************************************************/
+
+#include "nodeheap.h"
+
+#include <stdbool.h>
+
+#include "mem.h"
+
+void nhPush(nhEntry** heap, size_t* len, size_t* cap, float dist, nodeId id) {
+	flexBufferGrow((void**)heap, *len, cap, 1, sizeof(nhEntry));
+	nhEntry* h = *heap;
+	size_t i = (*len)++;
+	while (i > 0 && h[(i-1)/2].dist > dist) {
+		h[i] = h[(i-1)/2];
+		i = (i-1)/2;
+	}
+	h[i].dist = dist;
+	h[i].id = id;
+}
+
+void nhPop(nhEntry* heap, size_t* len, nhEntry* top) {
+	*top = heap[0];
+	nhEntry last = heap[--(*len)];
+	size_t i = 0;
+	while (true) {
+		size_t child = 2*i+1;
+		if (child >= *len) break;
+		if (child+1 < *len && heap[child+1].dist < heap[child].dist) ++child;
+		if (heap[child].dist >= last.dist) break;
+		heap[i] = heap[child];
+		i = child;
+	}
+	if (*len > 0) heap[i] = last;
+}
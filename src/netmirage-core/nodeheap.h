@@ -0,0 +1,41 @@
+/*******************************************************************************
+ * Copyright © 2018 Nik Unger, Ian Goldberg, Qatar University, and the Qatar
+ * Foundation for Education, Science and Community Development.
+ *
+ * This file is part of NetMirage.
+ *
+ * NetMirage is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * NetMirage is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Affero General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with NetMirage. If not, see <http://www.gnu.org/licenses/>.
+ *******************************************************************************/
+#pragma once
+
+// This module implements the binary min-heap of nodes keyed by distance that is
+// used by the shortest path searches. The heap is stored in a flexBuffer owned
+// by the caller, so it can be reused across searches by resetting its length.
+
+#include <stddef.h>
+
+#include "topology.h"
+
+typedef struct {
+	float dist;
+	nodeId id;
+} nhEntry;
+
+// Adds a node to the heap, growing the buffer if necessary. Nodes may be added
+// more than once; callers skip the stale entries when they are popped.
+void nhPush(nhEntry** heap, size_t* len, size_t* cap, float dist, nodeId id);
+
+// Removes the entry with the smallest distance and stores it in top. The heap
+// must not be empty.
+void nhPop(nhEntry* heap, size_t* len, nhEntry* top);
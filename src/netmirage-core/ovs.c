@@ -29,6 +29,7 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <fcntl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
@@ -88,10 +89,20 @@ static int ovsCommandVArg(char** output, size_t* outputLen, size_t* outputCap, c
 	lprintDirectf(LogDebug, "\n");
 	lprintDirectFinish(LogDebug);
 
+	// The child environment is prepared before forking because the child of a
+	// multithreaded process may not allocate memory
+	char* envp[] = { NULL, NULL };
+	if (dir != NULL) {
+		newSprintf(&envp[0], "OVS_RUNDIR=%s", dir);
+	}
+
+	// The pipe is close-on-exec so that commands executed concurrently by other
+	// threads do not inherit (and hold open) our end of it
 	int pipefd[2];
 	errno = 0;
-	if (pipe(pipefd) != 0) {
+	if (pipe2(pipefd, O_CLOEXEC) != 0) {
 		lprintf(LogError, "Failed to create pipe for Open vSwitch command: %s\n", strerror(errno));
+		free(envp[0]);
 		return errno;
 	}
 
@@ -99,32 +110,31 @@ static int ovsCommandVArg(char** output, size_t* outputLen, size_t* outputCap, c
 	pid_t pid = fork();
 	if (pid == -1) {
 		lprintf(LogError, "Failed to fork to execute Open vSwitch command: %s\n", strerror(errno));
+		close(pipefd[0]);
+		close(pipefd[1]);
+		free(envp[0]);
 		return errno;
 	}
 	if (pid == 0) { // Child
 		if (dir != NULL) {
 			errno = 0;
-			if (chdir(dir) != 0) exit(errno);
+			if (chdir(dir) != 0) _exit(errno);
 		}
 
 		close(pipefd[0]);
 		close(STDIN_FILENO);
 		errno = 0;
-		if (dup2(pipefd[1], STDOUT_FILENO) == -1) exit(errno);
+		if (dup2(pipefd[1], STDOUT_FILENO) == -1) _exit(errno);
 		errno = 0;
-		if (dup2(pipefd[1], STDERR_FILENO) == -1) exit(errno);
+		if (dup2(pipefd[1], STDERR_FILENO) == -1) _exit(errno);
 
 		close(pipefd[1]);
 
-		char* envp[] = { NULL, NULL };
-		if (dir != NULL) {
-			newSprintf(&envp[0], "OVS_RUNDIR=%s", dir);
-		}
-
 		errno = 0;
 		execvpe(command, (char**)argv, envp);
-		exit(errno);
+		_exit(errno);
 	}
+	free(envp[0]);
 	close(pipefd[1]);
 
 	int readErr = 0;
@@ -272,7 +282,7 @@ static int ovsModuleLoad(void) {
 			fclose(stderr);
 			errno = 0;
 			execlp("modprobe", "modprobe", LKM_OVS_NAME, NULL);
-			exit(errno);
+			_exit(errno);
 		}
 		int probeStatus;
 		waitpid(probePid, &probeStatus, 0);
@@ -450,12 +460,12 @@ int ovsSetBridgeMtu(ovsContext* ctx, const char* bridge, int mtu) {
 	return err;
 }
 
-int ovsAddPort(ovsContext* ctx, const char* bridge, const char* intfName) {
+int ovsAddPort(ovsContext* ctx, const char* bridge, const char* intfName, bool mayExist) {
 	int err = switchContext(ctx);
 	if (err != 0) return err;
 
 	lprintf(LogDebug, "Adding interface '%s' to Open vSwitch bridge '%s' in context %p\n", intfName, bridge, ctx);
-	err = ovsCommand(ctx->directory, "ovs-vsctl", ctx->compatArgs, ctx->dbSocketConnArg, "add-port", bridge, intfName, NULL);
+	err = ovsCommand(ctx->directory, "ovs-vsctl", ctx->compatArgs, ctx->dbSocketConnArg, (mayExist ? "--may-exist" : ""), "add-port", bridge, intfName, NULL);
 	if (err != 0) return err;
 
 	return 0;
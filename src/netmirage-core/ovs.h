@@ -65,10 +65,10 @@ int ovsDelBridge(ovsContext* ctx, const char* name);
 // Sets the MTU for a bridge. Returns 0 on success or an error code otherwise.
 int ovsSetBridgeMtu(ovsContext* ctx, const char* bridge, int mtu);
 
-// Adds a port to the bridge in the given Open vSwitch instance. If portId is
-// not NULL, it is set to the new port index. Returns 0 on success or an error
-// code otherwise.
-int ovsAddPort(ovsContext* ctx, const char* bridge, const char* intfName);
+// Adds a port to the bridge in the given Open vSwitch instance. If mayExist is
+// true, it is not an error if the port was already added. Returns 0 on success
+// or an error code otherwise.
+int ovsAddPort(ovsContext* ctx, const char* bridge, const char* intfName, bool mayExist);
 
 // Deletes all flows in a bridge. All traffic will be silently dropped. Returns
 // 0 on success or an error code otherwise.
@@ -0,0 +1,289 @@
+/*******************************************************************************
+ * Copyright © 2018 Nik Unger, Ian Goldberg, Qatar University, and the Qatar
+ * Foundation for Education, Science and Community Development.
+ *
+ * This file is part of NetMirage.
+ *
+ * NetMirage is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * NetMirage is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Affero General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with NetMirage. If not, see <http://www.gnu.org/licenses/>.
+ *******************************************************************************/
+#define _GNU_SOURCE // Needed for futimens and st_mtim
+
+#include "routecache.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "mem.h"
+
+#define RC_MAGIC "NMROUTE2"
+#define RC_SUFFIX ".routes"
+#define RC_TEMP_SUFFIX ".tmp"
+
+// Entries consist of this header followed by the next hop columns
+typedef struct {
+	char magic[8];
+	uint64_t key;
+	uint64_t check;
+	uint32_t nodeCount;
+	uint32_t destCount;
+	uint32_t hopSize;
+	uint32_t reserved;
+} rcHeader;
+
+typedef struct {
+	char* path;
+	uint64_t size;
+	struct timespec used;
+	bool temp; // Entry that another run is still writing
+} rcEntry;
+
+void rcKeyInit(rcKey* key) {
+	key->key = UINT64_C(14695981039346656037);
+	key->check = 0;
+}
+
+void rcMixKey(rcKey* key, const void* data, size_t len) {
+	// The key is a 64-bit FNV-1a hash. The check uses an unrelated
+	// multiplicative hash, so a collision in one is not a collision in both.
+	uint64_t hash = key->key;
+	uint64_t check = key->check;
+	for (const unsigned char* c = data; len > 0; ++c, --len) {
+		hash ^= *c;
+		hash *= UINT64_C(1099511628211);
+		check = (check + *c + 1) * UINT64_C(0x9E3779B97F4A7C15);
+		check ^= check >> 29;
+	}
+	key->key = hash;
+	key->check = check;
+}
+
+static void rcEntryPath(char** path, const char* dir, uint64_t key) {
+	newSprintf(path, "%s/%016lx" RC_SUFFIX, dir, key);
+}
+
+static size_t rcEntrySize(nodeId nodeCount, nodeId destCount) {
+	size_t size;
+	emulSize((size_t)nodeCount, (size_t)destCount, &size);
+	emulSize(size, sizeof(nodeId), &size);
+	eaddSize(size, sizeof(rcHeader), &size);
+	return size;
+}
+
+int rcLoad(const char* dir, const rcKey* key, nodeId nodeCount, nodeId destCount, const nodeId** nextHops) {
+	char* path;
+	rcEntryPath(&path, dir, key->key);
+	size_t size = rcEntrySize(nodeCount, destCount);
+
+	int err = 0;
+	void* map = MAP_FAILED;
+	errno = 0;
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		err = errno;
+		if (err != ENOENT) lprintf(LogWarning, "Could not open cached routes '%s': %s\n", path, strerror(err));
+		goto cleanup;
+	}
+
+	struct stat info;
+	if (fstat(fd, &info) != 0 || (uint64_t)info.st_size != size) {
+		lprintf(LogWarning, "Cached routes '%s' have the wrong size; ignoring them\n", path);
+		err = EINVAL;
+		goto cleanup;
+	}
+	map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) {
+		err = errno;
+		lprintf(LogWarning, "Could not map cached routes '%s': %s\n", path, strerror(err));
+		goto cleanup;
+	}
+
+	const rcHeader* header = map;
+	if (memcmp(header->magic, RC_MAGIC, sizeof(header->magic)) != 0 || header->key != key->key || header->check != key->check || header->nodeCount != nodeCount || header->destCount != destCount || header->hopSize != sizeof(nodeId)) {
+		lprintf(LogWarning, "Cached routes '%s' do not match the topology; ignoring them\n", path);
+		err = EINVAL;
+		goto cleanup;
+	}
+
+	// Make sure that a damaged file cannot lead us outside of the topology
+	const nodeId* hops = (const nodeId*)&header[1];
+	size_t hopCount = (size - sizeof(rcHeader)) / sizeof(nodeId);
+	for (size_t i = 0; i < hopCount; ++i) {
+		if (hops[i] >= nodeCount && hops[i] != INVALID_NODE_ID) {
+			lprintf(LogWarning, "Cached routes '%s' are corrupt; ignoring them\n", path);
+			err = EINVAL;
+			goto cleanup;
+		}
+	}
+
+	// Record the use for the eviction policy
+	futimens(fd, NULL);
+	*nextHops = hops;
+	map = MAP_FAILED;
+	lprintf(LogDebug, "Loaded cached routes from '%s'\n", path);
+
+cleanup:
+	if (map != MAP_FAILED) munmap(map, size);
+	if (fd != -1) close(fd);
+	free(path);
+	return err;
+}
+
+void rcRelease(const nodeId* nextHops, nodeId nodeCount, nodeId destCount) {
+	const rcHeader* header = (const rcHeader*)nextHops - 1;
+	munmap((void*)(uintptr_t)header, rcEntrySize(nodeCount, destCount));
+}
+
+static int rcCompareUse(const void* a, const void* b) {
+	const struct timespec* ta = &((const rcEntry*)a)->used;
+	const struct timespec* tb = &((const rcEntry*)b)->used;
+	if (ta->tv_sec != tb->tv_sec) return (ta->tv_sec < tb->tv_sec ? -1 : 1);
+	if (ta->tv_nsec != tb->tv_nsec) return (ta->tv_nsec < tb->tv_nsec ? -1 : 1);
+	return 0;
+}
+
+static bool rcHasSuffix(const char* name, const char* suffix) {
+	size_t nameLen = strlen(name);
+	size_t suffixLen = strlen(suffix);
+	return nameLen > suffixLen && strcmp(&name[nameLen - suffixLen], suffix) == 0;
+}
+
+// Returns true if a temporary file was left behind by a run that no longer
+// exists. The name of a temporary file contains the ID of its writer.
+static bool rcIsStaleTemp(const char* name) {
+	const char* pidStart = strstr(name, RC_SUFFIX ".");
+	if (pidStart == NULL) return false;
+	char* pidEnd;
+	long pid = strtol(&pidStart[strlen(RC_SUFFIX ".")], &pidEnd, 10);
+	if (pid <= 0 || strcmp(pidEnd, RC_TEMP_SUFFIX) != 0) return false;
+	errno = 0;
+	return kill((pid_t)pid, 0) != 0 && errno == ESRCH;
+}
+
+// Deletes the least recently used entries until the cache fits within maxSize
+// bytes. The entry at keepPath is never deleted. Temporary files left behind by
+// crashed runs are deleted, and those still being written count toward the
+// size.
+static void rcEvict(const char* dir, uint64_t maxSize, const char* keepPath) {
+	DIR* dirHandle = opendir(dir);
+	if (dirHandle == NULL) return;
+
+	rcEntry* entries;
+	size_t entryCount, entryCap;
+	flexBufferInit((void**)&entries, &entryCount, &entryCap);
+	uint64_t totalSize = 0;
+
+	struct dirent* dirEntry;
+	while ((dirEntry = readdir(dirHandle)) != NULL) {
+		rcEntry entry;
+		entry.temp = rcHasSuffix(dirEntry->d_name, RC_TEMP_SUFFIX);
+		if (!entry.temp && !rcHasSuffix(dirEntry->d_name, RC_SUFFIX)) continue;
+
+		newSprintf(&entry.path, "%s/%s", dir, dirEntry->d_name);
+		if (entry.temp && rcIsStaleTemp(dirEntry->d_name)) {
+			if (unlink(entry.path) == 0) lprintf(LogDebug, "Deleted stale cache file '%s'\n", entry.path);
+			free(entry.path);
+			continue;
+		}
+		struct stat info;
+		if (stat(entry.path, &info) != 0) {
+			free(entry.path);
+			continue;
+		}
+		entry.size = (uint64_t)info.st_size;
+		entry.used = info.st_mtim;
+		totalSize += entry.size;
+		flexBufferGrow((void**)&entries, entryCount, &entryCap, 1, sizeof(rcEntry));
+		flexBufferAppend(entries, &entryCount, &entry, 1, sizeof(rcEntry));
+	}
+	closedir(dirHandle);
+
+	qsort(entries, entryCount, sizeof(rcEntry), &rcCompareUse);
+	for (size_t i = 0; i < entryCount && totalSize > maxSize; ++i) {
+		if (entries[i].temp || strcmp(entries[i].path, keepPath) == 0) continue;
+		if (unlink(entries[i].path) == 0) {
+			lprintf(LogDebug, "Evicted cached routes '%s'\n", entries[i].path);
+			totalSize -= entries[i].size;
+		}
+	}
+
+	for (size_t i = 0; i < entryCount; ++i) {
+		free(entries[i].path);
+	}
+	flexBufferFree((void**)&entries, &entryCount, &entryCap);
+}
+
+int rcStore(const char* dir, const rcKey* key, nodeId nodeCount, nodeId destCount, const nodeId* nextHops, uint64_t maxSize) {
+	size_t size = rcEntrySize(nodeCount, destCount);
+	if (size > maxSize) {
+		lprintf(LogInfo, "The planned routes (%lu MiB) are larger than the route cache limit, so they are not cached\n", size / 1024 / 1024);
+		return 0;
+	}
+
+	errno = 0;
+	if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+		int err = errno;
+		lprintf(LogWarning, "Could not create the route cache directory '%s': %s\n", dir, strerror(err));
+		return err;
+	}
+
+	char* path;
+	char* tempPath;
+	rcEntryPath(&path, dir, key->key);
+	newSprintf(&tempPath, "%s.%d" RC_TEMP_SUFFIX, path, (int)getpid());
+
+	// Entries are written to a temporary file and then renamed, so other runs
+	// never observe partial entries
+	rcHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, RC_MAGIC, sizeof(header.magic));
+	header.key = key->key;
+	header.check = key->check;
+	header.nodeCount = nodeCount;
+	header.destCount = destCount;
+	header.hopSize = sizeof(nodeId);
+
+	int err = 0;
+	size_t hopCount = (size - sizeof(rcHeader)) / sizeof(nodeId);
+	errno = 0;
+	FILE* file = fopen(tempPath, "we");
+	if (file == NULL ||
+	    fwrite(&header, sizeof(header), 1, file) != 1 ||
+	    fwrite(nextHops, sizeof(nodeId), hopCount, file) != hopCount) {
+		err = (errno != 0 ? errno : EIO);
+	}
+	if (file != NULL && fclose(file) != 0 && err == 0) err = errno;
+	if (err == 0 && rename(tempPath, path) != 0) err = errno;
+	if (err != 0) {
+		lprintf(LogWarning, "Could not write cached routes '%s': %s\n", path, strerror(err));
+		unlink(tempPath);
+	} else {
+		lprintf(LogDebug, "Stored planned routes in '%s'\n", path);
+		rcEvict(dir, maxSize, path);
+	}
+
+	free(tempPath);
+	free(path);
+	return err;
+}
@@ -0,0 +1,59 @@
+/*******************************************************************************
+ * Copyright © 2018 Nik Unger, Ian Goldberg, Qatar University, and the Qatar
+ * Foundation for Education, Science and Community Development.
+ *
+ * This file is part of NetMirage.
+ *
+ * NetMirage is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * NetMirage is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Affero General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with NetMirage. If not, see <http://www.gnu.org/licenses/>.
+ *******************************************************************************/
+#pragma once
+
+// This module stores planned routes on disk so that later runs with the same
+// topology can reuse them. Each entry holds the next hops toward a set of
+// destinations, identified by a key that the caller derives from the planner
+// inputs. Entries are memory-mapped when loaded. The total size of the cache is
+// bounded by evicting the least recently used entries.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "topology.h"
+
+// Identifies a cache entry. The key names the entry, and the check is an
+// independent hash of the same inputs that guards against key collisions.
+typedef struct {
+	uint64_t key;
+	uint64_t check;
+} rcKey;
+
+// Initializes a key before data is mixed into it with rcMixKey
+void rcKeyInit(rcKey* key);
+
+// Mixes data into a cache key
+void rcMixKey(rcKey* key, const void* data, size_t len);
+
+// Looks up an entry in the cache directory. On success, nextHops points to
+// destCount columns of nodeCount next hops (in the same layout passed to
+// rcStore), which must be released with rcRelease. Returns 0 if the entry was
+// found, ENOENT if it was not, or another error code if the entry could not be
+// read or its check does not match.
+int rcLoad(const char* dir, const rcKey* key, nodeId nodeCount, nodeId destCount, const nodeId** nextHops);
+
+// Releases an entry loaded with rcLoad
+void rcRelease(const nodeId* nextHops, nodeId nodeCount, nodeId destCount);
+
+// Stores an entry in the cache directory, which is created if needed. Older
+// entries are evicted until the cache fits within maxSize bytes. Returns 0 on
+// success or an error code otherwise.
+int rcStore(const char* dir, const rcKey* key, nodeId nodeCount, nodeId destCount, const nodeId* nextHops, uint64_t maxSize);
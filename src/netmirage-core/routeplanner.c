@@ -19,16 +19,41 @@
  *******************************************************************************/
 #include "routeplanner.h"
 
+#include <errno.h>
 #include <math.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <glib.h>
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define RP_X86_KERNELS
+#include <immintrin.h>
+#endif
+
 #include "log.h"
 #include "mem.h"
+#include "nodeheap.h"
+#include "routecache.h"
 
-/* We use the Floyd-Warshall algorithm (with edge reconstruction) for APSP. We
+/* Routes are only ever requested toward a set of destinations (usually the
+ * clients). The planner records the link weights and selects one of two
+ * algorithms when planning begins:
+ * - Floyd-Warshall computes routes between all pairs of nodes. Its cost is
+ *   O(n^3) time and O(n^2) memory regardless of the number of destinations.
+ * - Dijkstra's algorithm is run once per destination on the reversed graph,
+ *   yielding the shortest path tree toward that destination. The searches are
+ *   independent, so they run in parallel. Only the next hops toward the
+ *   destinations are stored, for O(n*d) memory. This is much faster when there
+ *   are few destinations or the graph is sparse.
+ * We use the estimated cheaper algorithm that fits within the memory limit.
+ * Both produce shortest paths, but they may choose different paths among
+ * equally short ones. If a route cache is configured, the next hops toward the
+ * destinations are stored on disk, keyed by a hash of the planner inputs, and
+ * later plannings with the same inputs load them instead.
+ *
+ * We use the Floyd-Warshall algorithm (with edge reconstruction) for APSP. We
  * accept a loss of precision by using floats instead of doubles; this reduces
  * the memory requirements by half (due to padding).
  *
@@ -84,213 +109,442 @@
  * This pattern helps to improve cache performance as the matrix is processed.
  * We refer to this layout as "block order".
  *
- * This implementation is not perfect. There are several known techniques for
- * improving its performance, should that prove necessary:
- * 1) Use SIMD instructions for the core Floyd-Warshall comparison step. This
- *    likely means SSE or AVX intrinsics. This approach would necessitate
- *    storing the weights and "next" identifiers for multiple cells
- *    sequentially (e.g., struct { float weights[8]; nodeId nexts[8]; }; ). This
- *    would complicate cell storage further, but would likely improve
- *    performance.
- * 2) Use hierarchical tiling and ZMorton storage order, such as described by
- *    Park, Penner, and Prasanna in "Optimizing Graph Algorithms for Improved
- *    Cache Performance".
+ * Within a block, each row of cells is stored as a "cell row": the B weights
+ * are stored sequentially, followed by the B "next" identifiers. This allows
+ * the core Floyd-Warshall comparison step to update an entire cell row at once
+ * using SIMD instructions. Since the instructions available depend on the CPU,
+ * the block processing kernel is selected at runtime. Offsets within the matrix
+ * are still expressed in cells; cell row i of a block starting at cell offset o
+ * is at index o/B + i in the cell row array.
+ *
+ * This implementation is not perfect. One known technique for improving its
+ * performance, should that prove necessary, is to use hierarchical tiling and
+ * ZMorton storage order, such as described by Park, Penner, and Prasanna in
+ * "Optimizing Graph Algorithms for Improved Cache Performance".
  */
 
+#define BLOCK_SIZE 16
+
 typedef struct {
-	float weight;
-	nodeId next;
-} edgeInfo;
+	float weights[BLOCK_SIZE];
+	nodeId nexts[BLOCK_SIZE];
+} cellRow;
+
+// A pointer to a function that completely processes a single block of cells in
+// the current thread. The arguments are the cell offsets of the blocks.
+typedef void (*rpProcessBlockFunc)(cellRow* rows, size_t ijBlockStart, size_t ikBlockStart, size_t kjBlockStart);
 
+// Cell offsets grow with the square of the node count, so they are stored as
+// size_t values. Counts of blocks always fit in a nodeId.
 typedef struct {
-	edgeInfo* edges;
-	nodeId blockRowSize;
+	cellRow* rows;
+	rpProcessBlockFunc processBlock;
+	size_t blockRowSize;
 	nodeId rangeRows;
 	nodeId rangeCols;
-	nodeId ijBlock;
-	nodeId ikBlock;
-	nodeId kjBlock;
+	size_t ijBlock;
+	size_t ikBlock;
+	size_t kjBlock;
 
 	GMutex* todoLock;
 	GCond* finished;
-	nodeId todoCount;
+	size_t todoCount;
 } rpWorkRange;
 
 typedef struct {
 	rpWorkRange* range;
-	nodeId startIndex;
+	size_t startIndex;
 } rpWorkUnit;
 
+// A link weight set with rpSetWeight
+typedef struct {
+	nodeId from;
+	nodeId to;
+	float weight;
+} rpLink;
+
+typedef enum {
+	PlanNone,
+	PlanFloydWarshall,
+	PlanDijkstra,
+	PlanCached,
+} rpAlgorithm;
+
+// A graph in compressed sparse row form. The neighbors of node i are adj[start[i]]
+// to adj[start[i+1]-1], reached through links with the corresponding weights.
+typedef struct {
+	size_t* start;
+	nodeId* adj;
+	float* weight;
+} rpGraph;
+
+// A range of destinations processed by one thread during Dijkstra planning.
+// The unit handles dests[first], dests[first+stride], etc., and writes the next
+// hops toward dests[i] to column i of columns. If preferOld is set, ties are
+// broken in favor of the currently planned next hops.
+typedef struct {
+	routePlanner* planner;
+	nodeId first;
+	nodeId stride;
+	const nodeId* dests;
+	nodeId destCount;
+	nodeId* columns;
+	bool preferOld;
+} rpDijkstraUnit;
+
 struct routePlanner {
-	edgeInfo* edges;
 	nodeId nodeCount;
+	uint64_t memLimit;
+
+	// Link weights in the order in which the links were first set. linkIndex is
+	// an open addressing hash table keyed by the endpoints of the links, with
+	// linkIndexCap slots (a power of two). Each slot contains the index of a
+	// link plus one, or 0 if the slot is empty.
+	rpLink* links;
+	size_t linkCount;
+	size_t linkCap;
+	size_t* linkIndex;
+	size_t linkIndexCap;
+
+	// Destinations registered with rpAddDestination. destIndex maps node
+	// identifiers to destination indices, or INVALID_NODE_ID.
+	nodeId* destIndex;
+	nodeId destCount;
 
-	nodeId* pathBuffer;
-	size_t pathBufferCap;
+	rpAlgorithm algorithm; // Algorithm used by the last planning
+
+	// Route cache settings. cacheDir is NULL if caching is disabled.
+	const char* cacheDir;
+	uint64_t cacheSize;
+
+	// Floyd-Warshall state. The matrix covers paddedCount nodes, which is the
+	// node count rounded up to a multiple of BlockSize.
+	cellRow* rows;
+	nodeId paddedCount;
+	rpProcessBlockFunc processBlock;
+
+	// Dijkstra state. nextHops contains one column of nodeCount entries per
+	// destination. The graph is stored in reverse, so the neighbors of a node
+	// are the sources of the links entering it.
+	nodeId* nextHops;
+	const nodeId* columns; // Next hop columns used for lookups (Dijkstra or cache)
+	rpGraph reverse;
 
 	GThreadPool* pool;
 	rpWorkUnit* units;
 	size_t unitsCap;
+	rpDijkstraUnit* dijkstraUnits;
 
 	GMutex todoLock;
 	GCond finished;
+	size_t todoCount;
+
+	GThread* planThread; // Background planning thread, if running
+	int planResult;
 };
 
 // These values were empirically selected with guidance from the literature
-static const nodeId BlockSize = 16;
-static const nodeId BlockArea = 16 * 16;
+static const nodeId BlockSize = BLOCK_SIZE;
+static const nodeId BlockArea = BLOCK_SIZE * BLOCK_SIZE;
 static const nodeId ThreadedThresholdNodes = 1024;
 static const nodeId ThreadWorkSize = 8;
 
-static edgeInfo* rpEdgePtr(routePlanner* planner, nodeId from, nodeId to) {
+// Approximate cost of one Dijkstra edge relaxation (including its share of heap
+// operations) relative to one vectorized Floyd-Warshall cell update. This was
+// measured on graphs with a few thousand nodes.
+static const double DijkstraCostFactor = 8.0;
+
+// Returns the cell row containing the edge between two nodes. The column of the
+// edge within the cell row is stored in col.
+static cellRow* rpCellRowPtr(routePlanner* planner, nodeId from, nodeId to, nodeId* col) {
 	nodeId fromBlock = from / BlockSize;
 	nodeId toBlock = to / BlockSize;
 	nodeId row = from % BlockSize;
-	nodeId col = to % BlockSize;
-	nodeId blockRowSize = planner->nodeCount * BlockSize;
-	size_t index = (fromBlock * blockRowSize) + (toBlock * BlockArea) + (row * BlockSize) + col;
-	return &planner->edges[index];
+	*col = to % BlockSize;
+	size_t index = ((size_t)fromBlock * planner->paddedCount) + ((size_t)toBlock * BlockSize) + row;
+	return &planner->rows[index];
 }
 
-routePlanner* rpNewPlanner(nodeId nodeCount) {
-	lprintf(LogDebug, "Created a new route planner for %u nodes\n", nodeCount);
+// Returns the number of bytes needed for the Floyd-Warshall matrix
+static uint64_t rpFloydWarshallMemory(nodeId nodeCount) {
+	uint64_t paddedCount = ((uint64_t)nodeCount + BlockSize - 1) / BlockSize * BlockSize;
+	return paddedCount * paddedCount / BlockSize * sizeof(cellRow);
+}
 
-	/* We force the number of nodes to be a multiple of the block size. This
-	 * trades memory for performance.
-	 * Disadvantages:
-	 * - We waste memory. In the worst case, we lose:
-	 *   (2*nodeCount - BlockSize + 1) * (BlockSize -1) * 8 bytes
-	 * - O(nodeCount) additional operations required when pathfinding
-	 * - Less cache reuse between the end of a row and the start of the next
-	 * Advantages:
-	 * - O(nodeCount^2) fewer special-case tests (with good branch prediction)
-	 * - We use O(nodeCount^2) space and O(nodeCount^3) time, so the
-	 *   disadvantages are negligible
-	 */
-	nodeId blocks = (nodeCount + BlockSize - 1) / BlockSize;
-	nodeCount = blocks * BlockSize;
-	lprintf(LogDebug, "Node count was set to %u for block alignment\n", nodeCount);
+// Returns the number of bytes needed for the Dijkstra next hop columns, which
+// dominate the memory use of that algorithm
+static uint64_t rpDijkstraMemory(nodeId nodeCount, nodeId destCount) {
+	return (uint64_t)nodeCount * destCount * sizeof(nodeId);
+}
 
-	routePlanner* planner = malloc(sizeof(routePlanner));
-	planner->nodeCount = nodeCount;
+routePlanner* rpNewPlanner(nodeId nodeCount, nodeId expectedDests, uint64_t memLimit) {
+	lprintf(LogDebug, "Created a new route planner for %u nodes\n", nodeCount);
 
-	nodeId cellCount;
-	emul32(nodeCount, nodeCount, &cellCount);
-	planner->edges = eamalloc(cellCount, sizeof(edgeInfo), 0);
+	// The routes dominate the memory use of the program, so we make sure that
+	// one of the algorithms fits before we commit to planning
+	uint64_t fwMemory = rpFloydWarshallMemory(nodeCount);
+	uint64_t dijkstraMemory = rpDijkstraMemory(nodeCount, expectedDests);
+	if (fwMemory > memLimit && dijkstraMemory > memLimit) {
+		uint64_t needed = (fwMemory < dijkstraMemory ? fwMemory : dijkstraMemory);
+		lprintf(LogError, "Planning routes for %u nodes and %u destinations requires %lu MiB of memory, but the memory limit is %lu MiB. Increase the limit with --mem, or reduce the size of the topology.\n", nodeCount, expectedDests, needed / 1024 / 1024, memLimit / 1024 / 1024);
+		return NULL;
+	}
 
-	// Set initial weights and "next" identifiers. We traverse the edges in
-	// array order, which makes it somewhat difficult to efficiently compute the
-	// global column numbers.
-	edgeInfo* edge = planner->edges;
-	for (nodeId blockRow = 0; blockRow < blocks; ++blockRow) {
-		nodeId colOffset = 0;
-		for (nodeId blockCol = 0; blockCol < blocks; ++blockCol) {
-			for (nodeId row = 0; row < BlockSize; ++row) {
-				for (nodeId col = 0; col < BlockSize; ++col) {
-					edge->weight = INFINITY;
-					edge->next = colOffset + col;
-					++edge;
-				}
-			}
-			colOffset += BlockSize;
-		}
+	routePlanner* planner = emalloc(sizeof(routePlanner));
+	planner->nodeCount = nodeCount;
+	planner->memLimit = memLimit;
+	flexBufferInit((void**)&planner->links, &planner->linkCount, &planner->linkCap);
+	planner->linkIndex = NULL;
+	planner->linkIndexCap = 0;
+	planner->destIndex = eamalloc(nodeCount, sizeof(nodeId), 0);
+	for (nodeId id = 0; id < nodeCount; ++id) {
+		planner->destIndex[id] = INVALID_NODE_ID;
 	}
+	planner->destCount = 0;
+	planner->algorithm = PlanNone;
+	planner->cacheDir = NULL;
+	planner->cacheSize = 0;
+	planner->rows = NULL;
+	planner->paddedCount = 0;
+	planner->nextHops = NULL;
+	planner->columns = NULL;
+	planner->reverse.start = NULL;
+	planner->reverse.adj = NULL;
+	planner->reverse.weight = NULL;
+	planner->pool = NULL;
+	planner->dijkstraUnits = NULL;
 
-	flexBufferInit((void**)&planner->pathBuffer, NULL, &planner->pathBufferCap);
 	flexBufferInit((void**)&planner->units, NULL, &planner->unitsCap);
+	planner->planThread = NULL;
 
 	return planner;
 }
 
+static void rpFreeGraph(rpGraph* graph) {
+	free(graph->start);
+	free(graph->adj);
+	free(graph->weight);
+	graph->start = NULL;
+	graph->adj = NULL;
+	graph->weight = NULL;
+}
+
+// Releases the results of the last planning
+static void rpFreeResults(routePlanner* planner) {
+	if (planner->algorithm == PlanCached) rcRelease(planner->columns, planner->nodeCount, planner->destCount);
+	planner->columns = NULL;
+	free(planner->rows);
+	free(planner->nextHops);
+	planner->rows = NULL;
+	planner->nextHops = NULL;
+	rpFreeGraph(&planner->reverse);
+	planner->algorithm = PlanNone;
+}
+
 void rpFreePlan(routePlanner* planner) {
 	lprintln(LogDebug, "Releasing route planner resources");
+	if (planner->planThread != NULL) rpFinishPlanning(planner);
 	flexBufferFree((void**)&planner->units, NULL, &planner->unitsCap);
-	flexBufferFree((void**)&planner->pathBuffer, NULL, &planner->pathBufferCap);
-	free(planner->edges);
+	rpFreeResults(planner);
+	flexBufferFree((void**)&planner->links, &planner->linkCount, &planner->linkCap);
+	free(planner->linkIndex);
+	free(planner->destIndex);
 	free(planner);
 }
 
+// Returns the slot of the link index that refers to the link between two
+// nodes, or the empty slot where such a link would be inserted
+static size_t rpLinkSlot(const routePlanner* planner, nodeId from, nodeId to) {
+	uint64_t hash = (((uint64_t)from << 32) | to) * UINT64_C(0x9E3779B97F4A7C15);
+	size_t mask = planner->linkIndexCap - 1;
+	size_t slot = (size_t)(hash >> 32) & mask;
+	while (planner->linkIndex[slot] != 0) {
+		const rpLink* link = &planner->links[planner->linkIndex[slot]-1];
+		if (link->from == from && link->to == to) break;
+		slot = (slot + 1) & mask;
+	}
+	return slot;
+}
+
+// Returns the link between two nodes, or NULL if no weight was ever set for it
+static rpLink* rpFindLink(const routePlanner* planner, nodeId from, nodeId to) {
+	if (planner->linkIndexCap == 0) return NULL;
+	size_t entry = planner->linkIndex[rpLinkSlot(planner, from, to)];
+	return (entry == 0 ? NULL : &planner->links[entry-1]);
+}
+
+// Doubles the size of the link index, keeping it at most half full
+static void rpGrowLinkIndex(routePlanner* planner) {
+	free(planner->linkIndex);
+	planner->linkIndexCap = (planner->linkIndexCap == 0 ? 64 : planner->linkIndexCap * 2);
+	planner->linkIndex = eacalloc(planner->linkIndexCap, sizeof(size_t), 0);
+	for (size_t i = 0; i < planner->linkCount; ++i) {
+		const rpLink* link = &planner->links[i];
+		planner->linkIndex[rpLinkSlot(planner, link->from, link->to)] = i+1;
+	}
+}
+
 void rpSetWeight(routePlanner* planner, nodeId from, nodeId to, float weight) {
 	lprintf(LogDebug, "Route weight for %u => %u set to %f\n", from, to, weight);
-	rpEdgePtr(planner, from, to)->weight = weight;
+	rpLink* existing = rpFindLink(planner, from, to);
+	if (existing != NULL) {
+		existing->weight = weight;
+		return;
+	}
+	if ((planner->linkCount + 1) * 2 > planner->linkIndexCap) rpGrowLinkIndex(planner);
+	rpLink link = { .from = from, .to = to, .weight = weight };
+	flexBufferGrow((void**)&planner->links, planner->linkCount, &planner->linkCap, 1, sizeof(rpLink));
+	flexBufferAppend(planner->links, &planner->linkCount, &link, 1, sizeof(rpLink));
+	planner->linkIndex[rpLinkSlot(planner, from, to)] = planner->linkCount;
 }
 
-static void rpAddStep(routePlanner* planner, size_t* steps, nodeId nextStep) {
-	flexBufferGrow((void**)&planner->pathBuffer, *steps, &planner->pathBufferCap, 1, sizeof(nodeId));
-	flexBufferAppend(planner->pathBuffer, steps, &nextStep, 1, sizeof(nodeId));
+bool rpGetWeight(const routePlanner* planner, nodeId from, nodeId to, float* weight) {
+	const rpLink* link = rpFindLink(planner, from, to);
+	if (link == NULL) return false;
+	*weight = link->weight;
+	return true;
 }
 
-bool rpGetRoute(routePlanner* planner, nodeId start, nodeId end, nodeId** path, nodeId* steps) {
-	// This is the basic Floyd-Warshall path reconstruction technique. The only
-	// complication is using rpEdgePtr to access the edges, since they are
-	// stored in block layout.
+void rpSetCache(routePlanner* planner, const char* dir, uint64_t maxSize) {
+	planner->cacheDir = dir;
+	planner->cacheSize = maxSize;
+}
 
-	*path = NULL;
-	*steps = 0;
+void rpAddDestination(routePlanner* planner, nodeId id) {
+	if (planner->destIndex[id] != INVALID_NODE_ID) return;
+	planner->destIndex[id] = planner->destCount++;
+}
 
-	float pathWeight = rpEdgePtr(planner, start, end)->weight;
-	if (pathWeight == INFINITY) {
-		lprintf(LogDebug, "No route exists from %u => %u\n", start, end);
-		return false;
+nodeId rpNextHop(routePlanner* planner, nodeId start, nodeId end) {
+	if (planner->algorithm != PlanFloydWarshall) {
+		nodeId dest = planner->destIndex[end];
+		if (dest == INVALID_NODE_ID) {
+			lprintf(LogError, "BUG: Requested a route toward %u, which is not a destination\n", end);
+			return INVALID_NODE_ID;
+		}
+		return planner->columns[(size_t)dest * planner->nodeCount + start];
 	}
+	nodeId col;
+	const cellRow* cells = rpCellRowPtr(planner, start, end, &col);
+	if (cells->weights[col] == INFINITY) return INVALID_NODE_ID;
+	return cells->nexts[col];
+}
 
-	size_t longSteps = 0;
-	rpAddStep(planner, &longSteps, start);
+/* The block kernels below compute the same results; they only differ in the
+ * instructions that they use. For each intermediate node k, every cell row i of
+ * the ij block is updated using cell (i,k) of the ik block and cell row k of
+ * the kj block. The blocks may overlap (e.g., for the self-dependent block), but
+ * this is safe because weights are never negative: cell (i,k) and cell row k
+ * never change while they are being used for intermediate node k.
+ */
 
-	nodeId next = start;
-	while (next != end) {
-		next = rpEdgePtr(planner, next, end)->next;
-		rpAddStep(planner, &longSteps, next);
+// Portable kernel. The update is written without branches so that the compiler
+// can vectorize it for the baseline instruction set.
+static void rpProcessBlockScalar(cellRow* rows, size_t ijBlockStart, size_t ikBlockStart, size_t kjBlockStart) {
+	cellRow* ijRows = &rows[ijBlockStart / BlockSize];
+	const cellRow* ikRows = &rows[ikBlockStart / BlockSize];
+	const cellRow* kjRows = &rows[kjBlockStart / BlockSize];
+	for (nodeId k = 0; k < BlockSize; ++k) {
+		const cellRow* kjRow = &kjRows[k];
+		for (nodeId i = 0; i < BlockSize; ++i) {
+			cellRow* ijRow = &ijRows[i];
+			float ikWeight = ikRows[i].weights[k];
+			nodeId ikNext = ikRows[i].nexts[k];
+			for (nodeId j = 0; j < BLOCK_SIZE; ++j) {
+				float detourWeight = ikWeight + kjRow->weights[j];
+				bool shorter = detourWeight < ijRow->weights[j];
+				ijRow->weights[j] = shorter ? detourWeight : ijRow->weights[j];
+				ijRow->nexts[j] = shorter ? ikNext : ijRow->nexts[j];
+			}
+		}
 	}
+}
 
-	if (longSteps > MAX_NODE_ID) {
-		lprintf(LogError, "BUG: Route length %lu is longer than node count!\n", longSteps);
-		return false;
+#ifdef RP_X86_KERNELS
+
+// Processes a block using 4-wide SSE4.1 comparisons and blends
+__attribute__((target("sse4.1")))
+static void rpProcessBlockSse41(cellRow* rows, size_t ijBlockStart, size_t ikBlockStart, size_t kjBlockStart) {
+	cellRow* ijRows = &rows[ijBlockStart / BlockSize];
+	const cellRow* ikRows = &rows[ikBlockStart / BlockSize];
+	const cellRow* kjRows = &rows[kjBlockStart / BlockSize];
+	for (nodeId k = 0; k < BlockSize; ++k) {
+		const cellRow* kjRow = &kjRows[k];
+		for (nodeId i = 0; i < BlockSize; ++i) {
+			cellRow* ijRow = &ijRows[i];
+			__m128 ikWeight = _mm_set1_ps(ikRows[i].weights[k]);
+			__m128 ikNext = _mm_castsi128_ps(_mm_set1_epi32((int)ikRows[i].nexts[k]));
+			for (nodeId j = 0; j < BLOCK_SIZE; j += 4) {
+				__m128 detourWeight = _mm_add_ps(ikWeight, _mm_loadu_ps(&kjRow->weights[j]));
+				__m128 weight = _mm_loadu_ps(&ijRow->weights[j]);
+				__m128 shorter = _mm_cmplt_ps(detourWeight, weight);
+				__m128 next = _mm_castsi128_ps(_mm_loadu_si128((const __m128i*)&ijRow->nexts[j]));
+				_mm_storeu_ps(&ijRow->weights[j], _mm_blendv_ps(weight, detourWeight, shorter));
+				_mm_storeu_si128((__m128i*)&ijRow->nexts[j], _mm_castps_si128(_mm_blendv_ps(next, ikNext, shorter)));
+			}
+		}
 	}
-	*steps = (nodeId)longSteps;
-	*path = planner->pathBuffer;
-	lprintf(LogDebug, "Route from %u => %u has weight %f with %u hops\n", start, end, pathWeight, *steps);
-	return true;
 }
 
-// Completely process a single block of cells in the current thread
-static inline void rpProcessBlock(edgeInfo* edges, nodeId ijBlockStart, nodeId ikBlockStart, nodeId kjBlockStart) {
+// Processes a block using 8-wide AVX2 comparisons and blends
+__attribute__((target("avx2")))
+static void rpProcessBlockAvx2(cellRow* rows, size_t ijBlockStart, size_t ikBlockStart, size_t kjBlockStart) {
+	cellRow* ijRows = &rows[ijBlockStart / BlockSize];
+	const cellRow* ikRows = &rows[ikBlockStart / BlockSize];
+	const cellRow* kjRows = &rows[kjBlockStart / BlockSize];
 	for (nodeId k = 0; k < BlockSize; ++k) {
-		edgeInfo* ijEdge = &edges[ijBlockStart];
-		edgeInfo* ikEdge = &edges[ikBlockStart];
+		const cellRow* kjRow = &kjRows[k];
 		for (nodeId i = 0; i < BlockSize; ++i) {
-			edgeInfo* kjEdge = &edges[kjBlockStart];
-			for (nodeId j = 0; j < BlockSize; ++j) {
-				float detourWeight = ikEdge->weight + kjEdge->weight;
-				if (detourWeight < ijEdge->weight) {
-					ijEdge->weight = detourWeight;
-					ijEdge->next = ikEdge->next;
-				}
-
-				++kjEdge;
-				++ijEdge;
+			cellRow* ijRow = &ijRows[i];
+			__m256 ikWeight = _mm256_set1_ps(ikRows[i].weights[k]);
+			__m256 ikNext = _mm256_castsi256_ps(_mm256_set1_epi32((int)ikRows[i].nexts[k]));
+			for (nodeId j = 0; j < BLOCK_SIZE; j += 8) {
+				__m256 detourWeight = _mm256_add_ps(ikWeight, _mm256_loadu_ps(&kjRow->weights[j]));
+				__m256 weight = _mm256_loadu_ps(&ijRow->weights[j]);
+				__m256 shorter = _mm256_cmp_ps(detourWeight, weight, _CMP_LT_OQ);
+				__m256 next = _mm256_castsi256_ps(_mm256_loadu_si256((const __m256i*)&ijRow->nexts[j]));
+				_mm256_storeu_ps(&ijRow->weights[j], _mm256_blendv_ps(weight, detourWeight, shorter));
+				_mm256_storeu_si256((__m256i*)&ijRow->nexts[j], _mm256_castps_si256(_mm256_blendv_ps(next, ikNext, shorter)));
 			}
-			ikEdge += BlockSize;
 		}
-		++ikBlockStart; // Variable reuse; no longer points to block start
-		kjBlockStart += BlockSize;
 	}
 }
 
+#endif
+
+// Selects the fastest block kernel supported by the CPU. The name of the kernel
+// is stored in name.
+static rpProcessBlockFunc rpSelectBlockKernel(const char** name) {
+#ifdef RP_X86_KERNELS
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		*name = "AVX2";
+		return &rpProcessBlockAvx2;
+	}
+	if (__builtin_cpu_supports("sse4.1")) {
+		*name = "SSE4.1";
+		return &rpProcessBlockSse41;
+	}
+#endif
+	*name = "scalar";
+	return &rpProcessBlockScalar;
+}
+
 // A pointer to a function that processes a chunk of blocks. We use a pointer so
 // that we can easily swap between implementations at runtime based on the
 // characteristics of the graph.
-typedef void (*rpProcessChunkFunc)(routePlanner* planner, nodeId blockRowSize, nodeId rangeRows, nodeId rangeCols, nodeId ijBlock, nodeId ikBlock, nodeId kjBlock);
+typedef void (*rpProcessChunkFunc)(routePlanner* planner, size_t blockRowSize, nodeId rangeRows, nodeId rangeCols, size_t ijBlock, size_t ikBlock, size_t kjBlock);
 
 // Processes a chunk of blocks in a single thread. This is the most basic
 // implementation: simply enumerate the blocks and process each one locally.
-static void rpProcessChunkLocal(routePlanner* planner, nodeId blockRowSize, nodeId rangeRows, nodeId rangeCols, nodeId ijBlock, nodeId ikBlock, nodeId kjBlock) {
-	edgeInfo* edges = planner->edges;
+static void rpProcessChunkLocal(routePlanner* planner, size_t blockRowSize, nodeId rangeRows, nodeId rangeCols, size_t ijBlock, size_t ikBlock, size_t kjBlock) {
+	cellRow* rows = planner->rows;
+	rpProcessBlockFunc processBlock = planner->processBlock;
 	for (nodeId row = 0; row < rangeRows; ++row) {
-		nodeId ij = ijBlock;
-		nodeId kj = kjBlock;
+		size_t ij = ijBlock;
+		size_t kj = kjBlock;
 		for (nodeId col = 0; col < rangeCols; ++col) {
-			rpProcessBlock(edges, ij, ikBlock, kj);
+			processBlock(rows, ij, ikBlock, kj);
 			ij += BlockArea;
 			kj += BlockArea;
 		}
@@ -303,17 +557,17 @@ static void rpProcessChunkLocal(routePlanner* planner, nodeId blockRowSize, node
 // begin in the middle of the procedure. The function will act as if the
 // innermost loop has already been processed startIndex times, and will continue
 // for ThreadWorkSize steps.
-static void rpProcessPartialChunk(edgeInfo* edges, nodeId blockRowSize, nodeId rangeRows, nodeId rangeCols, nodeId ijBlock, nodeId ikBlock, nodeId kjBlock, nodeId startIndex) {
-	nodeId row = startIndex / rangeCols;
-	nodeId col = startIndex % rangeCols;
-	nodeId rowSkip = blockRowSize * row;
-	nodeId colSkip = BlockArea * col;
+static void rpProcessPartialChunk(cellRow* rows, rpProcessBlockFunc processBlock, size_t blockRowSize, nodeId rangeRows, nodeId rangeCols, size_t ijBlock, size_t ikBlock, size_t kjBlock, size_t startIndex) {
+	nodeId row = (nodeId)(startIndex / rangeCols);
+	nodeId col = (nodeId)(startIndex % rangeCols);
+	size_t rowSkip = blockRowSize * row;
+	size_t colSkip = (size_t)BlockArea * col;
 	ijBlock += rowSkip;
 	ikBlock += rowSkip;
-	nodeId ij = ijBlock + colSkip;
-	nodeId kj = kjBlock + colSkip;
+	size_t ij = ijBlock + colSkip;
+	size_t kj = kjBlock + colSkip;
 	for (nodeId i = 0; i < ThreadWorkSize; ++i) {
-		rpProcessBlock(edges, ij, ikBlock, kj);
+		processBlock(rows, ij, ikBlock, kj);
 		ij += BlockArea;
 		kj += BlockArea;
 
@@ -333,7 +587,7 @@ static void rpProcessPartialChunk(edgeInfo* edges, nodeId blockRowSize, nodeId r
 static void rpPoolCallback(gpointer data, gpointer user_data) {
 	rpWorkUnit* unit = data;
 	rpWorkRange* range = unit->range;
-	rpProcessPartialChunk(range->edges, range->blockRowSize, range->rangeRows, range->rangeCols, range->ijBlock, range->ikBlock, range->kjBlock, unit->startIndex);
+	rpProcessPartialChunk(range->rows, range->processBlock, range->blockRowSize, range->rangeRows, range->rangeCols, range->ijBlock, range->ikBlock, range->kjBlock, unit->startIndex);
 	g_mutex_lock(range->todoLock);
 	if (--range->todoCount == 0) {
 		g_cond_signal(range->finished);
@@ -342,8 +596,8 @@ static void rpPoolCallback(gpointer data, gpointer user_data) {
 }
 
 // Processes a chunk of blocks using a thread pool
-static void rpProcessChunkThreaded(routePlanner* planner, nodeId blockRowSize, nodeId rangeRows, nodeId rangeCols, nodeId ijBlock, nodeId ikBlock, nodeId kjBlock) {
-	nodeId spaceSize = rangeRows * rangeCols;
+static void rpProcessChunkThreaded(routePlanner* planner, size_t blockRowSize, nodeId rangeRows, nodeId rangeCols, size_t ijBlock, size_t ikBlock, size_t kjBlock) {
+	size_t spaceSize = (size_t)rangeRows * rangeCols;
 	if (spaceSize <= ThreadWorkSize) {
 		// The area is too small to justify thread pool overhead
 		if (spaceSize > 0) {
@@ -354,7 +608,8 @@ static void rpProcessChunkThreaded(routePlanner* planner, nodeId blockRowSize, n
 
 	// Copy starting parameters; available to all threads
 	rpWorkRange range;
-	range.edges = planner->edges;
+	range.rows = planner->rows;
+	range.processBlock = planner->processBlock;
 	range.todoLock = &planner->todoLock;
 	range.finished = &planner->finished;
 	range.blockRowSize = blockRowSize;
@@ -364,15 +619,15 @@ static void rpProcessChunkThreaded(routePlanner* planner, nodeId blockRowSize, n
 	range.ikBlock = ikBlock;
 	range.kjBlock = kjBlock;
 
-	nodeId tasks = (spaceSize + ThreadWorkSize - 1) / ThreadWorkSize;
+	size_t tasks = (spaceSize + ThreadWorkSize - 1) / ThreadWorkSize;
 	range.todoCount = tasks;
 
-	flexBufferGrow((void**)&planner->units, 0, &planner->unitsCap, (size_t)tasks, sizeof(rpWorkUnit));
+	flexBufferGrow((void**)&planner->units, 0, &planner->unitsCap, tasks, sizeof(rpWorkUnit));
 
 	g_mutex_lock(range.todoLock);
 
-	nodeId loopIdx = 0;
-	for (nodeId i = 0; i < tasks; ++i, loopIdx += ThreadWorkSize) {
+	size_t loopIdx = 0;
+	for (size_t i = 0; i < tasks; ++i, loopIdx += ThreadWorkSize) {
 		rpWorkUnit* unit = &planner->units[i];
 		unit->range = &range;
 		unit->startIndex = loopIdx;
@@ -384,10 +639,74 @@ static void rpProcessChunkThreaded(routePlanner* planner, nodeId blockRowSize, n
 	g_mutex_unlock(range.todoLock);
 }
 
-int rpPlanRoutes(routePlanner* planner) {
-	bool singleThreaded = planner->nodeCount < ThreadedThresholdNodes;
+// Initializes the Floyd-Warshall matrix from the link weights. Returns 0 on
+// success or an error code otherwise.
+static int rpInitMatrix(routePlanner* planner) {
+	/* We force the number of nodes to be a multiple of the block size. This
+	 * trades memory for performance.
+	 * Disadvantages:
+	 * - We waste memory. In the worst case, we lose:
+	 *   (2*nodeCount - BlockSize + 1) * (BlockSize -1) * 8 bytes
+	 * - O(nodeCount) additional operations required when pathfinding
+	 * - Less cache reuse between the end of a row and the start of the next
+	 * Advantages:
+	 * - O(nodeCount^2) fewer special-case tests (with good branch prediction)
+	 * - We use O(nodeCount^2) space and O(nodeCount^3) time, so the
+	 *   disadvantages are negligible
+	 */
+	nodeId blocks = (nodeId)(((uint64_t)planner->nodeCount + BlockSize - 1) / BlockSize);
+	emul32(blocks, BlockSize, &planner->paddedCount);
+	lprintf(LogDebug, "Node count was set to %u for block alignment\n", planner->paddedCount);
+
+	size_t rowCount;
+	size_t matrixSize;
+	emulSize((size_t)planner->paddedCount, (size_t)blocks, &rowCount);
+	emulSize(rowCount, sizeof(cellRow), &matrixSize);
+	lprintf(LogDebug, "Route planning matrix uses %lu MiB of memory\n", matrixSize / 1024 / 1024);
+
+	planner->rows = malloc(matrixSize);
+	if (planner->rows == NULL) {
+		lprintf(LogError, "Could not allocate %lu MiB of memory for planning routes\n", matrixSize / 1024 / 1024);
+		return ENOMEM;
+	}
+
+	// Set initial weights and "next" identifiers. We traverse the cell rows in
+	// array order, which makes it somewhat difficult to efficiently compute the
+	// global column numbers.
+	cellRow* cells = planner->rows;
+	for (nodeId blockRow = 0; blockRow < blocks; ++blockRow) {
+		nodeId colOffset = 0;
+		for (nodeId blockCol = 0; blockCol < blocks; ++blockCol) {
+			for (nodeId row = 0; row < BlockSize; ++row) {
+				for (nodeId col = 0; col < BlockSize; ++col) {
+					cells->weights[col] = INFINITY;
+					cells->nexts[col] = colOffset + col;
+				}
+				++cells;
+			}
+			colOffset += BlockSize;
+		}
+	}
+
+	for (size_t i = 0; i < planner->linkCount; ++i) {
+		const rpLink* link = &planner->links[i];
+		nodeId col;
+		rpCellRowPtr(planner, link->from, link->to, &col)->weights[col] = link->weight;
+	}
+	return 0;
+}
+
+static int rpPlanFloydWarshall(routePlanner* planner) {
+	int initErr = rpInitMatrix(planner);
+	if (initErr != 0) return initErr;
+
+	bool singleThreaded = planner->paddedCount < ThreadedThresholdNodes;
 
-	lprintf(LogInfo, "Constructing routing table for %u nodes (%s)\n", planner->nodeCount, singleThreaded ? "single-threaded" : "multi-threaded");
+	lprintf(LogInfo, "Constructing routing table for %u nodes using Floyd-Warshall (%s)\n", planner->nodeCount, singleThreaded ? "single-threaded" : "multi-threaded");
+
+	const char* kernelName;
+	planner->processBlock = rpSelectBlockKernel(&kernelName);
+	lprintf(LogDebug, "Using the %s kernel for Floyd-Warshall\n", kernelName);
 
 	rpProcessChunkFunc processRange;
 	if (singleThreaded) {
@@ -412,23 +731,23 @@ int rpPlanRoutes(routePlanner* planner) {
 	}
 
 	// Number of blocks per side of the cube
-	nodeId blocks = planner->nodeCount / BlockSize;
+	nodeId blocks = planner->paddedCount / BlockSize;
 
 	// The number of cells in a complete row of blocks
-	nodeId blockRowSize = planner->nodeCount * BlockSize;
+	size_t blockRowSize = (size_t)planner->paddedCount * BlockSize;
 
 	// Number of cells between block (i,i) and block (i+1,i+1)
-	nodeId blockDiagonalSize = blockRowSize + BlockArea;
+	size_t blockDiagonalSize = blockRowSize + BlockArea;
 
-	nodeId blockRowStart = 0; // Offset to (round, 0)
-	nodeId nextBlockRow = 0;  // Offset to (round+1, 0)
+	size_t blockRowStart = 0; // Offset to (round, 0)
+	size_t nextBlockRow = 0;  // Offset to (round+1, 0)
 
-	nodeId blockColStart = 0; // Offset to (0, round)
-	nodeId nextBlockCol = 0;  // Offset to (0, round+1)
+	size_t blockColStart = 0; // Offset to (0, round)
+	size_t nextBlockCol = 0;  // Offset to (0, round+1)
 
-	nodeId sdbStart = 0;             // Offset to (round, round), self-dependent
-	nodeId rightBlock = BlockArea;   // Offset to (round, round+1)
-	nodeId downBlock = blockRowSize; // Offset to (round+1, round)
+	size_t sdbStart = 0;             // Offset to (round, round), self-dependent
+	size_t rightBlock = BlockArea;   // Offset to (round, round+1)
+	size_t downBlock = blockRowSize; // Offset to (round+1, round)
 
 	nodeId remainingRounds = blocks - 1; // blocks - (round+1)
 
@@ -475,3 +794,524 @@ int rpPlanRoutes(routePlanner* planner) {
 	}
 	return 0;
 }
+
+// Builds adjacency lists for Dijkstra's algorithm. If reverse is set, the
+// neighbors of each node are the sources of the links entering it; otherwise,
+// they are the targets of the links leaving it. Untraversable links are kept so
+// that their weights can be changed in place with rpPatchGraph; searches skip
+// them.
+static void rpBuildGraph(const routePlanner* planner, bool reverse, rpGraph* graph) {
+	nodeId nodeCount = planner->nodeCount;
+	size_t* start = eacalloc(nodeCount, sizeof(size_t), sizeof(size_t));
+
+	// Counting sort of the links by the node that owns them
+	for (size_t i = 0; i < planner->linkCount; ++i) {
+		const rpLink* link = &planner->links[i];
+		if (link->from == link->to) continue;
+		++start[(reverse ? link->to : link->from)+1];
+	}
+	for (nodeId id = 0; id < nodeCount; ++id) {
+		start[id+1] += start[id];
+	}
+	size_t len = start[nodeCount];
+	nodeId* adj = eamalloc(len, sizeof(nodeId), 0);
+	float* weight = eamalloc(len, sizeof(float), 0);
+
+	// Each node lists its newest links first
+	size_t* fill = eamalloc(nodeCount, sizeof(size_t), 0);
+	memcpy(fill, &start[1], nodeCount * sizeof(size_t));
+	for (size_t i = 0; i < planner->linkCount; ++i) {
+		const rpLink* link = &planner->links[i];
+		if (link->from == link->to) continue;
+		size_t pos = --fill[reverse ? link->to : link->from];
+		adj[pos] = (reverse ? link->from : link->to);
+		weight[pos] = link->weight;
+	}
+	free(fill);
+
+	graph->start = start;
+	graph->adj = adj;
+	graph->weight = weight;
+}
+
+// Changes the weight of the link from a node to a neighbor in a graph built by
+// rpBuildGraph, which must contain the link
+static void rpPatchGraph(rpGraph* graph, nodeId id, nodeId neighbor, float weight) {
+	for (size_t i = graph->start[id]; i < graph->start[id+1]; ++i) {
+		if (graph->adj[i] == neighbor) {
+			graph->weight[i] = weight;
+			return;
+		}
+	}
+}
+
+// Working memory for running Dijkstra's algorithm in one thread
+typedef struct {
+	float* dist;
+	bool* settled;
+	nhEntry* heap;
+	size_t heapLen;
+	size_t heapCap;
+} rpSearch;
+
+static void rpSearchInit(rpSearch* search, nodeId nodeCount) {
+	search->dist = eamalloc(nodeCount, sizeof(float), 0);
+	search->settled = eamalloc(nodeCount, sizeof(bool), 0);
+	flexBufferInit((void**)&search->heap, &search->heapLen, &search->heapCap);
+}
+
+static void rpSearchFree(rpSearch* search) {
+	flexBufferFree((void**)&search->heap, &search->heapLen, &search->heapCap);
+	free(search->settled);
+	free(search->dist);
+}
+
+// Runs Dijkstra's algorithm from a source node, leaving the distances to all
+// nodes in search->dist. If preds is not NULL, it receives the predecessor of
+// each node in the search tree. If preferred is not NULL, ties between equally
+// short paths are broken in favor of the predecessors that it contains. A node
+// only adopts a settled predecessor, so this never creates cycles, even with
+// zero-weight links.
+static void rpSearchRun(rpSearch* search, const rpGraph* graph, nodeId nodeCount, nodeId source, nodeId* preds, const nodeId* preferred) {
+	float* dist = search->dist;
+	bool* settled = search->settled;
+	for (nodeId id = 0; id < nodeCount; ++id) {
+		dist[id] = INFINITY;
+		settled[id] = false;
+	}
+	if (preds != NULL) {
+		for (nodeId id = 0; id < nodeCount; ++id) {
+			preds[id] = INVALID_NODE_ID;
+		}
+	}
+	dist[source] = 0.f;
+	search->heapLen = 0;
+	nhPush(&search->heap, &search->heapLen, &search->heapCap, 0.f, source);
+	while (search->heapLen > 0) {
+		nhEntry entry;
+		nhPop(search->heap, &search->heapLen, &entry);
+		if (settled[entry.id]) continue; // Stale entry
+		settled[entry.id] = true;
+		for (size_t i = graph->start[entry.id]; i < graph->start[entry.id+1]; ++i) {
+			if (graph->weight[i] == INFINITY) continue;
+			nodeId neighbor = graph->adj[i];
+			float neighborDist = entry.dist + graph->weight[i];
+			if (neighborDist < dist[neighbor]) {
+				dist[neighbor] = neighborDist;
+				if (preds != NULL) preds[neighbor] = entry.id;
+				nhPush(&search->heap, &search->heapLen, &search->heapCap, neighborDist, neighbor);
+			} else if (preferred != NULL && neighborDist == dist[neighbor] && !settled[neighbor] && preferred[neighbor] == entry.id) {
+				preds[neighbor] = entry.id;
+			}
+		}
+	}
+}
+
+// Runs Dijkstra's algorithm toward every destination handled by a unit. The
+// search for a destination follows the links backwards, so the predecessor of
+// each node in the search is its next hop toward the destination.
+static void rpDijkstraDestinations(const rpDijkstraUnit* unit) {
+	routePlanner* planner = unit->planner;
+	nodeId nodeCount = planner->nodeCount;
+	rpSearch search;
+	rpSearchInit(&search, nodeCount);
+
+	for (nodeId i = unit->first; i < unit->destCount; i += unit->stride) {
+		nodeId dest = unit->dests[i];
+		const nodeId* preferred = NULL;
+		if (unit->preferOld) {
+			preferred = &planner->columns[(size_t)planner->destIndex[dest] * nodeCount];
+		}
+		rpSearchRun(&search, &planner->reverse, nodeCount, dest, &unit->columns[(size_t)i * nodeCount], preferred);
+	}
+
+	rpSearchFree(&search);
+}
+
+// Callback for the thread pool during Dijkstra planning. If no more work is
+// queued, the finished signal is raised.
+static void rpDijkstraPoolCallback(gpointer data, gpointer user_data) {
+	rpDijkstraUnit* unit = data;
+	routePlanner* planner = unit->planner;
+	rpDijkstraDestinations(unit);
+	g_mutex_lock(&planner->todoLock);
+	if (--planner->todoCount == 0) {
+		g_cond_signal(&planner->finished);
+	}
+	g_mutex_unlock(&planner->todoLock);
+}
+
+// Returns the number of threads used to run Dijkstra's algorithm
+static nodeId rpDijkstraThreads(nodeId destCount) {
+	nodeId threads = (nodeId)g_get_num_processors();
+	if (threads > destCount) threads = destCount;
+	if (threads < 1) threads = 1;
+	return threads;
+}
+
+// Creates the thread pool used by rpRunDijkstra. A single thread runs the
+// searches directly, so no pool is created for it. Returns 0 on success or an
+// error code otherwise.
+static int rpStartDijkstraPool(routePlanner* planner, nodeId threads) {
+	planner->pool = NULL;
+	if (threads <= 1) return 0;
+
+	GError* gerr = NULL;
+	planner->pool = g_thread_pool_new(&rpDijkstraPoolCallback, NULL, (gint)threads, TRUE, &gerr);
+	if (planner->pool == NULL) {
+		lprintf(LogError, "Failed to create thread pool for planning routes. Error: %s\n", gerr->message);
+		int err = gerr->code;
+		g_error_free(gerr);
+		return err;
+	}
+	g_mutex_init(&planner->todoLock);
+	g_cond_init(&planner->finished);
+	return 0;
+}
+
+// Destroys the thread pool created by rpStartDijkstraPool
+static void rpStopDijkstraPool(routePlanner* planner) {
+	if (planner->pool == NULL) return;
+	g_mutex_clear(&planner->todoLock);
+	g_cond_clear(&planner->finished);
+	g_thread_pool_free(planner->pool, FALSE, TRUE);
+	planner->pool = NULL;
+}
+
+// Plans the routes toward the given destinations using the reverse graph and
+// the thread pool started with rpStartDijkstraPool for the given number of
+// threads. The next hops toward dests[i] are written to column i of columns.
+static void rpRunDijkstra(routePlanner* planner, nodeId threads, const nodeId* dests, nodeId destCount, nodeId* columns, bool preferOld) {
+	if (threads > destCount) threads = destCount;
+	if (threads < 1) threads = 1;
+	planner->dijkstraUnits = eamalloc(threads, sizeof(rpDijkstraUnit), 0);
+	for (nodeId i = 0; i < threads; ++i) {
+		rpDijkstraUnit* unit = &planner->dijkstraUnits[i];
+		unit->planner = planner;
+		unit->first = i;
+		unit->stride = threads;
+		unit->dests = dests;
+		unit->destCount = destCount;
+		unit->columns = columns;
+		unit->preferOld = preferOld;
+	}
+
+	if (threads == 1 || planner->pool == NULL) {
+		for (nodeId i = 0; i < threads; ++i) {
+			rpDijkstraDestinations(&planner->dijkstraUnits[i]);
+		}
+	} else {
+		g_mutex_lock(&planner->todoLock);
+		planner->todoCount = threads;
+		for (nodeId i = 0; i < threads; ++i) {
+			g_thread_pool_push(planner->pool, &planner->dijkstraUnits[i], NULL);
+		}
+		while (planner->todoCount > 0) {
+			g_cond_wait(&planner->finished, &planner->todoLock);
+		}
+		g_mutex_unlock(&planner->todoLock);
+	}
+
+	free(planner->dijkstraUnits);
+	planner->dijkstraUnits = NULL;
+}
+
+// Returns an array containing the destinations, ordered by destination index
+static nodeId* rpDestinationList(const routePlanner* planner) {
+	nodeId* dests = eamalloc(planner->destCount, sizeof(nodeId), 0);
+	for (nodeId id = 0; id < planner->nodeCount; ++id) {
+		nodeId destIdx = planner->destIndex[id];
+		if (destIdx != INVALID_NODE_ID) dests[destIdx] = id;
+	}
+	return dests;
+}
+
+static int rpPlanDijkstra(routePlanner* planner) {
+	size_t columnCount;
+	emulSize((size_t)planner->nodeCount, (size_t)planner->destCount, &columnCount);
+	planner->nextHops = malloc(columnCount * sizeof(nodeId));
+	if (planner->nextHops == NULL && columnCount > 0) {
+		lprintf(LogError, "Could not allocate %lu MiB of memory for planning routes\n", columnCount * sizeof(nodeId) / 1024 / 1024);
+		return ENOMEM;
+	}
+	planner->columns = planner->nextHops;
+	rpBuildGraph(planner, true, &planner->reverse);
+
+	nodeId threads = rpDijkstraThreads(planner->destCount);
+	lprintf(LogInfo, "Constructing routing table for %u nodes and %u destinations using Dijkstra (%u threads)\n", planner->nodeCount, planner->destCount, threads);
+
+	int err = rpStartDijkstraPool(planner, threads);
+	if (err != 0) return err;
+	nodeId* dests = rpDestinationList(planner);
+	rpRunDijkstra(planner, threads, dests, planner->destCount, planner->nextHops, false);
+	free(dests);
+	rpStopDijkstraPool(planner);
+	return 0;
+}
+
+// Computes the route cache key for the current planner inputs
+static void rpCacheKey(const routePlanner* planner, rcKey* key) {
+	rcKeyInit(key);
+	rcMixKey(key, &planner->nodeCount, sizeof(planner->nodeCount));
+	rcMixKey(key, &planner->destCount, sizeof(planner->destCount));
+	rcMixKey(key, planner->destIndex, planner->nodeCount * sizeof(nodeId));
+	rcMixKey(key, &planner->linkCount, sizeof(planner->linkCount));
+	rcMixKey(key, planner->links, planner->linkCount * sizeof(rpLink));
+}
+
+// Copies the next hop columns for the destinations out of the planned routes.
+// Returns NULL if the memory could not be allocated.
+static nodeId* rpExtractColumns(routePlanner* planner) {
+	size_t columnCount;
+	emulSize((size_t)planner->nodeCount, (size_t)planner->destCount, &columnCount);
+	nodeId* columns = malloc(columnCount * sizeof(nodeId));
+	if (columns == NULL) return NULL;
+	if (planner->algorithm != PlanFloydWarshall) {
+		memcpy(columns, planner->columns, columnCount * sizeof(nodeId));
+		return columns;
+	}
+
+	// Floyd-Warshall plans routes toward all nodes, but we only need the
+	// columns for the destinations
+	for (nodeId dest = 0; dest < planner->nodeCount; ++dest) {
+		nodeId destIdx = planner->destIndex[dest];
+		if (destIdx == INVALID_NODE_ID) continue;
+		nodeId* column = &columns[(size_t)destIdx * planner->nodeCount];
+		for (nodeId id = 0; id < planner->nodeCount; ++id) {
+			column[id] = (id == dest ? INVALID_NODE_ID : rpNextHop(planner, id, dest));
+		}
+	}
+	return columns;
+}
+
+// Stores the planned routes in the route cache. Failures are not fatal, since
+// the routes can always be planned again.
+static void rpStoreCache(routePlanner* planner, const rcKey* key) {
+	if (planner->algorithm == PlanDijkstra) {
+		rcStore(planner->cacheDir, key, planner->nodeCount, planner->destCount, planner->nextHops, planner->cacheSize);
+		return;
+	}
+	nodeId* columns = rpExtractColumns(planner);
+	if (columns == NULL) return;
+	rcStore(planner->cacheDir, key, planner->nodeCount, planner->destCount, columns, planner->cacheSize);
+	free(columns);
+}
+
+int rpPlanRoutes(routePlanner* planner) {
+	rpFreeResults(planner);
+
+	rcKey cacheKey;
+	if (planner->cacheDir != NULL) {
+		rpCacheKey(planner, &cacheKey);
+		if (rcLoad(planner->cacheDir, &cacheKey, planner->nodeCount, planner->destCount, &planner->columns) == 0) {
+			planner->algorithm = PlanCached;
+			lprintf(LogInfo, "Loaded the routing table for %u nodes and %u destinations from the route cache\n", planner->nodeCount, planner->destCount);
+			return 0;
+		}
+	}
+
+	// Estimate the costs of the algorithms in Floyd-Warshall cell updates
+	double nodes = (double)planner->nodeCount;
+	double fwCost = nodes * nodes * nodes;
+	double dijkstraCost = (double)planner->destCount * ((double)planner->linkCount + nodes) * log2(nodes + 2.0) * DijkstraCostFactor;
+	bool fwFits = (rpFloydWarshallMemory(planner->nodeCount) <= planner->memLimit);
+	bool dijkstraFits = (rpDijkstraMemory(planner->nodeCount, planner->destCount) <= planner->memLimit);
+	if (!fwFits && !dijkstraFits) {
+		lprintf(LogError, "Planning routes for %u nodes and %u destinations exceeds the memory limit of %lu MiB. Increase the limit with --mem, or reduce the size of the topology.\n", planner->nodeCount, planner->destCount, planner->memLimit / 1024 / 1024);
+		return 1;
+	}
+	lprintf(LogDebug, "Estimated route planning cost: Floyd-Warshall %g%s, Dijkstra %g%s\n", fwCost, fwFits ? "" : " (exceeds memory limit)", dijkstraCost, dijkstraFits ? "" : " (exceeds memory limit)");
+
+	int err;
+	if (fwFits && (fwCost <= dijkstraCost || !dijkstraFits)) {
+		planner->algorithm = PlanFloydWarshall;
+		err = rpPlanFloydWarshall(planner);
+	} else {
+		planner->algorithm = PlanDijkstra;
+		err = rpPlanDijkstra(planner);
+	}
+	if (err != 0) {
+		rpFreeResults(planner);
+	} else if (planner->cacheDir != NULL) {
+		rpStoreCache(planner, &cacheKey);
+	}
+	return err;
+}
+
+static gpointer rpPlanThread(gpointer data) {
+	routePlanner* planner = data;
+	planner->planResult = rpPlanRoutes(planner);
+	return NULL;
+}
+
+void rpStartPlanning(routePlanner* planner) {
+	planner->planThread = g_thread_new("PlanThread", &rpPlanThread, planner);
+}
+
+int rpFinishPlanning(routePlanner* planner) {
+	g_thread_join(planner->planThread);
+	planner->planThread = NULL;
+	return planner->planResult;
+}
+
+// Converts the planned routes into owned next hop columns for the destinations,
+// which is the form that incremental updates maintain
+static int rpUseColumns(routePlanner* planner) {
+	if (planner->algorithm == PlanDijkstra) return 0;
+	nodeId* columns = rpExtractColumns(planner);
+	if (columns == NULL) {
+		lprintln(LogError, "Could not allocate memory for updating routes");
+		return ENOMEM;
+	}
+	rpFreeResults(planner);
+	planner->nextHops = columns;
+	planner->columns = columns;
+	planner->algorithm = PlanDijkstra;
+	return 0;
+}
+
+// Finds the destinations whose routes may be affected by changing the weight of
+// a link, and stores them in affected. A heavier link only matters to the
+// destinations whose routes use it. A lighter link only matters to the
+// destinations that its source can reach faster through it, which we find
+// using the distances in the forward graph before the change. Returns the
+// number of destinations.
+static nodeId rpAffectedDestinations(routePlanner* planner, const rpWeightChange* change, float oldWeight, const nodeId* dests, const rpGraph* forward, rpSearch* search, float* distFrom, nodeId* affected) {
+	nodeId nodeCount = planner->nodeCount;
+	nodeId affectedCount = 0;
+
+	if (change->weight > oldWeight) {
+		for (nodeId i = 0; i < planner->destCount; ++i) {
+			if (planner->nextHops[(size_t)i * nodeCount + change->from] == change->to) {
+				affected[affectedCount++] = dests[i];
+			}
+		}
+		return affectedCount;
+	}
+
+	rpSearchRun(search, forward, nodeCount, change->from, NULL, NULL);
+	memcpy(distFrom, search->dist, nodeCount * sizeof(float));
+	rpSearchRun(search, forward, nodeCount, change->to, NULL, NULL);
+	for (nodeId i = 0; i < planner->destCount; ++i) {
+		nodeId dest = dests[i];
+		if (change->weight + search->dist[dest] < distFrom[dest]) {
+			affected[affectedCount++] = dest;
+		}
+	}
+	return affectedCount;
+}
+
+int rpUpdateWeights(routePlanner* planner, const rpWeightChange* changes, size_t changeCount, rpRouteChangedFunc routeChanged, void* userData) {
+	if (planner->algorithm == PlanNone) {
+		lprintln(LogError, "BUG: Attempted to update routes that were not planned");
+		return 1;
+	}
+	int err = rpUseColumns(planner);
+	if (err != 0) return err;
+
+	nodeId nodeCount = planner->nodeCount;
+	nodeId destCount = planner->destCount;
+	size_t columnSize = (size_t)nodeCount * sizeof(nodeId);
+	nodeId threads = rpDijkstraThreads(destCount);
+	lprintf(LogDebug, "Updating routes for %lu link weight changes\n", changeCount);
+
+	// Links that were never set are added as untraversable, so that the graphs
+	// built below contain every changed link and can be patched in place
+	for (size_t c = 0; c < changeCount; ++c) {
+		const rpWeightChange* change = &changes[c];
+		if (rpFindLink(planner, change->from, change->to) == NULL) {
+			rpSetWeight(planner, change->from, change->to, INFINITY);
+		}
+	}
+	rpFreeGraph(&planner->reverse);
+	rpBuildGraph(planner, true, &planner->reverse);
+	err = rpStartDijkstraPool(planner, threads);
+	if (err != 0) return err;
+
+	// The changes are applied one at a time, so that each one is analyzed
+	// against the routes that include all of the earlier changes. The columns
+	// are saved before they are first modified, so that we can report the
+	// routes that differ after all of the changes. The forward graph is only
+	// needed for lighter links, so it is built when the first one is found.
+	nodeId* dests = rpDestinationList(planner);
+	nodeId** original = eacalloc(destCount, sizeof(nodeId*), 0);
+	nodeId* affected = eamalloc(destCount, sizeof(nodeId), 0);
+	float* distFrom = eamalloc(nodeCount, sizeof(float), 0);
+	nodeId* newColumns = NULL;
+	rpGraph forward = { .start = NULL, .adj = NULL, .weight = NULL };
+	rpSearch search;
+	rpSearchInit(&search, nodeCount);
+
+	for (size_t c = 0; c < changeCount; ++c) {
+		const rpWeightChange* change = &changes[c];
+		rpLink* link = rpFindLink(planner, change->from, change->to);
+		float oldWeight = link->weight;
+		if (change->weight == oldWeight) continue;
+		link->weight = change->weight;
+		if (change->from == change->to) continue;
+
+		if (change->weight < oldWeight && forward.start == NULL) {
+			// The forward graph must not include this change yet
+			link->weight = oldWeight;
+			rpBuildGraph(planner, false, &forward);
+			link->weight = change->weight;
+		}
+		nodeId affectedCount = rpAffectedDestinations(planner, change, oldWeight, dests, &forward, &search, distFrom, affected);
+		rpPatchGraph(&planner->reverse, change->to, change->from, change->weight);
+		if (forward.start != NULL) rpPatchGraph(&forward, change->from, change->to, change->weight);
+		if (affectedCount == 0) continue;
+
+		for (nodeId i = 0; i < affectedCount; ++i) {
+			nodeId destIdx = planner->destIndex[affected[i]];
+			if (original[destIdx] != NULL) continue;
+			original[destIdx] = emalloc(columnSize);
+			memcpy(original[destIdx], &planner->nextHops[(size_t)destIdx * nodeCount], columnSize);
+		}
+
+		// Plan the affected destinations again, keeping the old next hops where
+		// they remain shortest so that unaffected routes do not change
+		newColumns = earealloc(newColumns, affectedCount, columnSize, 0);
+		rpRunDijkstra(planner, threads, affected, affectedCount, newColumns, true);
+		for (nodeId i = 0; i < affectedCount; ++i) {
+			nodeId destIdx = planner->destIndex[affected[i]];
+			memcpy(&planner->nextHops[(size_t)destIdx * nodeCount], &newColumns[(size_t)i * nodeCount], columnSize);
+		}
+	}
+
+	nodeId replanned = 0;
+	size_t changedRoutes = 0;
+	for (nodeId destIdx = 0; destIdx < destCount; ++destIdx) {
+		if (original[destIdx] == NULL) continue;
+		++replanned;
+		const nodeId* column = &planner->nextHops[(size_t)destIdx * nodeCount];
+		for (nodeId id = 0; id < nodeCount; ++id) {
+			if (column[id] == original[destIdx][id]) continue;
+			++changedRoutes;
+			if (routeChanged != NULL) {
+				err = routeChanged(id, dests[destIdx], original[destIdx][id], column[id], userData);
+				if (err != 0) goto cleanup;
+			}
+		}
+	}
+	lprintf(LogInfo, "Updated %lu link weights: replanned routes toward %u of %u destinations, %lu routes changed\n", changeCount, replanned, destCount, changedRoutes);
+
+	if (planner->cacheDir != NULL) {
+		rcKey cacheKey;
+		rpCacheKey(planner, &cacheKey);
+		rpStoreCache(planner, &cacheKey);
+	}
+
+cleanup:
+	rpSearchFree(&search);
+	rpFreeGraph(&forward);
+	rpStopDijkstraPool(planner);
+	free(newColumns);
+	free(distFrom);
+	free(affected);
+	for (nodeId destIdx = 0; destIdx < destCount; ++destIdx) {
+		free(original[destIdx]);
+	}
+	free(original);
+	free(dests);
+	return err;
+}
@@ -19,35 +19,93 @@
  *******************************************************************************/
 #pragma once
 
-// This module implements an all-pairs shortest path algorithm for computing
-// static routing for a network graph.
+// This module computes shortest path static routing for a network graph. Routes
+// are planned toward a set of destinations, using either an all-pairs shortest
+// path algorithm or a single-destination algorithm for each destination,
+// whichever is expected to be faster. Planned routes can be updated after link
+// weight changes without planning them from scratch.
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
 #include "topology.h"
 
 typedef struct routePlanner routePlanner;
 
+// A new weight for the link between two nodes, as for rpSetWeight
+typedef struct {
+	nodeId from;
+	nodeId to;
+	float weight;
+} rpWeightChange;
+
+// Called for every route changed by rpUpdateWeights. The next hop from node
+// "id" toward "dest" changed from "oldNextHop" to "nextHop". Either is
+// INVALID_NODE_ID if the destination was or became unreachable. Returning a
+// nonzero value stops the reporting, and the value is returned by
+// rpUpdateWeights.
+typedef int (*rpRouteChangedFunc)(nodeId id, nodeId dest, nodeId oldNextHop, nodeId nextHop, void* userData);
+
 // Creates a new route planner for nodeCount nodes. Initially, all edges in the
-// graph are untraversable. Returns NULL if an error occurred.
-routePlanner* rpNewPlanner(nodeId nodeCount);
+// graph are untraversable. expectedDests is the number of destinations that will
+// be added with rpAddDestination. The planner requires memory proportional to
+// nodeCount^2 or nodeCount*expectedDests, depending on the algorithm; if neither
+// fits within memLimit bytes, planning is not attempted. Returns NULL if an
+// error occurred.
+routePlanner* rpNewPlanner(nodeId nodeCount, nodeId expectedDests, uint64_t memLimit);
 
 // Releases all resources associated with a route planner.
 void rpFreePlan(routePlanner* planner);
 
-// Sets the link weight between two nodes. Weights must not be negative.
+// Sets the link weight between two nodes. Weights must not be negative. Setting
+// the weight of a link again replaces its previous weight.
 void rpSetWeight(routePlanner* planner, nodeId from, nodeId to, float weight);
 
+// Retrieves the weight of the link between two nodes. Returns false if no
+// weight was ever set for the link.
+bool rpGetWeight(const routePlanner* planner, nodeId from, nodeId to, float* weight);
+
+// Enables the route cache in the given directory. Routes planned by
+// rpPlanRoutes are stored there, and later plannings with the same weights and
+// destinations load them instead of planning again. The cache is kept within
+// maxSize bytes by evicting the least recently used routes. The directory
+// string must remain valid for the lifetime of the planner.
+void rpSetCache(routePlanner* planner, const char* dir, uint64_t maxSize);
+
+// Marks a node as a destination. Routes can only be requested toward
+// destinations. Adding a node more than once has no effect.
+void rpAddDestination(routePlanner* planner, nodeId id);
+
 // Discovers the shortest routes between all nodes in the graph. If new edge
 // weights are set after planning the routes, this function must be called again
 // before requesting shortest paths. Returns 0 on success or an error code
 // otherwise.
 int rpPlanRoutes(routePlanner* planner);
 
-// Finds the shortest route from a starting node to an ending node. Must be
-// called after rpPlanRoutes. If no path exists, the function returns false.
-// Otherwise, it returns true, "path" points to an array of node indices
-// beginning with "start" and ending with "end", and "steps" is set to the
-// number of array elements. This array is invalidated by a subsequent call to
-// rpGetRoute or rpFreePlan.
-bool rpGetRoute(routePlanner* planner, nodeId start, nodeId end, nodeId** path, nodeId* steps);
+// Begins discovering the shortest routes in a background thread, so that the
+// caller can do other work while planning is in progress. No other function may
+// be called for the planner until rpFinishPlanning returns, except rpFreePlan.
+void rpStartPlanning(routePlanner* planner);
+
+// Waits for planning started by rpStartPlanning to complete. Returns the result
+// of the planning, as for rpPlanRoutes.
+int rpFinishPlanning(routePlanner* planner);
+
+// Finds the node that follows "start" on the shortest route from "start" to
+// "end", which must be a destination. Must be called after rpPlanRoutes. The
+// routes to any given end node form a tree, so following this function
+// repeatedly yields the complete route. Returns INVALID_NODE_ID if no path
+// exists.
+nodeId rpNextHop(routePlanner* planner, nodeId start, nodeId end);
+
+// Changes the weights of a set of links after the routes have been planned, and
+// updates the routes without planning them from scratch. Only the destinations
+// whose routes could be affected by a change are planned again, and existing
+// next hops are kept when they remain among the shortest. routeChanged, if not
+// NULL, is called for each (node, destination) pair whose next hop differs from
+// the one before the update. Afterwards, only routes toward destinations are
+// available. Returns 0 on success or an error code otherwise. If an error
+// occurs before the routes are reported, they must be planned again with
+// rpPlanRoutes.
+int rpUpdateWeights(routePlanner* planner, const rpWeightChange* changes, size_t changeCount, rpRouteChangedFunc routeChanged, void* userData);
@@ -0,0 +1,103 @@
+/*******************************************************************************
+ * Copyright © 2018 Nik Unger, Ian Goldberg, Qatar University, and the Qatar
+ * Foundation for Education, Science and Community Development.
+ *
+ * This file is part of NetMirage.
+ *
+ * NetMirage is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * NetMirage is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Affero General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with NetMirage. If not, see <http://www.gnu.org/licenses/>.
+ *******************************************************************************/
+#include "routetable.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <arpa/inet.h>
+
+#include "ip.h"
+
+static int compareRoutes(const void* a, const void* b) {
+	uint32_t addrA = ntohl(((const TopoRoute*)a)->subnet.addr);
+	uint32_t addrB = ntohl(((const TopoRoute*)b)->subnet.addr);
+	if (addrA < addrB) return -1;
+	if (addrA > addrB) return 1;
+	return 0;
+}
+
+static int compareRouteHops(const void* a, const void* b) {
+	nodeId viaA = ((const TopoRoute*)a)->via;
+	nodeId viaB = ((const TopoRoute*)b)->via;
+	if (viaA < viaB) return -1;
+	if (viaA > viaB) return 1;
+	return compareRoutes(a, b);
+}
+
+// Returns true if two subnets are the lower and upper halves of the same
+// covering subnet, in that order
+static bool isSiblingPair(const ip4Subnet* lower, const ip4Subnet* upper) {
+	if (lower->prefixLen != upper->prefixLen || lower->prefixLen == 0) return false;
+	uint32_t halfBit = (uint32_t)1 << (32 - lower->prefixLen);
+	uint32_t lowerAddr = ntohl(lower->addr);
+	return ((lowerAddr & halfBit) == 0 && ntohl(upper->addr) == (lowerAddr | halfBit));
+}
+
+size_t rtAggregate(TopoRoute routes[], size_t routeCount) {
+	if (routeCount < 2) return routeCount;
+	qsort(routes, routeCount, sizeof(TopoRoute), &compareRoutes);
+
+	// Since the subnets are sorted and disjoint, the lower half of a covering
+	// subnet is always processed immediately before its upper half (or the
+	// routes that merge into it). We keep the merged prefix of the table as a
+	// stack and collapse its top whenever it ends with a mergeable pair.
+	size_t top = 0;
+	for (size_t i = 0; i < routeCount; ++i) {
+		routes[top++] = routes[i];
+		while (top >= 2) {
+			TopoRoute* lower = &routes[top-2];
+			TopoRoute* upper = &routes[top-1];
+			if (lower->via != upper->via || !isSiblingPair(&lower->subnet, &upper->subnet)) break;
+			--lower->subnet.prefixLen;
+			--top;
+		}
+	}
+	return top;
+}
+
+size_t rtUseDefaultRoute(TopoRoute routes[], size_t routeCount) {
+	if (routeCount < 2) return routeCount;
+	qsort(routes, routeCount, sizeof(TopoRoute), &compareRouteHops);
+
+	// Find the longest run of routes with the same next hop
+	size_t bestStart = 0, bestLen = 0;
+	for (size_t start = 0; start < routeCount;) {
+		size_t end = start+1;
+		while (end < routeCount && routes[end].via == routes[start].via) ++end;
+		if (end - start > bestLen) {
+			bestStart = start;
+			bestLen = end - start;
+		}
+		start = end;
+	}
+	if (bestLen < 2) return routeCount;
+
+	TopoRoute defaultRoute = routes[bestStart];
+	defaultRoute.subnet.addr = 0;
+	defaultRoute.subnet.prefixLen = 0;
+
+	memmove(&routes[bestStart], &routes[bestStart+bestLen], (routeCount - bestStart - bestLen) * sizeof(TopoRoute));
+	routeCount -= bestLen;
+	routes[routeCount++] = defaultRoute;
+	return routeCount;
+}
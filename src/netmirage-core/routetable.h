@@ -0,0 +1,42 @@
+/*******************************************************************************
+ * Copyright © 2018 Nik Unger, Ian Goldberg, Qatar University, and the Qatar
+ * Foundation for Education, Science and Community Development.
+ *
+ * This file is part of NetMirage.
+ *
+ * NetMirage is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * NetMirage is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Affero General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with NetMirage. If not, see <http://www.gnu.org/licenses/>.
+ *******************************************************************************/
+#pragma once
+
+// This module operates on the static routing tables computed for the nodes in
+// the topology.
+
+#include <stddef.h>
+
+#include "topology.h"
+
+// Replaces a routing table with the smallest equivalent set of routes that can
+// be obtained by merging sibling subnets (two halves of the same covering
+// subnet) with the same next hop into their covering subnet. The subnets in the
+// table must not overlap. The table is reordered and shrunk in place; the new
+// number of routes is returned.
+size_t rtAggregate(TopoRoute routes[], size_t routeCount);
+
+// Replaces all routes that use the most common next hop in a table with a
+// single default route through that neighbor, leaving only the exceptions as
+// explicit routes. The table must not already contain a default route. Since
+// packets for unknown destinations are then forwarded rather than rejected,
+// this is only suitable if no such traffic is expected. The table is reordered
+// and shrunk in place; the new number of routes is returned.
+size_t rtUseDefaultRoute(TopoRoute routes[], size_t routeCount);
@@ -30,14 +30,16 @@
 #include <stdlib.h>
 #include <string.h>
 
-#include <glib.h>
-
 #include "graphml.h"
 #include "ip.h"
+#include "journal.h"
 #include "log.h"
 #include "mem.h"
+#include "nametable.h"
 #include "routeplanner.h"
+#include "routetable.h"
 #include "topology.h"
+#include "toporeduce.h"
 #include "work.h"
 
 static const setupParams* globalParams = NULL;
@@ -45,6 +47,11 @@ static const setupParams* globalParams = NULL;
 static bool edgeFileOpened = false;
 static FILE* edgeFile = NULL;
 
+// The journal is opened once the root namespace exists. If resuming is true,
+// work recorded in the journal by an earlier run is skipped.
+static setupJournal* journal = NULL;
+static bool resuming = false;
+
 #define DO_OR_GOTO(stmt, label, res) do{ \
 	res = (stmt); \
 	if (res != 0) { \
@@ -59,8 +66,15 @@ static FILE* edgeFile = NULL;
 	} \
 }while(0)
 
-int setupInit(void) {
-	DO_OR_RETURN(workInit());
+// Cancels the requests in an array that were not awaited, and then frees the
+// array. Entries for requests that were never issued must be 0.
+static void setupFreeRequests(workRequest* requests, size_t count) {
+	for (size_t i = 0; i < count; ++i) workCancel(requests[i]);
+	free(requests);
+}
+
+int setupInit(bool workerThreads) {
+	DO_OR_RETURN(workInit(workerThreads));
 	return 0;
 }
 
@@ -79,14 +93,38 @@ int setupConfigure(const setupParams* params) {
 		return 1;
 	}
 
-	if (params->keepOldNetworks) {
+	if (params->resume) {
+		int err = 0;
+		journal = jnOpen(params->ovsDir, true, &err);
+		if (journal == NULL && err != ENOENT) return err;
+		uint64_t value, check;
+		resuming = (journal != NULL && jnGet(journal, "root", &value, &check));
+		if (resuming) {
+			lprintf(LogInfo, "Resuming the interrupted network setup recorded in '%s'\n", params->ovsDir);
+		} else {
+			if (journal != NULL) jnClose(journal);
+			journal = NULL;
+			if (params->requireResume) {
+				lprintf(LogError, "There is no network setup recorded in '%s'. Set up the network first.\n", params->ovsDir);
+				return 1;
+			}
+			lprintln(LogWarning, "There is no interrupted network setup to resume. Setting up a new network instead.");
+		}
+	}
+
+	if (resuming) {
+		// The existing network is the one that we continue to build
+	} else if (params->keepOldNetworks) {
 		lprintln(LogInfo, "Preserving existing virtual networks as requested");
 	} else {
 		int err = destroyNetwork();
 		if (err != 0) return err;
 	}
 
-	// Complete definitions for edge nodes by filling in default / missing data
+	// Complete definitions for edge nodes by filling in default / missing data.
+	// MAC addresses are requested for all edge nodes before waiting for any of
+	// them so that the lookups are performed in parallel.
+	workRequest* macRequests = eacalloc(params->edgeNodeCount, sizeof(workRequest), 0);
 	size_t edgeSubnetsNeeded = 0;
 	for (size_t i = 0; i < params->edgeNodeCount; ++i) {
 		edgeNodeParams* edge = &params->edgeNodes[i];
@@ -95,18 +133,53 @@ int setupConfigure(const setupParams* params) {
 				char ip[IP4_ADDR_BUFLEN];
 				ip4AddrToString(edge->ip, ip);
 				lprintf(LogError, "No interface was specified for edge node with IP %s. Either specify an interface, or specify --iface if all edge nodes are behind the same one.\n", ip);
+				setupFreeRequests(macRequests, params->edgeNodeCount);
 				return 1;
 			}
 			edge->intf = eamalloc(strlen(params->edgeNodeDefaults.intf), 1, 1);
 			strcpy(edge->intf, params->edgeNodeDefaults.intf);
 		}
+		if (!edge->macSpecified && resuming) {
+			// The interface was moved into the root namespace, so the lookup
+			// would fail. We use the address found by the earlier run instead.
+			char key[32];
+			sprintf(key, "edge-mac-%lu", i);
+			uint64_t value, check;
+			if (!jnGet(journal, key, &value, &check)) {
+				lprintf(LogError, "The setup journal does not contain the MAC address of edge node %lu\n", i);
+				setupFreeRequests(macRequests, params->edgeNodeCount);
+				return 1;
+			}
+			for (int octet = MAC_ADDR_BYTES-1; octet >= 0; --octet) {
+				edge->mac.octets[octet] = (uint8_t)(value & 0xFF);
+				value >>= 8;
+			}
+			edge->macSpecified = true;
+		}
 		if (!edge->macSpecified) {
-			DO_OR_RETURN(workGetEdgeRemoteMac(edge->intf, edge->ip, &edge->mac));
+			int err = workRequestEdgeRemoteMac(edge->intf, edge->ip, &edge->mac, &macRequests[i]);
+			if (err != 0) {
+				setupFreeRequests(macRequests, params->edgeNodeCount);
+				return err;
+			}
 		}
 		if (!edge->vsubnetSpecified) {
 			++edgeSubnetsNeeded;
 		}
 	}
+	for (size_t i = 0; i < params->edgeNodeCount; ++i) {
+		edgeNodeParams* edge = &params->edgeNodes[i];
+		if (edge->macSpecified) continue;
+		int err = workAwait(macRequests[i]);
+		if (err != 0) {
+			char ipStr[IP4_ADDR_BUFLEN];
+			ip4AddrToString(edge->ip, ipStr);
+			lprintf(LogError, "Could not find the MAC address for edge node with IP %s on interface '%s'. Ensure that the edge node is online, or manually specify the MAC address in the setup file or command arguments.\n", ipStr, edge->intf);
+			setupFreeRequests(macRequests, params->edgeNodeCount);
+			return err;
+		}
+	}
+	free(macRequests);
 
 	// Automatically provide client subnets to unconfigured edge nodes
 	bool subnetErr = false;
@@ -183,6 +256,8 @@ int setupConfigure(const setupParams* params) {
 }
 
 int setupCleanup(void) {
+	if (journal != NULL) jnClose(journal);
+	journal = NULL;
 	DO_OR_RETURN(workCleanup());
 	if (edgeFileOpened) {
 		fclose(edgeFile);
@@ -196,9 +271,91 @@ int destroyNetwork(void) {
 	DO_OR_RETURN(workDestroyHosts());
 	DO_OR_RETURN(workJoin(false));
 
+	if (journal != NULL) jnClose(journal);
+	journal = NULL;
+	resuming = false;
+	jnDelete(globalParams->ovsDir);
 	return 0;
 }
 
+bool setupCanResume(void) {
+	return journal != NULL;
+}
+
+
+/******************************************************************************\
+|                                Setup Journal                                 |
+\******************************************************************************/
+
+// Progress through one phase of the setup. The items of a phase are always
+// processed in the same order, so the number of completed items identifies
+// them. Progress is recorded in the journal at regular checkpoints, along with
+// a checksum of the inputs that determined the items. When resuming, the items
+// completed by the earlier run are skipped, and the items after its last
+// checkpoint are replaced since they may have been partially set up.
+typedef struct {
+	const char* key;  // Journal key
+	const char* what; // Description of the items for log messages
+	uint64_t done;    // Number of items processed so far
+	bool recorded;    // True if the earlier run recorded progress
+	uint64_t resumeAt;
+	uint64_t resumeCheck;
+} setupPhase;
+
+// Number of items between checkpoints. Each checkpoint waits until all
+// outstanding work is finished, so this should not be too small.
+static const uint64_t CheckpointInterval = 4096;
+
+static void phaseInit(setupPhase* phase, const char* key, const char* what) {
+	phase->key = key;
+	phase->what = what;
+	phase->done = 0;
+	phase->resumeAt = 0;
+	phase->recorded = (resuming && jnGet(journal, key, &phase->resumeAt, &phase->resumeCheck));
+	if (phase->recorded && phase->resumeAt > 0) {
+		lprintf(LogInfo, "Skipping %lu %s that were set up by an earlier run\n", phase->resumeAt, what);
+	}
+}
+
+// Returns true if the next item was completed by an earlier run
+static bool phaseSkip(const setupPhase* phase) {
+	return phase->done < phase->resumeAt;
+}
+
+// Returns true if the next item may have been partially set up by an earlier run
+static bool phaseReplace(const setupPhase* phase) {
+	return resuming && phase->done < phase->resumeAt + CheckpointInterval;
+}
+
+// Records the progress of a phase once the outstanding work is finished. When
+// the replayed items reach the earlier run's last checkpoint, the checksums are
+// compared instead. If final is true, the phase is complete. Returns 0 on
+// success or an error code otherwise.
+static int phaseCheckpoint(setupPhase* phase, uint64_t check, bool final) {
+	if (phase->done < phase->resumeAt) {
+		if (!final) return 0;
+	} else if (phase->done > phase->resumeAt || !phase->recorded) {
+		DO_OR_RETURN(workJoin(false));
+		return jnPut(journal, phase->key, phase->done, check);
+	} else if (check == phase->resumeCheck) {
+		return 0;
+	}
+	lprintf(LogError, "The %s do not match the interrupted setup. The network topology or configuration may have changed. Destroy the network and set it up again without resuming.\n", phase->what);
+	return 1;
+}
+
+// Marks the next item as processed. Returns 0 on success or an error code
+// otherwise.
+static int phaseAdvance(setupPhase* phase, uint64_t check) {
+	++phase->done;
+	if (phase->done % CheckpointInterval != 0) return 0;
+	return phaseCheckpoint(phase, check, false);
+}
+
+static int phaseFinish(setupPhase* phase, uint64_t check) {
+	return phaseCheckpoint(phase, check, true);
+}
+
 
 /******************************************************************************\
 |                               GraphML Parsing                                |
@@ -206,25 +363,55 @@ int destroyNetwork(void) {
 
 typedef struct {
 	ip4Addr addr; // Duplicated for all interfaces
+	nodeId clientIdx; // Index in the client states, if this is a client
+	nodeId degree; // Number of links to other nodes
+	bool defined; // False if the node has only been referenced by links so far
 	bool isClient;
-	ip4Subnet clientSubnet;
-	macAddr clientMacs[NEEDED_MACS_CLIENT];
 } gmlNodeState;
 
+// State that is only needed for client nodes
+typedef struct {
+	ip4Subnet subnet;
+	macAddr macs[NEEDED_MACS_CLIENT];
+	TopoNode t; // Only used if host creation is deferred
+} gmlClientState;
+
 typedef struct {
 	bool finishedNodes;
-	bool ignoreNodes;
-	bool ignoreEdges;
+
+	// If spoolLinks is true, links are buffered until the whole file has been
+	// read, since nodes may appear after the links that use them. If
+	// reduceTopology or pruneTopology is also true, hosts are only created once
+	// the buffered topology has been simplified.
+	bool spoolLinks;
+	bool reduceTopology;
+	bool pruneTopology;
+	TopoEdge* spooledLinks;
+	size_t spooledLinkCount;
+	size_t spooledLinkCap;
 
 	// Variable-sized buffer for storing all node states
 	gmlNodeState* nodeStates;
 	size_t nodeCount;   // Total number of nodes (client + non-client)
 	size_t clientNodes; // Total number of client nodes
 	size_t nodeCap;
-	GHashTable* gmlToState; // Maps GraphML names to indices in nodeStates
+	nameTable* names; // Maps GraphML names to indices in nodeStates
+
+	// Variable-sized buffer for client-specific states. The length is
+	// clientNodes.
+	gmlClientState* clientStates;
+	size_t clientCap;
 
 	int mtu;
 
+	// Progress of the setup phases, and a checksum of the inputs that
+	// determined the work so far
+	setupPhase hostPhase;
+	setupPhase linkPhase;
+	setupPhase clientPhase;
+	setupPhase routePhase;
+	uint64_t check;
+
 	double clientsPerEdge;
 	nodeId currentEdgeIdx;
 	nodeId currentEdgeClients;
@@ -236,7 +423,8 @@ typedef struct {
 	routePlanner* routes;
 } gmlContext;
 
-static void gmlFreeData(gpointer data) { free(data); }
+// Mixes a value into the checksum of the inputs
+#define GML_CHECK(ctx, value) do{ (ctx)->check = jnCheck((ctx)->check, &(value), sizeof(value)); }while(0)
 
 static void gmlGenerateIp(gmlContext* ctx, bool* addrExhausted, ip4Addr* addr) {
 	if (*addrExhausted) return;
@@ -249,43 +437,65 @@ static void gmlGenerateIp(gmlContext* ctx, bool* addrExhausted, ip4Addr* addr) {
 
 // Looks up the node state for a given string identifier from the GraphML file.
 // If the state does not exist, and "node" is not NULL, then a new state is
-// created and cached. Otherwise, an error occurs. Returns true on success, in
-// which case "id" and "state" are set. Otherwise, returns false and their
-// values are undefined.
+// created and cached. If links are being spooled, a placeholder state is also
+// created for unknown nodes referenced by links; it is completed once "node" is
+// known. Otherwise, an error occurs. Returns true on success, in which case
+// "id" and "state" are set. Otherwise, returns false and their values are
+// undefined.
 static bool gmlNameToState(gmlContext* ctx, const char* name, const TopoNode* node, nodeId* id, gmlNodeState** state) {
-	gpointer ptr;
-	gboolean exists = g_hash_table_lookup_extended(ctx->gmlToState, name, NULL, &ptr);
-	size_t index = GPOINTER_TO_SIZE(ptr);
-	*state = &ctx->nodeStates[index];
-	if (!exists) {
-		if (node == NULL) {
+	if (node == NULL && !ctx->spoolLinks) {
+		if (!ntFind(ctx->names, name, id)) {
 			lprintf(LogError, "Requested existing state for unknown host '%s'\n", name);
-			return NULL;
+			return false;
 		}
+		*state = &ctx->nodeStates[*id];
+		return true;
+	}
+
+	bool added;
+	*id = ntIntern(ctx->names, name, &added);
+	if (added) {
 		bool addrExhausted = false;
 		ip4Addr newAddr;
 		gmlGenerateIp(ctx, &addrExhausted, &newAddr);
 		if (addrExhausted) {
 			lprintln(LogError, "Cannot set up all of the virtual hosts because the non-routable IPv4 address space has been exhausted. Either decrease the number of nodes in the topology, or assign fewer addresses to the edge nodes.");
-			return NULL;
+			return false;
 		}
 
-		index = ctx->nodeCount++;
-
 		flexBufferGrow((void**)&ctx->nodeStates, ctx->nodeCount, &ctx->nodeCap, 1, sizeof(gmlNodeState));
-		g_hash_table_insert(ctx->gmlToState, (gpointer)strdup(name), GSIZE_TO_POINTER(index));
-
-		*state = &ctx->nodeStates[index];
-		(*state)->addr = newAddr;
+		gmlNodeState* newState = &ctx->nodeStates[ctx->nodeCount++];
+		newState->addr = newAddr;
+		newState->clientIdx = INVALID_NODE_ID;
+		newState->degree = 0;
+		newState->defined = false;
+		newState->isClient = false;
+	}
+	*state = &ctx->nodeStates[*id];
+	if (node != NULL && !(*state)->defined) {
+		(*state)->defined = true;
 		(*state)->isClient = node->client;
 	}
-	*id = (nodeId)index;
-	return state;
+	return true;
+}
+
+static int gmlAddHost(gmlContext* ctx, nodeId id, const TopoNode* node) {
+	gmlNodeState* state = &ctx->nodeStates[id];
+	gmlClientState* client = (node->client ? &ctx->clientStates[state->clientIdx] : NULL);
+	GML_CHECK(ctx, id);
+	GML_CHECK(ctx, state->addr);
+	GML_CHECK(ctx, node->client);
+	GML_CHECK(ctx, node->packetLoss);
+	GML_CHECK(ctx, node->bandwidthUp);
+	GML_CHECK(ctx, node->bandwidthDown);
+	if (!phaseSkip(&ctx->hostPhase)) {
+		DO_OR_RETURN(workAddHost(id, state->addr, client != NULL ? client->macs : NULL, ctx->mtu, node, phaseReplace(&ctx->hostPhase)));
+	}
+	return phaseAdvance(&ctx->hostPhase, ctx->check);
 }
 
 static int gmlAddNode(const GmlNode* node, void* userData) {
 	gmlContext* ctx = userData;
-	if (ctx->ignoreNodes) return 0;
 	if (ctx->finishedNodes) {
 		lprintln(LogError, "The GraphML file contains some <node> elements after the <edge> elements. To parse this file, use the --two-pass option.");
 		return 1;
@@ -295,12 +505,16 @@ static int gmlAddNode(const GmlNode* node, void* userData) {
 	gmlNodeState* state;
 	if (!gmlNameToState(ctx, node->name, &node->t, &id, &state)) return 1;
 
+	gmlClientState* client = NULL;
 	if (node->t.client) {
-		if (!macNextAddrs(&ctx->macAddrIter, state->clientMacs, NEEDED_MACS_CLIENT)) {
+		flexBufferGrow((void**)&ctx->clientStates, ctx->clientNodes, &ctx->clientCap, 1, sizeof(gmlClientState));
+		state->clientIdx = (nodeId)ctx->clientNodes++;
+		client = &ctx->clientStates[state->clientIdx];
+		if (!macNextAddrs(&ctx->macAddrIter, client->macs, NEEDED_MACS_CLIENT)) {
 			lprintln(LogError, "Ran out of MAC addresses when creating a new client node.");
 			return 1;
 		}
-		++ctx->clientNodes;
+		client->t = node->t;
 	}
 
 	if (PASSES_LOG_THRESHOLD(LogDebug)) {
@@ -309,11 +523,12 @@ static int gmlAddNode(const GmlNode* node, void* userData) {
 		lprintf(LogDebug, "GraphML node '%s' assigned identifier %u and IP address %s\n", node->name, id, ip);
 	}
 
-	DO_OR_RETURN(workAddHost(id, state->addr, state->clientMacs, ctx->mtu, &node->t));
-	return 0;
+	if (ctx->reduceTopology || ctx->pruneTopology) return 0;
+	return gmlAddHost(ctx, id, &node->t);
 }
 
 static int gmlOnFinishedNodes(gmlContext* ctx) {
+	DO_OR_RETURN(phaseFinish(&ctx->hostPhase, ctx->check));
 	lprintln(LogInfo, "Host creation complete. Now adding virtual ethernet connections.");
 	lprintf(LogDebug, "Encountered %u nodes (%u clients)\n", ctx->nodeCount, ctx->clientNodes);
 	if (ctx->clientNodes < globalParams->edgeNodeCount) {
@@ -322,23 +537,55 @@ static int gmlOnFinishedNodes(gmlContext* ctx) {
 	}
 
 	uint64_t worstCaseLinkCount = (uint64_t)ctx->nodeCount * (uint64_t)ctx->nodeCount;
-	DO_OR_RETURN(workJoin(false));
 	DO_OR_RETURN(workEnsureSystemScaling(worstCaseLinkCount, (nodeId)ctx->nodeCount, (nodeId)ctx->clientNodes));
-	DO_OR_RETURN(workJoin(false));
 
 	ctx->clientsPerEdge = (double)ctx->clientNodes / (double)globalParams->edgeNodeCount;
-	ctx->routes = rpNewPlanner((nodeId)ctx->nodeCount);
+	// Routes are needed toward every client, and toward the root of the tree
+	// if clients are assigned subnets in tree order
+	ctx->routes = rpNewPlanner((nodeId)ctx->nodeCount, (nodeId)ctx->clientNodes + 1, globalParams->softMemCap);
+	if (ctx->routes == NULL) return 1;
 	return 0;
 }
 
+// Connects two nodes once the node section is complete
+static int gmlConnectNodes(gmlContext* ctx, nodeId sourceId, nodeId targetId, float weight, const TopoLink* link) {
+	gmlNodeState* sourceState = &ctx->nodeStates[sourceId];
+	gmlNodeState* targetState = &ctx->nodeStates[targetId];
+	GML_CHECK(ctx, sourceId);
+	GML_CHECK(ctx, targetId);
+	GML_CHECK(ctx, weight);
+	GML_CHECK(ctx, link->latency);
+	GML_CHECK(ctx, link->packetLoss);
+	GML_CHECK(ctx, link->jitter);
+	GML_CHECK(ctx, link->queueLen);
+	bool skip = phaseSkip(&ctx->linkPhase);
+	if (sourceId == targetId) {
+		if (sourceState->isClient && !skip) {
+			DO_OR_RETURN(workSetSelfLink(sourceId, link));
+		}
+	} else {
+		macAddr macs[NEEDED_MACS_LINK];
+		if (!macNextAddrs(&ctx->macAddrIter, macs, NEEDED_MACS_LINK)) {
+			lprintln(LogError, "Ran out of MAC addresses when adding a new virtual ethernet connection.");
+			return 1;
+		}
+		if (!skip) {
+			DO_OR_RETURN(workAddLink(sourceId, targetId, sourceState->addr, targetState->addr, macs, ctx->mtu, link, phaseReplace(&ctx->linkPhase)));
+		}
+		rpSetWeight(ctx->routes, sourceId, targetId, weight);
+		rpSetWeight(ctx->routes, targetId, sourceId, weight);
+		++sourceState->degree;
+		++targetState->degree;
+	}
+	return phaseAdvance(&ctx->linkPhase, ctx->check);
+}
+
 static int gmlAddLink(const GmlLink* link, void* userData) {
 	gmlContext* ctx = userData;
 
-	if (ctx->ignoreEdges) return 0;
-	if (!ctx->finishedNodes) {
-		ctx->finishedNodes = true;
-		int res = gmlOnFinishedNodes(ctx);
-		if (res != 0) return res;
+	if (link->weight < 0.f) {
+		lprintf(LogError, "The link from '%s' to '%s' in the topology has negative weight %f, which is not supported.\n", link->sourceName, link->targetName, link->weight);
+		return 1;
 	}
 
 	nodeId sourceId, targetId;
@@ -347,26 +594,88 @@ static int gmlAddLink(const GmlLink* link, void* userData) {
 	if (!gmlNameToState(ctx, link->sourceName, NULL, &sourceId, &sourceState)) return 1;
 	if (!gmlNameToState(ctx, link->targetName, NULL, &targetId, &targetState)) return 1;
 
-	if (sourceId == targetId) {
-		if (sourceState->isClient) {
-			DO_OR_RETURN(workSetSelfLink(sourceId, &link->t));
-		}
-	} else {
-		macAddr macs[NEEDED_MACS_LINK];
-		if (!macNextAddrs(&ctx->macAddrIter, macs, NEEDED_MACS_LINK)) {
-			lprintln(LogError, "Ran out of MAC addresses when adding a new virtual ethernet connection.");
+	if (ctx->spoolLinks) {
+		TopoEdge spooled = { .source = sourceId, .target = targetId, .weight = link->weight, .t = link->t };
+		flexBufferGrow((void**)&ctx->spooledLinks, ctx->spooledLinkCount, &ctx->spooledLinkCap, 1, sizeof(TopoEdge));
+		flexBufferAppend(ctx->spooledLinks, &ctx->spooledLinkCount, &spooled, 1, sizeof(TopoEdge));
+		return 0;
+	}
+
+	if (!ctx->finishedNodes) {
+		ctx->finishedNodes = true;
+		int res = gmlOnFinishedNodes(ctx);
+		if (res != 0) return res;
+	}
+	return gmlConnectNodes(ctx, sourceId, targetId, link->weight, &link->t);
+}
+
+// Reduces the spooled topology (see trReduce) and creates the remaining hosts.
+// The node identifiers are renumbered accordingly.
+typedef nodeId (*gmlSimplifyFunc)(nodeId nodeCount, const bool isClient[], TopoEdge links[], size_t* linkCount, nodeId nodeMap[]);
+
+// Applies a topology simplification to the spooled links and renumbers the
+// node states accordingly.
+static void gmlSimplifyTopology(gmlContext* ctx, gmlSimplifyFunc simplify) {
+	bool* isClient = eamalloc(ctx->nodeCount, sizeof(bool), 0);
+	for (nodeId id = 0; id < ctx->nodeCount; ++id) {
+		isClient[id] = ctx->nodeStates[id].isClient;
+	}
+	nodeId* nodeMap = eamalloc(ctx->nodeCount, sizeof(nodeId), 0);
+	nodeId remaining = simplify((nodeId)ctx->nodeCount, isClient, ctx->spooledLinks, &ctx->spooledLinkCount, nodeMap);
+	free(isClient);
+
+	// Identifiers only ever decrease, so the states can be moved in place
+	for (nodeId id = 0; id < ctx->nodeCount; ++id) {
+		if (nodeMap[id] != INVALID_NODE_ID) ctx->nodeStates[nodeMap[id]] = ctx->nodeStates[id];
+	}
+	ctx->nodeCount = remaining;
+	free(nodeMap);
+}
+
+// Simplifies the spooled topology and then creates the remaining hosts.
+// Returns 0 on success or an error code otherwise.
+static int gmlReduceTopology(gmlContext* ctx) {
+	if (ctx->reduceTopology) {
+		lprintln(LogInfo, "Reducing the topology");
+		gmlSimplifyTopology(ctx, &trReduce);
+	}
+	if (ctx->pruneTopology) {
+		lprintln(LogInfo, "Pruning nodes that are not used by any client");
+		gmlSimplifyTopology(ctx, &trPrune);
+	}
+
+	const TopoNode transitNode = { .client = false };
+	for (nodeId id = 0; id < ctx->nodeCount; ++id) {
+		gmlNodeState* state = &ctx->nodeStates[id];
+		DO_OR_RETURN(gmlAddHost(ctx, id, state->isClient ? &ctx->clientStates[state->clientIdx].t : &transitNode));
+	}
+	return 0;
+}
+
+// Adds the links that were spooled while reading the file. Returns 0 on
+// success or an error code otherwise.
+static int gmlAddSpooledLinks(gmlContext* ctx) {
+	ctx->spoolLinks = false;
+	for (nodeId id = 0; id < ctx->nodeCount; ++id) {
+		if (!ctx->nodeStates[id].defined) {
+			lprintf(LogError, "The GraphML file contains links to a host that does not exist: '%s'\n", ntName(ctx->names, id));
 			return 1;
 		}
-		DO_OR_RETURN(workAddLink(sourceId, targetId, sourceState->addr, targetState->addr, macs, ctx->mtu, &link->t));
-		if (link->weight < 0.f) {
-			lprintf(LogError, "The link from '%s' to '%s' in the topology has negative weight %f, which is not supported.\n", link->sourceName, link->targetName, link->weight);
-			return 1;
-		} else {
-			rpSetWeight(ctx->routes, sourceId, targetId, link->weight);
-			rpSetWeight(ctx->routes, targetId, sourceId, link->weight);
+	}
+	if (ctx->reduceTopology || ctx->pruneTopology) DO_OR_RETURN(gmlReduceTopology(ctx));
+
+	lprintf(LogDebug, "Adding %lu links that were buffered while reading the file\n", ctx->spooledLinkCount);
+	int err = 0;
+	if (ctx->spooledLinkCount > 0) {
+		ctx->finishedNodes = true;
+		err = gmlOnFinishedNodes(ctx);
+		for (size_t i = 0; err == 0 && i < ctx->spooledLinkCount; ++i) {
+			TopoEdge* link = &ctx->spooledLinks[i];
+			err = gmlConnectNodes(ctx, link->source, link->target, link->weight, &link->t);
 		}
 	}
-	return 0;
+	flexBufferFree((void**)&ctx->spooledLinks, &ctx->spooledLinkCount, &ctx->spooledLinkCap);
+	return err;
 }
 
 static bool gmlNextEdge(gmlContext* ctx) {
@@ -447,13 +756,589 @@ static bool gmlNextClientSubnet(gmlContext* ctx, ip4Subnet* subnet) {
 	return true;
 }
 
+// Returns the root of the tree used for the "tree" client order, which is the
+// node with the most links
+static nodeId gmlTreeRoot(const gmlContext* ctx) {
+	nodeId root = 0;
+	for (nodeId id = 1; id < ctx->nodeCount; ++id) {
+		if (ctx->nodeStates[id].degree > ctx->nodeStates[root].degree) root = id;
+	}
+	return root;
+}
+
+// Returns the client nodes in the order in which they should be assigned
+// subnets. The returned array must be freed by the caller. Routes can only be
+// aggregated for clients with adjacent subnets, so the "tree" order follows a
+// depth-first traversal of the shortest path tree toward the best-connected
+// node. Clients in the same subtree then receive a contiguous block of
+// addresses, and nodes outside the subtree tend to reach the entire block
+// through the same neighbor.
+static nodeId* gmlClientOrder(gmlContext* ctx, ClientOrder order) {
+	nodeId* clients = eamalloc(ctx->clientNodes, sizeof(nodeId), 0);
+	size_t clientCount = 0;
+
+	if (order == ClientOrderTree) {
+		nodeId root = gmlTreeRoot(ctx);
+
+		// Children of node i in the tree are children[childStart[i]] to
+		// children[childStart[i+1]-1], in ascending order
+		size_t* childStart = eacalloc(ctx->nodeCount, sizeof(size_t), sizeof(size_t));
+		nodeId* children = eamalloc(ctx->nodeCount, sizeof(nodeId), 0);
+		nodeId* parents = eamalloc(ctx->nodeCount, sizeof(nodeId), 0);
+		for (nodeId id = 0; id < ctx->nodeCount; ++id) {
+			parents[id] = (id == root ? INVALID_NODE_ID : rpNextHop(ctx->routes, id, root));
+			if (parents[id] != INVALID_NODE_ID) ++childStart[parents[id]+1];
+		}
+		for (size_t i = 0; i < ctx->nodeCount; ++i) {
+			childStart[i+1] += childStart[i];
+		}
+		size_t* childFill = eamalloc(ctx->nodeCount, sizeof(size_t), 0);
+		memcpy(childFill, childStart, ctx->nodeCount * sizeof(size_t));
+		for (nodeId id = 0; id < ctx->nodeCount; ++id) {
+			if (parents[id] != INVALID_NODE_ID) children[childFill[parents[id]]++] = id;
+		}
+		free(childFill);
+
+		// Iterative pre-order traversal. The stack holds at most one entry per
+		// node, so we reuse the parents buffer for it.
+		nodeId* stack = parents;
+		size_t stackLen = 0;
+		stack[stackLen++] = root;
+		while (stackLen > 0) {
+			nodeId id = stack[--stackLen];
+			if (ctx->nodeStates[id].isClient) clients[clientCount++] = id;
+			for (size_t i = childStart[id+1]; i > childStart[id]; --i) {
+				stack[stackLen++] = children[i-1];
+			}
+		}
+		free(parents);
+		free(children);
+		free(childStart);
+
+		if (clientCount < ctx->clientNodes) {
+			// Clients that cannot reach the root follow in identifier order
+			bool* added = eacalloc(ctx->nodeCount, sizeof(bool), 0);
+			for (size_t i = 0; i < clientCount; ++i) added[clients[i]] = true;
+			for (nodeId id = 0; id < ctx->nodeCount; ++id) {
+				if (ctx->nodeStates[id].isClient && !added[id]) clients[clientCount++] = id;
+			}
+			free(added);
+		}
+	} else {
+		for (nodeId id = 0; id < ctx->nodeCount; ++id) {
+			if (ctx->nodeStates[id].isClient) clients[clientCount++] = id;
+		}
+	}
+	return clients;
+}
+
+// Assigns a subnet to each client node and sets up its connection to the root
+// namespace. edgePorts lists the Open vSwitch ports of the edge interfaces.
+// Returns 0 on success or an error code otherwise.
+static int gmlAssignClients(gmlContext* ctx, ClientOrder order, const uint32_t edgePorts[], uint32_t* nextOvsPort) {
+	lprintf(LogDebug, "Assigning %u client nodes to %u edge nodes\n", ctx->clientNodes, globalParams->edgeNodeCount);
+	int err = 0;
+	nodeId* clientOrder = gmlClientOrder(ctx, order);
+	for (size_t i = 0; i < ctx->clientNodes; ++i) {
+		nodeId id = clientOrder[i];
+		gmlClientState* client = &ctx->clientStates[ctx->nodeStates[id].clientIdx];
+
+		if (!gmlNextClientSubnet(ctx, &client->subnet)) {
+			lprintln(LogError, "BUG: exhausted client node subnet space");
+			err = 1;
+			break;
+		}
+		size_t edgeIdx = ctx->currentEdgeIdx;
+		if (PASSES_LOG_THRESHOLD(LogDebug)) {
+			char subnet[IP4_CIDR_BUFLEN];
+			ip4SubnetToString(&client->subnet, subnet);
+			lprintf(LogDebug, "Assigned client node %u to subnet %s owned by edge %lu\n", id, subnet, edgeIdx);
+		}
+		if (!phaseSkip(&ctx->clientPhase)) {
+			err = workAddClientRoutes(id, client->macs, &client->subnet, edgePorts[edgeIdx], *nextOvsPort, phaseReplace(&ctx->clientPhase));
+			if (err != 0) break;
+		}
+		// Open vSwitch locks its database file when processing commands, so
+		// the work module serializes these orders for us
+		*nextOvsPort += NEEDED_PORTS_CLIENT;
+		err = phaseAdvance(&ctx->clientPhase, ctx->check);
+		if (err != 0) break;
+	}
+	free(clientOrder);
+	if (err == 0) err = phaseFinish(&ctx->clientPhase, ctx->check);
+	return err;
+}
+
+// Routes for a node that have not been sent to the workers yet
+typedef struct {
+	TopoRoute* routes;
+	size_t len;
+	size_t cap;
+} gmlRouteTable;
+
+// Maximum number of routes sent to a worker in a single order
+static const size_t RoutesPerOrder = 512;
+
+// Builds the routing table of every node and sends it to the workers. The
+// shortest paths to a destination client form a tree (see rpNextHop), so every
+// node in the tree needs exactly one route for the destination's subnet. Walks
+// from the other clients stop as soon as they reach the part of the tree that
+// is already known, so each route is only generated once. Each table is
+// aggregated before it is sent, since clients behind the same edge node have
+// adjacent subnets and frequently share next hops. If defaultRoutes is true,
+// the most common next hop of each node also becomes its default route.
+static int gmlAddRoutes(gmlContext* ctx, bool defaultRoutes) {
+	lprintln(LogDebug, "Building routing tables for paths between all client node pairs");
+
+	int err = 0;
+	nodeId* treeDest = eamalloc(ctx->nodeCount, sizeof(nodeId), 0); // Destination of the last tree containing each node
+	gmlRouteTable* tables = eacalloc(ctx->nodeCount, sizeof(gmlRouteTable), 0);
+	for (size_t id = 0; id < ctx->nodeCount; ++id) {
+		treeDest[id] = INVALID_NODE_ID;
+	}
+
+	bool seenUnroutable = false;
+	uint64_t routeCount = 0;
+	for (nodeId destId = 0; destId < ctx->nodeCount; ++destId) {
+		gmlNodeState* dest = &ctx->nodeStates[destId];
+		if (!dest->isClient) continue;
+		treeDest[destId] = destId;
+
+		for (nodeId startId = 0; startId < ctx->nodeCount; ++startId) {
+			if (!ctx->nodeStates[startId].isClient) continue;
+
+			nodeId id = startId;
+			while (treeDest[id] != destId) {
+				nodeId via = rpNextHop(ctx->routes, id, destId);
+				if (via == INVALID_NODE_ID) {
+					if (!seenUnroutable) {
+						lprintf(LogWarning, "Topology contains unconnected client nodes (e.g., %u to %u is unroutable)\n", startId, destId);
+						seenUnroutable = true;
+					}
+					break;
+				}
+				treeDest[id] = destId;
+
+				gmlRouteTable* table = &tables[id];
+				TopoRoute route = { .subnet = ctx->clientStates[dest->clientIdx].subnet, .via = via, .gateway = ctx->nodeStates[via].addr };
+				flexBufferGrow((void**)&table->routes, table->len, &table->cap, 1, sizeof(TopoRoute));
+				flexBufferAppend(table->routes, &table->len, &route, 1, sizeof(TopoRoute));
+				++routeCount;
+
+				id = via;
+			}
+		}
+	}
+
+	uint64_t aggregatedCount = 0;
+	for (nodeId id = 0; id < ctx->nodeCount; ++id) {
+		gmlRouteTable* table = &tables[id];
+		table->len = rtAggregate(table->routes, table->len);
+		if (defaultRoutes) table->len = rtUseDefaultRoute(table->routes, table->len);
+		aggregatedCount += table->len;
+		// Routes replace existing ones, so resumed tables need no cleanup
+		for (size_t start = 0; start < table->len && !phaseSkip(&ctx->routePhase); start += RoutesPerOrder) {
+			size_t count = table->len - start;
+			if (count > RoutesPerOrder) count = RoutesPerOrder;
+			err = workAddRoutes(id, &table->routes[start], count);
+			if (err != 0) goto cleanup;
+		}
+		err = phaseAdvance(&ctx->routePhase, ctx->check);
+		if (err != 0) goto cleanup;
+	}
+	lprintf(LogDebug, "Requested %lu static routes (%lu before compression)\n", aggregatedCount, routeCount);
+	err = phaseFinish(&ctx->routePhase, ctx->check);
+
+cleanup:
+	for (size_t id = 0; id < ctx->nodeCount; ++id) {
+		flexBufferFree((void**)&tables[id].routes, &tables[id].len, &tables[id].cap);
+	}
+	free(tables);
+	free(treeDest);
+	return err;
+}
+
+// Reads the link weight updates in a file. Each line contains the names of the
+// two nodes joined by a link, followed by the new routing weight of the link.
+// Blank lines and lines beginning with '#' are ignored. Both directions of each
+// link are updated. On success, changes is set to a new array.
+static int gmlReadWeightUpdates(gmlContext* ctx, const char* filename, rpWeightChange** changes, size_t* changeCount) {
+	errno = 0;
+	FILE* file = fopen(filename, "re");
+	if (file == NULL) {
+		int err = errno;
+		lprintf(LogError, "Could not open the link weight updates '%s': %s\n", filename, strerror(err));
+		return err;
+	}
+
+	int err = 0;
+	size_t changeCap;
+	flexBufferInit((void**)changes, changeCount, &changeCap);
+	char* line = NULL;
+	size_t len = 0;
+	size_t lineNum = 0;
+	while (getline(&line, &len, file) != -1) {
+		++lineNum;
+		char* save;
+		const char* sourceName = strtok_r(line, " \t\r\n", &save);
+		if (sourceName == NULL || sourceName[0] == '#') continue;
+		const char* targetName = strtok_r(NULL, " \t\r\n", &save);
+		const char* weightStr = (targetName == NULL ? NULL : strtok_r(NULL, " \t\r\n", &save));
+		float weight = NAN;
+		if (weightStr != NULL && strtok_r(NULL, " \t\r\n", &save) == NULL) {
+			char* weightEnd;
+			weight = strtof(weightStr, &weightEnd);
+			if (*weightEnd != '\0') weight = NAN;
+		}
+		if (!(weight >= 0.f)) {
+			lprintf(LogError, "Line %lu of '%s' is not of the form \"SOURCE TARGET WEIGHT\" with a non-negative weight\n", lineNum, filename);
+			err = 1;
+			break;
+		}
+
+		nodeId sourceId, targetId;
+		float oldWeight;
+		if (!ntFind(ctx->names, sourceName, &sourceId) || !ntFind(ctx->names, targetName, &targetId) || !rpGetWeight(ctx->routes, sourceId, targetId, &oldWeight)) {
+			lprintf(LogError, "Line %lu of '%s' refers to a link between '%s' and '%s', which does not exist in the topology\n", lineNum, filename, sourceName, targetName);
+			err = 1;
+			break;
+		}
+		rpWeightChange linkChanges[2] = {
+			{ .from = sourceId, .to = targetId, .weight = weight },
+			{ .from = targetId, .to = sourceId, .weight = weight },
+		};
+		flexBufferGrow((void**)changes, *changeCount, &changeCap, 2, sizeof(rpWeightChange));
+		flexBufferAppend(*changes, changeCount, linkChanges, 2, sizeof(rpWeightChange));
+	}
+	if (err == 0 && ferror(file)) {
+		lprintf(LogError, "Could not read the link weight updates '%s'\n", filename);
+		err = EIO;
+	}
+	free(line);
+	fclose(file);
+	if (err != 0) flexBufferFree((void**)changes, changeCount, &changeCap);
+	return err;
+}
+
+// Applies the link weight updates recorded in the journal by earlier runs, so
+// that the planned routes match those installed in the network. Updates are
+// only recorded once the routing tables are complete, so this does not affect
+// the routes that a resumed setup still needs to add.
+static int gmlApplyRecordedWeights(gmlContext* ctx) {
+	if (!resuming) return 0;
+
+	int err = 0;
+	rpWeightChange* changes;
+	size_t changeCount, changeCap;
+	flexBufferInit((void**)&changes, &changeCount, &changeCap);
+	size_t batches;
+	for (batches = 0; ; ++batches) {
+		char key[32];
+		uint64_t check;
+		sprintf(key, "weights-%lu", batches);
+		void* data;
+		size_t len;
+		if (!jnGetBlob(journal, key, &data, &len, &check)) {
+			uint64_t unused;
+			if (jnGet(journal, key, &unused, &check)) err = 1; // Damaged data
+			break;
+		}
+		if (check != ctx->check) {
+			lprintln(LogError, "The recorded link weight updates do not match the network topology or configuration. Destroy the network and set it up again without resuming.");
+			free(data);
+			err = 1;
+			break;
+		}
+		const rpWeightChange* batch = data;
+		size_t batchCount = len / sizeof(rpWeightChange);
+		for (size_t i = 0; i < batchCount && err == 0; ++i) {
+			if (batch[i].from >= ctx->nodeCount || batch[i].to >= ctx->nodeCount) {
+				lprintln(LogError, "The setup journal is incomplete");
+				err = 1;
+			}
+		}
+		if (err == 0) {
+			flexBufferGrow((void**)&changes, changeCount, &changeCap, batchCount, sizeof(rpWeightChange));
+			flexBufferAppend(changes, &changeCount, batch, batchCount, sizeof(rpWeightChange));
+		}
+		free(data);
+		if (err != 0) break;
+	}
+	if (err == 0 && changeCount > 0) {
+		lprintf(LogInfo, "Applying %lu link weight updates recorded by %lu earlier runs\n", changeCount, batches);
+		err = rpUpdateWeights(ctx->routes, changes, changeCount, NULL, NULL);
+	}
+
+	flexBufferFree((void**)&changes, &changeCount, &changeCap);
+	return err;
+}
+
+// Records link weight updates in the journal. All of the changes made by one
+// run are stored as a single batch, so that they reach the disk together and
+// an interrupted update is not recorded at all.
+static int gmlRecordWeights(gmlContext* ctx, const rpWeightChange* changes, size_t changeCount) {
+	char key[32];
+	size_t batch = 0;
+	uint64_t unused, check;
+	do {
+		sprintf(key, "weights-%lu", batch++);
+	} while (jnGet(journal, key, &unused, &check));
+	return jnPutBlob(journal, key, changes, changeCount * sizeof(rpWeightChange), ctx->check);
+}
+
+// A route toward a client whose next hop changed after a weight update
+typedef struct {
+	nodeId id;
+	nodeId dest;
+	nodeId oldNextHop;
+	nodeId nextHop;
+} gmlRouteChange;
+
+typedef struct {
+	const gmlContext* ctx;
+	gmlRouteChange* changes;
+	size_t len;
+	size_t cap;
+} gmlRouteChanges;
+
+static int gmlOnRouteChanged(nodeId id, nodeId dest, nodeId oldNextHop, nodeId nextHop, void* userData) {
+	gmlRouteChanges* changes = userData;
+	if (!changes->ctx->nodeStates[dest].isClient) return 0;
+	gmlRouteChange change = { .id = id, .dest = dest, .oldNextHop = oldNextHop, .nextHop = nextHop };
+	flexBufferGrow((void**)&changes->changes, changes->len, &changes->cap, 1, sizeof(gmlRouteChange));
+	flexBufferAppend(changes->changes, &changes->len, &change, 1, sizeof(gmlRouteChange));
+	return 0;
+}
+
+// Sends the routes that changed after a weight update to the workers. Every
+// node with a changed next hop receives a new route, since it may still have a
+// route from an earlier path. Nodes that join the paths from the clients
+// without a changed next hop also receive one, since they may never have needed
+// a route for the destination before. Nodes whose routes did not change and
+// that were already on the paths keep their existing routes. The routes are not
+// aggregated, because existing routes for individual clients would take
+// precedence over them. The changes must be grouped by destination.
+static int gmlSendChangedRoutes(gmlContext* ctx, const gmlRouteChange* changes, size_t changeCount) {
+	int err = 0;
+	nodeId* changedFor = eamalloc(ctx->nodeCount, sizeof(nodeId), 0); // Destination of the last change to each node
+	nodeId* oldHops = eamalloc(ctx->nodeCount, sizeof(nodeId), 0);
+	nodeId* oldTreeDest = eamalloc(ctx->nodeCount, sizeof(nodeId), 0); // As in gmlAddRoutes, for the old paths
+	nodeId* newTreeDest = eamalloc(ctx->nodeCount, sizeof(nodeId), 0);
+	gmlRouteTable* tables = eacalloc(ctx->nodeCount, sizeof(gmlRouteTable), 0);
+	for (size_t id = 0; id < ctx->nodeCount; ++id) {
+		changedFor[id] = INVALID_NODE_ID;
+		oldTreeDest[id] = INVALID_NODE_ID;
+		newTreeDest[id] = INVALID_NODE_ID;
+	}
+
+	bool seenUnroutable = false;
+	uint64_t routeCount = 0;
+	for (size_t first = 0, end = 0; first < changeCount; first = end) {
+		nodeId destId = changes[first].dest;
+		for (end = first; end < changeCount && changes[end].dest == destId; ++end) {
+			changedFor[changes[end].id] = destId;
+			oldHops[changes[end].id] = changes[end].oldNextHop;
+		}
+		const ip4Subnet* subnet = &ctx->clientStates[ctx->nodeStates[destId].clientIdx].subnet;
+
+		// Find the nodes that were on the old paths to the destination
+		oldTreeDest[destId] = destId;
+		for (nodeId startId = 0; startId < ctx->nodeCount; ++startId) {
+			if (!ctx->nodeStates[startId].isClient) continue;
+			nodeId id = startId;
+			while (oldTreeDest[id] != destId) {
+				oldTreeDest[id] = destId;
+				id = (changedFor[id] == destId ? oldHops[id] : rpNextHop(ctx->routes, id, destId));
+				if (id == INVALID_NODE_ID) break;
+			}
+		}
+
+		newTreeDest[destId] = destId;
+		for (nodeId startId = 0; startId < ctx->nodeCount; ++startId) {
+			if (!ctx->nodeStates[startId].isClient) continue;
+			nodeId id = startId;
+			while (newTreeDest[id] != destId) {
+				newTreeDest[id] = destId;
+				nodeId via = rpNextHop(ctx->routes, id, destId);
+				if (via == INVALID_NODE_ID) break;
+				if (changedFor[id] != destId && oldTreeDest[id] == destId) {
+					id = via;
+					continue;
+				}
+				gmlRouteTable* table = &tables[id];
+				TopoRoute route = { .subnet = *subnet, .via = via, .gateway = ctx->nodeStates[via].addr };
+				flexBufferGrow((void**)&table->routes, table->len, &table->cap, 1, sizeof(TopoRoute));
+				flexBufferAppend(table->routes, &table->len, &route, 1, sizeof(TopoRoute));
+				++routeCount;
+				id = via;
+			}
+		}
+
+		// Changed nodes that are no longer on the paths were handled above
+		for (size_t i = first; i < end; ++i) {
+			const gmlRouteChange* change = &changes[i];
+			if (change->nextHop == INVALID_NODE_ID) {
+				if (!seenUnroutable) {
+					lprintf(LogWarning, "Some clients became unreachable after the link weight update, so their old routes were kept (e.g., %u to %u)\n", change->id, destId);
+					seenUnroutable = true;
+				}
+				continue;
+			}
+			if (newTreeDest[change->id] == destId) continue;
+			gmlRouteTable* table = &tables[change->id];
+			TopoRoute route = { .subnet = *subnet, .via = change->nextHop, .gateway = ctx->nodeStates[change->nextHop].addr };
+			flexBufferGrow((void**)&table->routes, table->len, &table->cap, 1, sizeof(TopoRoute));
+			flexBufferAppend(table->routes, &table->len, &route, 1, sizeof(TopoRoute));
+			++routeCount;
+		}
+	}
+
+	for (nodeId id = 0; id < ctx->nodeCount; ++id) {
+		gmlRouteTable* table = &tables[id];
+		for (size_t start = 0; start < table->len; start += RoutesPerOrder) {
+			size_t count = table->len - start;
+			if (count > RoutesPerOrder) count = RoutesPerOrder;
+			err = workAddRoutes(id, &table->routes[start], count);
+			if (err != 0) goto cleanup;
+		}
+	}
+	lprintf(LogInfo, "Requested %lu static routes for %lu changed next hops\n", routeCount, changeCount);
+
+cleanup:
+	for (size_t id = 0; id < ctx->nodeCount; ++id) {
+		flexBufferFree((void**)&tables[id].routes, &tables[id].len, &tables[id].cap);
+	}
+	free(tables);
+	free(newTreeDest);
+	free(oldTreeDest);
+	free(oldHops);
+	free(changedFor);
+	return err;
+}
+
+// Applies link weight updates read by gmlReadWeightUpdates to the network.
+// Only the routes that changed are sent to the workers. Once they are
+// installed, the updates are recorded in the journal, so that later runs start
+// from the updated weights. If the update is interrupted, running it again
+// installs the same routes.
+static int gmlUpdateWeights(gmlContext* ctx, const rpWeightChange* changes, size_t changeCount) {
+	lprintf(LogInfo, "Updating the routes for %lu link weight changes\n", changeCount / 2);
+
+	int err;
+	gmlRouteChanges routeChanges = { .ctx = ctx };
+	flexBufferInit((void**)&routeChanges.changes, &routeChanges.len, &routeChanges.cap);
+	DO_OR_GOTO(rpUpdateWeights(ctx->routes, changes, changeCount, &gmlOnRouteChanged, &routeChanges), cleanup, err);
+	DO_OR_GOTO(gmlSendChangedRoutes(ctx, routeChanges.changes, routeChanges.len), cleanup, err);
+	DO_OR_GOTO(workJoin(false), cleanup, err);
+	err = gmlRecordWeights(ctx, changes, changeCount);
+
+cleanup:
+	flexBufferFree((void**)&routeChanges.changes, &routeChanges.len, &routeChanges.cap);
+	return err;
+}
+
+// Determines the common MTU for all edge interfaces and checks that it is
+// supported. All of the interfaces are queried at once. Returns 0 on success or
+// an error code otherwise.
+static int setupFindMtu(int* mtu) {
+	int err = 0;
+	int* edgeMtus = eamalloc(globalParams->edgeNodeCount, sizeof(int), 0);
+	workRequest* requests = eacalloc(globalParams->edgeNodeCount, sizeof(workRequest), 0);
+	workRequest mtuRequest = 0;
+	for (size_t i = 0; i < globalParams->edgeNodeCount; ++i) {
+		DO_OR_GOTO(workRequestInterfaceMtu(globalParams->edgeNodes[i].intf, &edgeMtus[i], &requests[i]), cleanup, err);
+	}
+	*mtu = 0;
+	for (size_t i = 0; i < globalParams->edgeNodeCount; ++i) {
+		edgeNodeParams *edge = &globalParams->edgeNodes[i];
+		DO_OR_GOTO(workAwait(requests[i]), cleanup, err);
+		int edgeMtu = edgeMtus[i];
+		if (edgeMtu <= 0) {
+			lprintf(LogError, "Interface %s has non-positive MTU: %d\n", edge->intf, edgeMtu);
+		}
+		if (*mtu <= 0) {
+			*mtu = edgeMtu;
+			lprintf(LogDebug, "Using edge MTU %d for network\n", *mtu);
+		} else if (edgeMtu != *mtu) {
+			lprintf(LogError, "Edge interfaces have different MTUs. All interfaces must share the same MTU to avoid segmentation problems. Interface %s has MTU %d, but interface %s has MTU %d.\n", globalParams->edgeNodes[0].intf, *mtu, edge->intf, edgeMtu);
+			err = 1;
+			goto cleanup;
+		}
+	}
+
+	// If we're using a non-standard MTU, make sure that that this feature is supported
+	bool mtuSupported = false;
+	const char* failReason = NULL;
+	DO_OR_GOTO(workRequestMtuSupported(*mtu, &mtuSupported, &failReason, &mtuRequest), cleanup, err);
+	DO_OR_GOTO(workAwait(mtuRequest), cleanup, err);
+	if (!mtuSupported) {
+		lprintf(LogError, "The edge interfaces have their MTU set to %d, which requires \"jumbo packet\" support. %s Alternatively, you can set the edge interface MTUs to the default value to avoid this requirement.\n", *mtu, failReason);
+		err = 1;
+		goto cleanup;
+	}
+
+cleanup:
+	// Requests abandoned after an error still hold slots in the worker pool
+	setupFreeRequests(requests, globalParams->edgeNodeCount);
+	workCancel(mtuRequest);
+	free(edgeMtus);
+	return err;
+}
+
+// Computes a checksum of the parameters that determine the root namespace and
+// the edge node configuration
+static uint64_t setupCheckParams(int mtu) {
+	uint64_t check = JN_CHECK_INIT;
+	check = jnCheck(check, globalParams->nsPrefix, strlen(globalParams->nsPrefix));
+	check = jnCheck(check, &globalParams->rootIsInitNs, sizeof(globalParams->rootIsInitNs));
+	check = jnCheck(check, &mtu, sizeof(mtu));
+	for (size_t i = 0; i < globalParams->edgeNodeCount; ++i) {
+		const edgeNodeParams* edge = &globalParams->edgeNodes[i];
+		check = jnCheck(check, &edge->ip, sizeof(edge->ip));
+		check = jnCheck(check, edge->intf, strlen(edge->intf));
+		check = jnCheck(check, edge->mac.octets, MAC_ADDR_BYTES);
+		check = jnCheck(check, &edge->vsubnet.addr, sizeof(edge->vsubnet.addr));
+		check = jnCheck(check, &edge->vsubnet.prefixLen, sizeof(edge->vsubnet.prefixLen));
+	}
+	return check;
+}
+
+// Records the completion of the root namespace and the edge node setup. The
+// journal is created at this point because the Open vSwitch directory now
+// exists. Returns 0 on success or an error code otherwise.
+static int setupRecordRoot(int mtu, uint64_t rootCheck) {
+	int err = 0;
+	journal = jnOpen(globalParams->ovsDir, false, &err);
+	if (journal == NULL) return err;
+	for (size_t i = 0; i < globalParams->edgeNodeCount; ++i) {
+		char key[32];
+		sprintf(key, "edge-mac-%lu", i);
+		uint64_t value = 0;
+		for (int octet = 0; octet < MAC_ADDR_BYTES; ++octet) {
+			value = (value << 8) | globalParams->edgeNodes[i].mac.octets[octet];
+		}
+		DO_OR_RETURN(jnPut(journal, key, value, rootCheck));
+	}
+	DO_OR_RETURN(jnPut(journal, "mtu", (uint64_t)mtu, rootCheck));
+	return jnPut(journal, "root", 1, rootCheck);
+}
+
 int setupGraphML(const setupGraphMLParams* gmlParams) {
+	if (gmlParams->weightUpdateFile != NULL && (gmlParams->reduceTopology || gmlParams->pruneTopology)) {
+		lprintln(LogError, "Link weights cannot be updated in a reduced or pruned topology, since its nodes no longer correspond to those in the GraphML file");
+		return 1;
+	}
+
 	lprintf(LogInfo, "Reading network topology in GraphML format from %s\n", globalParams->srcFile ? globalParams->srcFile : "<stdin>");
 
 	gmlContext ctx = {
 		.finishedNodes = false,
-		.ignoreNodes = false,
-		.ignoreEdges = false,
+		.spoolLinks = (gmlParams->unsorted || gmlParams->reduceTopology || gmlParams->pruneTopology),
+		.reduceTopology = gmlParams->reduceTopology,
+		.pruneTopology = gmlParams->pruneTopology,
+		.spooledLinks = NULL,
+		.spooledLinkCount = 0,
+		.spooledLinkCap = 0,
 
 		.clientNodes = 0,
 
@@ -464,7 +1349,8 @@ int setupGraphML(const setupGraphMLParams* gmlParams) {
 	};
 	macNextAddr(&ctx.macAddrIter); // Skip all-zeroes address (unassignable)
 	flexBufferInit((void**)&ctx.nodeStates, &ctx.nodeCount, &ctx.nodeCap);
-	ctx.gmlToState = g_hash_table_new_full(&g_str_hash, &g_str_equal, &gmlFreeData, NULL);
+	flexBufferInit((void**)&ctx.clientStates, NULL, &ctx.clientCap);
+	ctx.names = ntNewTable();
 
 	// We assign internal interface addresses from the full IPv4 space, but
 	// avoid the subnets reserved for the edge nodes. The fact that the
@@ -491,6 +1377,10 @@ int setupGraphML(const setupGraphMLParams* gmlParams) {
 	int err;
 	uint32_t* edgePorts = eamalloc(globalParams->edgeNodeCount, sizeof(uint32_t), 0);
 	uint32_t nextOvsPort = 1;
+	workRequest* requests = eacalloc(globalParams->edgeNodeCount, sizeof(workRequest), 0);
+	macAddr* edgeLocalMacs = eamalloc(globalParams->edgeNodeCount, sizeof(macAddr), 0);
+	rpWeightChange* weightChanges = NULL;
+	size_t weightChangeCount = 0;
 
 	ip4Addr rootAddrs[2];
 	for (int i = 0; i < 2; ++i) {
@@ -503,38 +1393,32 @@ int setupGraphML(const setupGraphMLParams* gmlParams) {
 		}
 	}
 
-	// Determine the common MTU for all edge interfaces
-	ctx.mtu = 0;
-	for (size_t i = 0; i < globalParams->edgeNodeCount; ++i) {
-		edgeNodeParams *edge = &globalParams->edgeNodes[i];
-		int edgeMtu;
-		DO_OR_GOTO(workGetInterfaceMtu(edge->intf, &edgeMtu), cleanup, err);
-		if (edgeMtu <= 0) {
-			lprintf(LogError, "Interface %s has non-positive MTU: %d\n", edge->intf, edgeMtu);
+	uint64_t rootCheck = 0;
+	if (resuming) {
+		uint64_t mtu, check;
+		if (!jnGet(journal, "mtu", &mtu, &check) || !jnGet(journal, "root", &check, &rootCheck)) {
+			lprintln(LogError, "The setup journal is incomplete");
+			err = 1;
+			goto cleanup;
 		}
-		if (ctx.mtu <= 0) {
-			ctx.mtu = edgeMtu;
-			lprintf(LogDebug, "Using edge MTU %d for network\n", ctx.mtu);
-		} else if (edgeMtu != ctx.mtu) {
-			lprintf(LogError, "Edge interfaces have different MTUs. All interfaces must share the same MTU to avoid segmentation problems. Interface %s has MTU %d, but interface %s has MTU %d.\n", globalParams->edgeNodes[0].intf, ctx.mtu, edge->intf, edgeMtu);
+		ctx.mtu = (int)mtu;
+		if (setupCheckParams(ctx.mtu) != rootCheck) {
+			lprintln(LogError, "The edge node configuration does not match the interrupted setup. Destroy the network and set it up again without resuming.");
 			err = 1;
 			goto cleanup;
 		}
+	} else {
+		DO_OR_GOTO(setupFindMtu(&ctx.mtu), cleanup, err);
+		rootCheck = setupCheckParams(ctx.mtu);
 	}
 
-	// If we're using a non-standard MTU, make sure that that this feature is supported
-	bool mtuSupported = false;
-	const char* failReason = NULL;
-	DO_OR_GOTO(workMtuSupported(ctx.mtu, &mtuSupported, &failReason), cleanup, err);
-	if (!mtuSupported) {
-		lprintf(LogError, "The edge interfaces have their MTU set to %d, which requires \"jumbo packet\" support. %s Alternatively, you can set the edge interface MTUs to the default value to avoid this requirement.\n", ctx.mtu, failReason);
-		err = 1;
+	err = workAddRoot(rootAddrs[0], rootAddrs[1], ctx.mtu, globalParams->rootIsInitNs, resuming);
+	if (err == 0) err = workJoin(false);
+	if (err != 0) {
+		if (resuming) lprintln(LogError, "Could not connect to the network being resumed. Destroy the network and set it up again without resuming.");
 		goto cleanup;
 	}
 
-	DO_OR_GOTO(workAddRoot(rootAddrs[0], rootAddrs[1], ctx.mtu, globalParams->rootIsInitNs), cleanup, err);
-	DO_OR_GOTO(workJoin(false), cleanup, err);
-
 	// Move all interfaces associated with edge nodes into the root namespace
 	for (size_t i = 0; i < globalParams->edgeNodeCount; ++i) {
 		edgeNodeParams* edge = &globalParams->edgeNodes[i];
@@ -552,50 +1436,55 @@ int setupGraphML(const setupGraphMLParams* gmlParams) {
 			}
 		}
 		if (!duplicateIntf) {
-			DO_OR_GOTO(workAddEdgeInterface(edge->intf), cleanup, err);
-			DO_OR_GOTO(workJoin(false), cleanup, err);
+			if (!resuming) DO_OR_GOTO(workAddEdgeInterface(edge->intf), cleanup, err);
 			edgePorts[i] = nextOvsPort++;
 		}
-
-		macAddr edgeLocalMac;
-		DO_OR_GOTO(workGetEdgeLocalMac(edge->intf, &edgeLocalMac), cleanup, err);
-		DO_OR_GOTO(workAddEdgeRoutes(&edge->vsubnet, edgePorts[i], &edgeLocalMac, &edge->mac), cleanup, err);
+		DO_OR_GOTO(workRequestEdgeLocalMac(edge->intf, &edgeLocalMacs[i], &requests[i]), cleanup, err);
+	}
+	for (size_t i = 0; i < globalParams->edgeNodeCount; ++i) {
+		edgeNodeParams* edge = &globalParams->edgeNodes[i];
+		DO_OR_GOTO(workAwait(requests[i]), cleanup, err);
+		if (!resuming) DO_OR_GOTO(workAddEdgeRoutes(&edge->vsubnet, edgePorts[i], &edgeLocalMacs[i], &edge->mac), cleanup, err);
 	}
 	DO_OR_GOTO(workJoin(false), cleanup, err);
-
-	if (globalParams->srcFile) {
-		int passes = gmlParams->twoPass ? 2 : 1;
-
-		// Setup based on number of passes
-		if (passes > 1) ctx.ignoreEdges = true;
-
-		for (int pass = passes; pass > 0; --pass) {
-			err = gmlParseFile(globalParams->srcFile, &gmlAddNode, &gmlAddLink, &ctx, gmlParams->clientType, gmlParams->weightKey);
-			if (err != 0) goto cleanup;
-
-			// Transitions between passes
-			if (pass == 2) {
-				// Pretend that we've reached the end of the node section in a
-				// sorted file, and ignore any future nodes rather than
-				// raising an error.
-				ctx.finishedNodes = true;
-				ctx.ignoreNodes = true;
-				ctx.ignoreEdges = false;
-			}
-		}
-	} else {
-		if (gmlParams->twoPass) {
-			lprintln(LogError, "Cannot perform two passes when reading a GraphML file from stdin. Either ensure that all nodes appear before edges, or read from a file.");
+	if (!resuming) DO_OR_GOTO(setupRecordRoot(ctx.mtu, rootCheck), cleanup, err);
+
+	// Everything from this point on depends on the topology as well
+	ctx.check = rootCheck;
+	GML_CHECK(&ctx, gmlParams->clientOrder);
+	GML_CHECK(&ctx, gmlParams->defaultRoutes);
+	phaseInit(&ctx.hostPhase, "hosts", "hosts");
+	phaseInit(&ctx.linkPhase, "links", "links");
+	phaseInit(&ctx.clientPhase, "clients", "client connections");
+	phaseInit(&ctx.routePhase, "routes", "routing tables");
+	if (resuming) {
+		// Make sure that the hosts that we skip still exist
+		nodeId hostCount;
+		workRequest countRequest;
+		DO_OR_GOTO(workRequestHostCount(&hostCount, &countRequest), cleanup, err);
+		DO_OR_GOTO(workAwait(countRequest), cleanup, err);
+		if (hostCount < ctx.hostPhase.resumeAt) {
+			lprintf(LogError, "Only %u of the %lu hosts created by the interrupted setup still exist. Destroy the network and set it up again without resuming.\n", hostCount, ctx.hostPhase.resumeAt);
 			err = 1;
 			goto cleanup;
-
 		}
-		err = gmlParse(stdin, &gmlAddNode, &gmlAddLink, &ctx, gmlParams->clientType, gmlParams->weightKey);
 	}
 
-	DO_OR_GOTO(workJoin(false), cleanup, err);
+	if (globalParams->srcFile) {
+		err = gmlParseFile(globalParams->srcFile, &gmlAddNode, &gmlAddLink, &ctx, gmlParams->clientType, gmlParams->weightKey);
+	} else {
+		err = gmlParse(stdin, &gmlAddNode, &gmlAddLink, &ctx, gmlParams->clientType, gmlParams->weightKey);
+	}
+	if (err != 0) goto cleanup;
+	if (ctx.spoolLinks) {
+		DO_OR_GOTO(gmlAddSpooledLinks(&ctx), cleanup, err);
+	}
+	if (ctx.routes != NULL) {
+		DO_OR_GOTO(phaseFinish(&ctx.linkPhase, ctx.check), cleanup, err);
+	}
 
-	// Host and link construction is finished. Now we set up routing
+	// Host and link construction continues in the workers while we plan routes.
+	// Later orders automatically wait for the hosts and links that they use.
 	lprintln(LogInfo, "Setting up static routing for the network");
 
 	if (ctx.routes == NULL) {
@@ -603,76 +1492,51 @@ int setupGraphML(const setupGraphMLParams* gmlParams) {
 		err = 1;
 		goto cleanup;
 	}
-	rpPlanRoutes(ctx.routes);
-
-	lprintf(LogDebug, "Assigning %u client nodes to %u edge nodes\n", ctx.clientNodes, globalParams->edgeNodeCount);
-	for (size_t id = 0; id < ctx.nodeCount; ++id) {
-		gmlNodeState* node = &ctx.nodeStates[id];
-		if (!node->isClient) continue;
-
-		if (!gmlNextClientSubnet(&ctx, &node->clientSubnet)) {
-			lprintln(LogError, "BUG: exhausted client node subnet space");
-			goto cleanup;
-		}
-		size_t edgeIdx = ctx.currentEdgeIdx;
-		if (PASSES_LOG_THRESHOLD(LogDebug)) {
-			char subnet[IP4_CIDR_BUFLEN];
-			ip4SubnetToString(&node->clientSubnet, subnet);
-			lprintf(LogDebug, "Assigned client node %u to subnet %s owned by edge %lu\n", id, subnet, edgeIdx);
-		}
-		DO_OR_GOTO(workAddClientRoutes((nodeId)id, node->clientMacs, &node->clientSubnet, edgePorts[edgeIdx], nextOvsPort), cleanup, err);
-		nextOvsPort += NEEDED_PORTS_CLIENT;
-		// We need to join here because Open vSwitch locks the database file
-		// when processing commands. They cannot be parallelized.
-		DO_OR_GOTO(workJoin(false), cleanup, err);
+	if (gmlParams->weightUpdateFile != NULL) {
+		// The updates are read before planning so that mistakes are found early
+		DO_OR_GOTO(gmlReadWeightUpdates(&ctx, gmlParams->weightUpdateFile, &weightChanges, &weightChangeCount), cleanup, err);
+	}
+	if (gmlParams->routeCacheDir != NULL) {
+		rpSetCache(ctx.routes, gmlParams->routeCacheDir, gmlParams->routeCacheSize);
+	}
+	for (nodeId id = 0; id < ctx.nodeCount; ++id) {
+		if (ctx.nodeStates[id].isClient) rpAddDestination(ctx.routes, id);
+	}
+	if (gmlParams->clientOrder == ClientOrderTree) {
+		rpAddDestination(ctx.routes, gmlTreeRoot(&ctx));
+	}
+	// Planning is CPU-bound, so we run it in the background. Unless the order of
+	// the client subnets depends on the routes, the workers can set up the
+	// client routes and flows in the meantime.
+	rpStartPlanning(ctx.routes);
+	bool assignDuringPlanning = (gmlParams->clientOrder != ClientOrderTree);
+	if (assignDuringPlanning) {
+		DO_OR_GOTO(gmlAssignClients(&ctx, gmlParams->clientOrder, edgePorts, &nextOvsPort), cleanup, err);
+	}
+	DO_OR_GOTO(rpFinishPlanning(ctx.routes), cleanup, err);
+	if (!assignDuringPlanning) {
+		DO_OR_GOTO(gmlAssignClients(&ctx, gmlParams->clientOrder, edgePorts, &nextOvsPort), cleanup, err);
 	}
 
-	// Build routes between every pair of client nodes
-	lprintln(LogDebug, "Adding static routes along paths for all client node pairs");
-	bool seenUnroutable = false;
-	for (nodeId startId = 0; startId < ctx.nodeCount; ++startId) {
-		gmlNodeState* start = &ctx.nodeStates[startId];
-		if (!start->isClient) continue;
-
-		for (nodeId endId = startId+1; endId < ctx.nodeCount; ++endId) {
-			gmlNodeState* end = &ctx.nodeStates[endId];
-			if (!end->isClient) continue;
-
-			lprintf(LogDebug, "Constructing route from client %u to %u\n", startId, endId);
-			nodeId* path;
-			nodeId steps;
-			if (!rpGetRoute(ctx.routes, startId, endId, &path, &steps)) {
-				if (!seenUnroutable) {
-					lprintf(LogWarning, "Topology contains unconnected client nodes (e.g., %u to %u is unroutable)\n", startId, endId);
-					seenUnroutable = true;
-				}
-				continue;
-			}
-			if (steps < 2) {
-				lprintf(LogError, "BUG: route from client %u to %u has %d steps\n", startId, endId, steps);
-				continue;
-			}
-
-			nodeId prevId = path[0];
-			for (nodeId step = 1; step < steps; ++step) {
-				nodeId nextId = path[step];
-				lprintf(LogDebug, "Hop %d for %u => %u: %u => %u\n", step, startId, endId, prevId, nextId);
-				DO_OR_GOTO(workAddInternalRoutes(prevId, nextId, ctx.nodeStates[prevId].addr, ctx.nodeStates[nextId].addr, &start->clientSubnet, &end->clientSubnet), cleanup, err);
-				// Another join mandated by locking Open vSwitch commands
-				DO_OR_GOTO(workJoin(false), cleanup, err);
+	DO_OR_GOTO(gmlAddRoutes(&ctx, gmlParams->defaultRoutes), cleanup, err);
+	DO_OR_GOTO(workJoin(false), cleanup, err);
 
-				prevId = nextId;
-			}
-		}
+	DO_OR_GOTO(gmlApplyRecordedWeights(&ctx), cleanup, err);
+	if (weightChanges != NULL) {
+		DO_OR_GOTO(gmlUpdateWeights(&ctx, weightChanges, weightChangeCount), cleanup, err);
 	}
-	DO_OR_GOTO(workJoin(false), cleanup, err);
 
 cleanup:
 	if (ctx.clientIter != NULL) ip4FreeFragIter(ctx.clientIter);
 	if (ctx.routes != NULL) rpFreePlan(ctx.routes);
-	g_hash_table_destroy(ctx.gmlToState);
+	ntFreeTable(ctx.names);
 	ip4FreeIter(ctx.intfAddrIter);
 	flexBufferFree((void**)&ctx.nodeStates, &ctx.nodeCount, &ctx.nodeCap);
+	flexBufferFree((void**)&ctx.clientStates, NULL, &ctx.clientCap);
+	flexBufferFree((void**)&ctx.spooledLinks, &ctx.spooledLinkCount, &ctx.spooledLinkCap);
 	free(edgePorts);
+	setupFreeRequests(requests, globalParams->edgeNodeCount);
+	free(edgeLocalMacs);
+	free(weightChanges);
 	return err;
 }
@@ -51,6 +51,8 @@ typedef struct {
 
 	bool destroyOnly;      // If true, networks are destroyed and no new ones are set up
 	bool keepOldNetworks;  // If true, networks are not destroyed before setting up new ones
+	bool resume;           // If true, an interrupted setup recorded in the journal is continued
+	bool requireResume;    // If true, it is an error if resume finds no recorded setup
 
 	// srcFile is the path to a file containing the network topology in the
 	// appropriate format. If it is NULL, then stdin is used instead.
@@ -74,22 +76,43 @@ typedef struct {
 	} edgeNodeDefaults;
 
 	uint64_t softMemCap; // (Very) approximate memory use
+
+	bool workerThreads; // If true, workers are threads rather than processes
 } setupParams;
 
+// Orders in which client nodes are assigned subnets
+typedef enum {
+	ClientOrderId,   // Order of appearance in the topology
+	ClientOrderTree, // Depth-first order of a shortest path tree
+} ClientOrder;
+
 typedef struct {
 	// Divisor to convert bandwidth rates in the GraphML file into Mbit/s.
 	float bandwidthDivisor;
 
-	bool twoPass; // True if the file contains node elements after edge elements
+	bool unsorted; // True if the file contains node elements after edge elements
+	bool reduceTopology; // If true, transit chains and zero-cost links are contracted
+	bool pruneTopology; // If true, nodes that are not on any shortest path between clients are removed
 
 	const char* weightKey; // Data key used for static routing computation
 	const char* clientType; // Value for "type" identifying client nodes
+
+	bool defaultRoutes; // If true, each node's most common next hop becomes its default route
+	ClientOrder clientOrder; // Order in which clients receive adjacent subnets
+
+	const char* routeCacheDir; // Directory for cached routes, or NULL to disable caching
+	uint64_t routeCacheSize;   // Maximum size of the route cache, in bytes
+
+	// File with new weights for links of the existing network, or NULL. The
+	// setup must be resumed, and only the routes that changed are installed.
+	const char* weightUpdateFile;
 } setupGraphMLParams;
 
 // Initializes the setup system. setupConfigure must be called before any
-// source-specific setup functions. Returns 0 on success or an error code
+// source-specific setup functions. If workerThreads is true, the workers run as
+// threads of the calling process. Returns 0 on success or an error code
 // otherwise.
-int setupInit(void);
+int setupInit(bool workerThreads);
 
 // Configures the setup system with the given global parameters. Returns 0 on
 // success or an error code otherwise.
@@ -99,6 +122,10 @@ int setupConfigure(const setupParams* params);
 // setup calls after this.
 int setupCleanup(void);
 
+// Returns true if a failed setup left enough progress in the journal to be
+// continued by a later run with the resume parameter.
+bool setupCanResume(void);
+
 // Sets up a virtual network from a GraphML topology. Returns 0 on success or an
 // error code otherwise.
 int setupGraphML(const setupGraphMLParams* gmlParams);
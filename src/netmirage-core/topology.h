@@ -24,6 +24,8 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+#include "ip.h"
+
 typedef uint32_t nodeId;
 #define MAX_NODE_ID     (UINT32_MAX-1)
 #define INVALID_NODE_ID (UINT32_MAX)
@@ -46,3 +48,19 @@ typedef struct {
 	double jitter;
 	uint32_t queueLen;
 } TopoLink;
+
+// A link between two specific nodes, along with its routing weight
+typedef struct {
+	nodeId source;
+	nodeId target;
+	float weight;
+	TopoLink t;
+} TopoEdge;
+
+// A static route in the routing table of a node. Traffic for the subnet is
+// forwarded over the link to a neighboring node.
+typedef struct {
+	ip4Subnet subnet;
+	nodeId via;
+	ip4Addr gateway; // Address of the neighbor
+} TopoRoute;
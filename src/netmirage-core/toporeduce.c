@@ -0,0 +1,391 @@
+/*******************************************************************************
+ * Copyright © 2018 Nik Unger, Ian Goldberg, Qatar University, and the Qatar
+ * Foundation for Education, Science and Community Development.
+ *
+ * This file is part of NetMirage.
+ *
+ * NetMirage is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * NetMirage is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Affero General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with NetMirage. If not, see <http://www.gnu.org/licenses/>.
+ *******************************************************************************/
+#include "toporeduce.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+#include "mem.h"
+#include "nodeheap.h"
+
+// A chain of transit nodes that can be replaced by a single link
+typedef struct {
+	TopoEdge combined;
+	size_t firstLink; // Index of the chain's first link in the chain link buffer
+	size_t linkCount;
+} trChain;
+
+static nodeId trFind(nodeId parents[], nodeId id) {
+	while (parents[id] != id) {
+		parents[id] = parents[parents[id]];
+		id = parents[id];
+	}
+	return id;
+}
+
+static bool trIsZeroCost(const TopoEdge* link) {
+	return link->weight == 0.f && link->t.latency == 0.0 && link->t.jitter == 0.0 && link->t.packetLoss == 0.0;
+}
+
+// Updates a link to also include the characteristics of a link that follows it
+static void trAppendLink(TopoEdge* combined, const TopoEdge* next) {
+	combined->weight += next->weight;
+	combined->t.latency += next->t.latency;
+	combined->t.packetLoss = 1.0 - (1.0 - combined->t.packetLoss) * (1.0 - next->t.packetLoss);
+	combined->t.jitter = sqrt(combined->t.jitter * combined->t.jitter + next->t.jitter * next->t.jitter);
+	if (combined->t.queueLen == 0 || next->t.queueLen == 0) {
+		combined->t.queueLen = 0; // Either queue uses the default length
+	} else if (UINT32_MAX - combined->t.queueLen < next->t.queueLen) {
+		combined->t.queueLen = UINT32_MAX;
+	} else {
+		combined->t.queueLen += next->t.queueLen;
+	}
+}
+
+// Links are undirected, so the key ignores the direction
+static uint64_t trPairKey(const TopoEdge* link) {
+	nodeId low = (link->source < link->target ? link->source : link->target);
+	nodeId high = (link->source < link->target ? link->target : link->source);
+	return ((uint64_t)low << 32) | high;
+}
+
+static int trComparePairs(const void* a, const void* b) {
+	uint64_t keyA = trPairKey(a);
+	uint64_t keyB = trPairKey(b);
+	if (keyA != keyB) return (keyA < keyB ? -1 : 1);
+	return 0;
+}
+
+// Orders links by their endpoints, and then by increasing weight
+static int trCompareLinks(const void* a, const void* b) {
+	int res = trComparePairs(a, b);
+	if (res != 0) return res;
+	float weightA = ((const TopoEdge*)a)->weight;
+	float weightB = ((const TopoEdge*)b)->weight;
+	if (weightA != weightB) return (weightA < weightB ? -1 : 1);
+	return 0;
+}
+
+static int trCompareChains(const void* a, const void* b) {
+	return trCompareLinks(&((const trChain*)a)->combined, &((const trChain*)b)->combined);
+}
+
+// Returns true if the sorted links contain a link between the same nodes
+static bool trHasLink(const TopoEdge links[], size_t count, const TopoEdge* link) {
+	return bsearch(link, links, count, sizeof(TopoEdge), &trComparePairs) != NULL;
+}
+
+static nodeId trOtherEnd(const TopoEdge* link, nodeId id) {
+	return (link->source == id ? link->target : link->source);
+}
+
+// Builds the adjacency lists (without self links). The links of node i are
+// adjacent[adjacentStart[i]] to adjacent[adjacentStart[i+1]-1]. The caller
+// must free both arrays.
+static void trBuildAdjacency(nodeId nodeCount, const TopoEdge links[], size_t count, size_t** adjacentStart, size_t** adjacent) {
+	size_t* start = eacalloc(nodeCount, sizeof(size_t), sizeof(size_t));
+	for (size_t i = 0; i < count; ++i) {
+		if (links[i].source == links[i].target) continue;
+		++start[links[i].source+1];
+		++start[links[i].target+1];
+	}
+	for (nodeId id = 0; id < nodeCount; ++id) {
+		start[id+1] += start[id];
+	}
+	size_t* adj = eamalloc(start[nodeCount], sizeof(size_t), 0);
+	size_t* fill = eamalloc(nodeCount, sizeof(size_t), 0);
+	memcpy(fill, start, nodeCount * sizeof(size_t));
+	for (size_t i = 0; i < count; ++i) {
+		if (links[i].source == links[i].target) continue;
+		adj[fill[links[i].source]++] = i;
+		adj[fill[links[i].target]++] = i;
+	}
+	free(fill);
+	*adjacentStart = start;
+	*adjacent = adj;
+}
+
+// Assigns consecutive identifiers to the nodes that were not removed and
+// updates the link endpoints. Returns the number of remaining nodes.
+static nodeId trRenumber(nodeId nodeCount, const bool removed[], TopoEdge links[], size_t count, nodeId nodeMap[]) {
+	nodeId remaining = 0;
+	for (nodeId id = 0; id < nodeCount; ++id) {
+		nodeMap[id] = removed[id] ? INVALID_NODE_ID : remaining++;
+	}
+	for (size_t i = 0; i < count; ++i) {
+		links[i].source = nodeMap[links[i].source];
+		links[i].target = nodeMap[links[i].target];
+	}
+	return remaining;
+}
+
+nodeId trReduce(nodeId nodeCount, const bool isClient[], TopoEdge links[], size_t* linkCount, nodeId nodeMap[]) {
+	size_t count = *linkCount;
+
+	// Merge the endpoints of zero-cost links. Each group of merged nodes is
+	// represented by its client, if it has one.
+	nodeId* parents = eamalloc(nodeCount, sizeof(nodeId), 0);
+	bool* hasClient = eamalloc(nodeCount, sizeof(bool), 0);
+	for (nodeId id = 0; id < nodeCount; ++id) {
+		parents[id] = id;
+		hasClient[id] = isClient[id];
+	}
+	nodeId mergedNodes = 0;
+	for (size_t i = 0; i < count; ++i) {
+		TopoEdge* link = &links[i];
+		if (link->source == link->target || !trIsZeroCost(link)) continue;
+		nodeId keep = trFind(parents, link->source);
+		nodeId merge = trFind(parents, link->target);
+		if (keep == merge || (hasClient[keep] && hasClient[merge])) continue;
+		if (hasClient[merge]) {
+			nodeId tmp = keep;
+			keep = merge;
+			merge = tmp;
+		}
+		parents[merge] = keep;
+		++mergedNodes;
+	}
+	free(hasClient);
+
+	// Move the links to the merged nodes. Links within a group are dropped,
+	// since the group is connected at zero cost. Self links only matter for
+	// clients, so the others are dropped as well.
+	size_t kept = 0;
+	for (size_t i = 0; i < count; ++i) {
+		TopoEdge link = links[i];
+		nodeId source = trFind(parents, link.source);
+		nodeId target = trFind(parents, link.target);
+		if (link.source == link.target) {
+			if (!isClient[link.source]) continue;
+		} else if (source == target) {
+			continue;
+		}
+		link.source = source;
+		link.target = target;
+		links[kept++] = link;
+	}
+	count = kept;
+
+	// Routing only ever uses the cheapest of several parallel links
+	if (count > 0) qsort(links, count, sizeof(TopoEdge), &trCompareLinks);
+	kept = 0;
+	for (size_t i = 0; i < count; ++i) {
+		if (kept > 0 && trComparePairs(&links[kept-1], &links[i]) == 0) continue;
+		links[kept++] = links[i];
+	}
+	count = kept;
+
+	size_t* adjacentStart;
+	size_t* adjacent;
+	trBuildAdjacency(nodeCount, links, count, &adjacentStart, &adjacent);
+
+	#define IS_INTERIOR(id) (!isClient[(id)] && adjacentStart[(id)+1] - adjacentStart[(id)] == 2)
+
+	// Find the maximal chains of interior nodes. Every interior node belongs
+	// to exactly one chain.
+	trChain* chains;
+	size_t chainCount, chainCap;
+	size_t* chainLinks;
+	size_t chainLinkCount, chainLinkCap;
+	flexBufferInit((void**)&chains, &chainCount, &chainCap);
+	flexBufferInit((void**)&chainLinks, &chainLinkCount, &chainLinkCap);
+	bool* visited = eacalloc(nodeCount, sizeof(bool), 0);
+	for (nodeId start = 0; start < nodeCount; ++start) {
+		if (visited[start] || !IS_INTERIOR(start)) continue;
+		visited[start] = true;
+
+		size_t firstLink = chainLinkCount;
+		nodeId ends[2];
+		bool cycle = false;
+		for (int side = 0; side < 2 && !cycle; ++side) {
+			nodeId id = start;
+			size_t via = adjacent[adjacentStart[start] + (size_t)side];
+			while (true) {
+				flexBufferGrow((void**)&chainLinks, chainLinkCount, &chainLinkCap, 1, sizeof(size_t));
+				flexBufferAppend(chainLinks, &chainLinkCount, &via, 1, sizeof(size_t));
+				id = trOtherEnd(&links[via], id);
+				if (id == start) {
+					cycle = true;
+					break;
+				}
+				if (!IS_INTERIOR(id)) break;
+				visited[id] = true;
+				size_t* nodeLinks = &adjacent[adjacentStart[id]];
+				via = (nodeLinks[0] == via ? nodeLinks[1] : nodeLinks[0]);
+			}
+			ends[side] = id;
+		}
+		if (cycle || ends[0] == ends[1]) {
+			// Isolated rings and loops carry no traffic between clients, but
+			// we leave them alone rather than changing the topology further
+			chainLinkCount = firstLink;
+			continue;
+		}
+
+		trChain chain = { .combined = links[chainLinks[firstLink]], .firstLink = firstLink, .linkCount = chainLinkCount - firstLink };
+		for (size_t i = firstLink+1; i < chainLinkCount; ++i) {
+			trAppendLink(&chain.combined, &links[chainLinks[i]]);
+		}
+		chain.combined.source = ends[0];
+		chain.combined.target = ends[1];
+		flexBufferGrow((void**)&chains, chainCount, &chainCap, 1, sizeof(trChain));
+		flexBufferAppend(chains, &chainCount, &chain, 1, sizeof(trChain));
+	}
+	#undef IS_INTERIOR
+	free(visited);
+	free(adjacent);
+	free(adjacentStart);
+
+	// A chain can only be contracted if the new link does not duplicate an
+	// existing one. Of several parallel chains, the cheapest is contracted.
+	bool* removed = eacalloc(nodeCount, sizeof(bool), 0);
+	bool* deadLinks = eacalloc(count, sizeof(bool), 0);
+	size_t newLinkCount = 0;
+	nodeId chainNodes = 0;
+	if (chainCount > 0) qsort(chains, chainCount, sizeof(trChain), &trCompareChains);
+	for (size_t c = 0; c < chainCount; ++c) {
+		trChain* chain = &chains[c];
+		if (c > 0 && trComparePairs(&chains[c-1].combined, &chain->combined) == 0) continue;
+		if (trHasLink(links, count, &chain->combined)) continue;
+		for (size_t i = chain->firstLink; i < chain->firstLink + chain->linkCount; ++i) {
+			TopoEdge* link = &links[chainLinks[i]];
+			deadLinks[chainLinks[i]] = true;
+			if (link->source != chain->combined.source && link->source != chain->combined.target) removed[link->source] = true;
+			if (link->target != chain->combined.source && link->target != chain->combined.target) removed[link->target] = true;
+		}
+		chainNodes += (nodeId)(chain->linkCount - 1);
+		// The new links are compacted at the front of the chain array. This
+		// never overwrites a chain that has yet to be compared.
+		chains[newLinkCount++].combined = chain->combined;
+	}
+	flexBufferFree((void**)&chainLinks, &chainLinkCount, &chainLinkCap);
+
+	kept = 0;
+	for (size_t i = 0; i < count; ++i) {
+		if (!deadLinks[i]) links[kept++] = links[i];
+	}
+	// Each chain has at least two links, so the new links always fit in the
+	// space freed by the dead ones
+	for (size_t i = 0; i < newLinkCount; ++i) {
+		links[kept++] = chains[i].combined;
+	}
+	count = kept;
+	free(deadLinks);
+	flexBufferFree((void**)&chains, &chainCount, &chainCap);
+
+	for (nodeId id = 0; id < nodeCount; ++id) {
+		if (parents[id] != id) removed[id] = true;
+	}
+	nodeId remaining = trRenumber(nodeCount, removed, links, count, nodeMap);
+	free(removed);
+	free(parents);
+
+	lprintf(LogInfo, "Topology reduction merged %u nodes connected by zero-cost links and contracted %u transit nodes in chains (%u nodes and %lu links remain, down from %u and %lu)\n", mergedNodes, chainNodes, remaining, count, nodeCount, *linkCount);
+	*linkCount = count;
+	return remaining;
+}
+
+nodeId trPrune(nodeId nodeCount, const bool isClient[], TopoEdge links[], size_t* linkCount, nodeId nodeMap[]) {
+	size_t count = *linkCount;
+	size_t* adjacentStart;
+	size_t* adjacent;
+	trBuildAdjacency(nodeCount, links, count, &adjacentStart, &adjacent);
+
+	// We only need shortest paths from the clients, so we run Dijkstra's
+	// algorithm once per client rather than planning routes for all nodes.
+	// Each search marks the paths to the clients with higher identifiers.
+	bool* usedNodes = eacalloc(nodeCount, sizeof(bool), 0);
+	bool* usedLinks = eacalloc(count, sizeof(bool), 0);
+	float* dist = eamalloc(nodeCount, sizeof(float), 0);
+	size_t* predLink = eamalloc(nodeCount, sizeof(size_t), 0);
+	nodeId* treeStamp = eamalloc(nodeCount, sizeof(nodeId), 0); // Last search that marked the node
+	nhEntry* heap;
+	size_t heapLen, heapCap;
+	flexBufferInit((void**)&heap, &heapLen, &heapCap);
+	for (nodeId id = 0; id < nodeCount; ++id) {
+		treeStamp[id] = INVALID_NODE_ID;
+		if (isClient[id]) usedNodes[id] = true;
+	}
+
+	for (nodeId source = 0; source < nodeCount; ++source) {
+		if (!isClient[source]) continue;
+
+		for (nodeId id = 0; id < nodeCount; ++id) {
+			dist[id] = INFINITY;
+		}
+		dist[source] = 0.f;
+		predLink[source] = SIZE_MAX;
+		heapLen = 0;
+		nhPush(&heap, &heapLen, &heapCap, 0.f, source);
+		while (heapLen > 0) {
+			nhEntry entry;
+			nhPop(heap, &heapLen, &entry);
+			if (entry.dist > dist[entry.id]) continue; // Stale entry
+			for (size_t i = adjacentStart[entry.id]; i < adjacentStart[entry.id+1]; ++i) {
+				size_t linkIdx = adjacent[i];
+				nodeId next = trOtherEnd(&links[linkIdx], entry.id);
+				float nextDist = entry.dist + links[linkIdx].weight;
+				if (nextDist < dist[next]) {
+					dist[next] = nextDist;
+					predLink[next] = linkIdx;
+					nhPush(&heap, &heapLen, &heapCap, nextDist, next);
+				}
+			}
+		}
+
+		treeStamp[source] = source;
+		for (nodeId target = source+1; target < nodeCount; ++target) {
+			if (!isClient[target] || dist[target] == INFINITY) continue;
+			for (nodeId id = target; treeStamp[id] != source;) {
+				treeStamp[id] = source;
+				usedNodes[id] = true;
+				usedLinks[predLink[id]] = true;
+				id = trOtherEnd(&links[predLink[id]], id);
+			}
+		}
+	}
+	flexBufferFree((void**)&heap, &heapLen, &heapCap);
+	free(treeStamp);
+	free(predLink);
+	free(dist);
+	free(adjacent);
+	free(adjacentStart);
+
+	size_t kept = 0;
+	for (size_t i = 0; i < count; ++i) {
+		bool clientSelfLink = (links[i].source == links[i].target && isClient[links[i].source]);
+		if (usedLinks[i] || clientSelfLink) links[kept++] = links[i];
+	}
+	count = kept;
+	free(usedLinks);
+
+	for (nodeId id = 0; id < nodeCount; ++id) {
+		usedNodes[id] = !usedNodes[id]; // Now indicates removed nodes
+	}
+	nodeId remaining = trRenumber(nodeCount, usedNodes, links, count, nodeMap);
+	free(usedNodes);
+
+	lprintf(LogInfo, "Pruning removed %u nodes and %lu links that are not on any shortest path between clients (%u nodes and %lu links remain)\n", nodeCount - remaining, *linkCount - count, remaining, count);
+	*linkCount = count;
+	return remaining;
+}
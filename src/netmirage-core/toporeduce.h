@@ -0,0 +1,54 @@
+/*******************************************************************************
+ * Copyright © 2018 Nik Unger, Ian Goldberg, Qatar University, and the Qatar
+ * Foundation for Education, Science and Community Development.
+ *
+ * This file is part of NetMirage.
+ *
+ * NetMirage is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * NetMirage is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Affero General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with NetMirage. If not, see <http://www.gnu.org/licenses/>.
+ *******************************************************************************/
+#pragma once
+
+// This module simplifies a topology before it is emulated, while preserving
+// the characteristics of the paths between client nodes.
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "topology.h"
+
+// Reduces a topology with nodeCount nodes and the given links, where isClient
+// indicates which nodes are clients. Two transformations are applied:
+// - Links with no latency, jitter, loss, or routing weight are contracted by
+//   merging their endpoints, unless both sides contain a client.
+// - Chains of non-client nodes that have exactly two neighbors are replaced by
+//   single links between the ends of the chains. The latencies and routing
+//   weights of the links in the chain are summed, their loss rates are
+//   compounded, and their jitter variances are summed.
+// Duplicate links between the same nodes are also reduced to the one with the
+// lowest weight. Client nodes are never removed.
+//
+// The links array is modified in place and linkCount is updated. Link
+// endpoints are renumbered so that the remaining nodes have consecutive
+// identifiers in their original order. nodeMap must have space for nodeCount
+// entries; for each original node, it receives the new identifier, or
+// INVALID_NODE_ID if the node was removed. Returns the number of remaining
+// nodes.
+nodeId trReduce(nodeId nodeCount, const bool isClient[], TopoEdge links[], size_t* linkCount, nodeId nodeMap[]);
+
+// Removes the nodes and links that are not part of a shortest path (according
+// to the link weights) between any two clients. If several shortest paths
+// exist, at least one of them is kept. Client nodes and their self links are
+// never removed. The parameters and result have the same meaning as for
+// trReduce.
+nodeId trPrune(nodeId nodeCount, const bool isClient[], TopoEdge links[], size_t* linkCount, nodeId nodeMap[]);
@@ -31,6 +31,7 @@
 #include <glib.h>
 #include <unistd.h>
 
+#include "channel.h"
 #include "ip.h"
 #include "log.h"
 #include "mem.h"
@@ -42,22 +43,34 @@
  * 1) Enable parallel execution of kernel commands
  * 2) Isolate elevated privileges from the main program I/O
  * The primary constraint informing the design is that many of the kernel calls
- * performed by the functions in net.h operate on the process' active network
- * namespace. Since there can only be one active network namespace per PID, this
- * means that achieving parallelization requires a process pool rather than a
- * thread pool.
+ * performed by the functions in net.h operate on the caller's active network
+ * namespace. Each thread has only one active network namespace, so every
+ * worker must run in its own thread, and must switch namespaces as it moves
+ * between nodes. By default, each worker is a separate process, which also
+ * satisfies the second goal. An alternative backend runs the workers as
+ * threads of the main process instead (see below).
  *
- * Given these objectives and constraint, we use the following architecture:
+ * Given these objectives and constraint, the default backend uses the
+ * following architecture:
  * - An unprivileged main process
  * - Calls to the work module generate work order structures defining the call
- * - A custom thread pool running in the main process receives work orders
- * - Each order thread in the main process serializes incoming orders and sends
- *   them through a pipe to the associated worker process
+ * - Work orders are routed to per-worker queues in the main process according
+ *   to the nodes that they operate on (see below)
+ * - Each order thread in the main process serializes orders from its queue and
+ *   sends them through a shared memory ring (or, if shared memory is not
+ *   available, a pipe) to the associated worker process. Orders are
+ *   encoded in compact variable-length frames, and frames are sent in batches
+ *   whenever the queue runs dry
  * - Worker processes call the appropriate kernel interfaces to fulfill orders
  * - Worker processes send serialized responses or log messages back through a
- *   reverse pipe to the main process, as necessary
+ *   reverse ring or pipe to the main process, as necessary. Responses are
+ *   batched in the same way, and are flushed before the worker waits for more
+ *   orders
  * - In the main process, each worker has an associated response thread that
- *   receives responses and relays them to the main thread
+ *   receives responses and relays them to the main thread. Orders that produce
+ *   a result are tagged with a request identifier, and the result is stored in
+ *   the caller's buffer when the tagged response arrives. This allows the main
+ *   thread to have many requests outstanding at once
  *
  * All of the state associated with a worker (e.g, pipe descriptors and thread
  * pointers) is stored in a "workplace". There are two different perspectives of
@@ -65,6 +78,62 @@
  * child process. This module defines the management of these states and the
  * communication mechanism. The "worker" module defines the actual procedures
  * performed by the child processes.
+ *
+ * Workers cache the contexts for the namespaces that they have recently used.
+ * Opening a context is expensive, so orders that operate on a node are always
+ * routed to the worker that "owns" the node, as determined by a hash of its
+ * identifier. Orders involving two nodes (e.g., links) are routed to whichever
+ * of the two owners currently has the shorter queue. Orders that do not involve
+ * any nodes are routed to the worker with the shortest queue.
+ *
+ * Open vSwitch locks its database while processing commands, so operations on
+ * the root switch cannot be parallelized. All orders involving the switch are
+ * routed to a dedicated "switch lane" (the first worker), which executes them
+ * in FIFO order. When the pool has more than one worker, the switch lane does
+ * not own any nodes, so that namespace operations on the remaining workers are
+ * never stuck behind switch commands. For this reason, client setup is split
+ * into two orders: one for the routes in the client namespace, and one for the
+ * flow rules in the switch.
+ *
+ * Each worker executes the orders in its queue in FIFO order, but orders in
+ * different queues can depend on each other (e.g., a link needs both of its
+ * hosts). Every order is assigned a ticket (the worker and a per-worker sequence
+ * number), and the main process records the tickets of the orders that create
+ * and modify each node. When an order is submitted, these tables are used to
+ * determine the tickets that must be completed first. Workers periodically
+ * report the sequence number of the last order that they finished, and a send
+ * thread holding an order with an unfinished dependency on another worker
+ * delivers its current batch and then waits for that report before continuing.
+ * Dependencies always refer to earlier orders, so this cannot deadlock. This
+ * allows the main thread to keep submitting orders without joining, except
+ * when it actually needs all work to be finished.
+ *
+ * The main thread can generate orders much faster than the workers can execute
+ * them. To bound the memory used by the main process, the number of orders that
+ * have not yet been delivered to the workers is limited to a high-water mark
+ * derived from the memory limit. Submitting an order blocks while the limit is
+ * reached. Order structures are carved out of slabs and recycled through a free
+ * list, since one is allocated for every operation.
+ *
+ * Since the active network namespace is actually a per-thread property in
+ * Linux, all of the state in the worker module (and the modules that it uses)
+ * is thread-local. This makes an alternative backend possible, in which each
+ * worker is a thread of the main process. Each worker thread pops orders
+ * directly from its queue, waits for the dependencies, and executes them, and
+ * responses are handled by the worker thread itself. This avoids forking, the
+ * pipes and rings, serialization, and the relay threads, and the workers read
+ * the topology structures of the main process directly. However, privileges
+ * are no longer isolated from the I/O portion of the program.
+ *
+ * Once an order fails, the network is going to be torn down, so there is no
+ * point in executing the orders that are still pending. Every order is stamped
+ * with the current "cancellation epoch" when it is submitted. The epoch is kept
+ * in a small block of shared memory, and the first worker to fail an order
+ * advances it, which makes all orders stamped before the failure stale. Send
+ * threads discard stale orders instead of delivering them, and workers skip any
+ * stale orders that were already delivered. The main process refuses new orders
+ * until the error is reset by a join. Orders that must always run (e.g., pings
+ * and configuration) are exempt.
  */
 
 typedef enum {
@@ -81,14 +150,29 @@ typedef enum {
 	WorkerSetSelfLink,
 	WorkerEnsureSystemScaling,
 	WorkerAddLink,
-	WorkerAddInternalRoutes,
+	WorkerAddRoutes,
 	WorkerAddClientRoutes,
+	WorkerAddClientFlows,
 	WorkerAddEdgeRoutes,
 	WorkerDestroyHosts,
+	WorkerCountHosts,
 } WorkerOrderCode;
 
+typedef struct {
+	guint worker;
+	uint64_t seq; // Sequence numbers start at 1; 0 indicates no ticket
+} WorkTicket;
+
 typedef struct {
 	WorkerOrderCode code;
+	uint64_t seq; // Sequence number within the worker's queue (0 for broadcasts)
+	uint32_t epoch; // Cancellation epoch when submitted (see orderCancelled)
+
+	// Tickets that must be completed before the order can be sent. Only used by
+	// the main process.
+	WorkTicket* deps;
+	guint depCount;
+
 	union {
 		struct {
 			LogLevel logThreshold;
@@ -102,16 +186,20 @@ typedef struct {
 			char* ovsSchema;
 		} configure;
 		struct {
+			workRequest request;
 			char intfName[INTERFACE_BUF_LEN];
 			ip4Addr ip;
 		} getEdgeRemoteMac;
 		struct {
+			workRequest request;
 			char intfName[INTERFACE_BUF_LEN];
 		} getEdgeLocalMac;
 		struct {
+			workRequest request;
 			char intfName[INTERFACE_BUF_LEN];
 		} getInterfaceMtu;
 		struct {
+			workRequest request;
 			int mtu;
 		} mtuSupported;
 		struct {
@@ -127,6 +215,7 @@ typedef struct {
 			macAddr macs[NEEDED_MACS_CLIENT];
 			int mtu;
 			TopoNode node;
+			bool replace;
 		} addHost;
 		struct {
 			nodeId id;
@@ -145,22 +234,26 @@ typedef struct {
 			macAddr macs[NEEDED_MACS_LINK];
 			int mtu;
 			TopoLink link;
+			bool replace;
 		} addLink;
 		struct {
-			nodeId id1;
-			nodeId id2;
-			ip4Addr ip1;
-			ip4Addr ip2;
-			ip4Subnet subnet1;
-			ip4Subnet subnet2;
-		} addInternalRoutes;
+			nodeId id;
+			size_t routeCount;
+			TopoRoute* routes;
+		} addRoutes;
+		struct {
+			nodeId clientId;
+			ip4Subnet subnet;
+			bool replace;
+		} addClientRoutes;
 		struct {
 			nodeId clientId;
 			macAddr clientMacs[NEEDED_MACS_CLIENT];
 			ip4Subnet subnet;
 			uint32_t edgePort;
 			uint32_t clientPorts[NEEDED_PORTS_CLIENT];
-		} addClientRoutes;
+			bool replace;
+		} addClientFlows;
 		struct {
 			ip4Subnet edgeSubnet;
 			uint32_t edgePort;
@@ -170,6 +263,9 @@ typedef struct {
 		struct {
 			char intfName[INTERFACE_BUF_LEN];
 		} addEdgeInterface;
+		struct {
+			workRequest request;
+		} countHosts;
 	};
 } WorkerOrder;
 
@@ -177,75 +273,188 @@ typedef enum {
 	ResponseError,
 	ResponsePong,
 	ResponseLogPrint,
-	ResponseLogEnd,
 	ResponseGotMac,
 	ResponseGotMtu,
 	ResponseGotMtuSupported,
+	ResponseGotHostCount,
 	ResponseAddedEdgeInterface,
+	ResponseProgress,
 } WorkerResponseCode;
 
 typedef struct {
 	WorkerResponseCode code;
 	union {
 		struct {
+			workRequest request; // Request that failed, or 0 if not applicable
 			int code;
+			WorkerOrderCode order; // Code of the order that failed
+			nodeId nodes[2];       // Nodes involved in the failed order
+			guint nodeCount;
 		} error;
 		struct {
-			size_t len;
-		} logMessage;
-		struct {
+			workRequest request;
 			macAddr mac;
 		} gotMac;
 		struct {
+			workRequest request;
 			int mtu;
 		} gotMtu;
 		struct {
+			workRequest request;
 			bool supported;
 			const char* failReason;
 		} gotMtuSupported;
+		struct {
+			workRequest request;
+			nodeId count;
+		} gotHostCount;
+		struct {
+			uint64_t seq;
+		} progress;
 	};
 } WorkerResponse;
 
 // Workplace context from the perspective of the main process
 typedef struct {
 	bool established;
+	GAsyncQueue* orderQueue;
 	GThread* sendThread;
 	GThread* responseThread;
+	GThread* workerThread; // Used only by the thread backend
 	int ordersFd;    // Write end of work order pipe
 	int responsesFd; // Read end of work response pipe
+	chRing* orderRing;    // NULL if the pipes carry the data
+	chRing* responseRing;
 
-	char* logBuffer;
-	size_t logLen;
-	size_t logCap;
+	chWriter orders;      // Used only by the send thread
+	chReader responses;   // Used only by the response thread
+	uint32_t batchedOrders;
+
+	uint64_t nextSeq;      // Used only by the main thread
+	uint64_t finishedSeq;  // Protected by workMain.lock
 } Workplace;
 
+// An outstanding request made by the main thread. The response thread stores
+// the response in the slot, and the main thread copies the result into the
+// caller's buffers when it awaits the request. This way, the response thread
+// never touches memory owned by the caller, even if the caller gives up on a
+// request.
+typedef struct {
+	workRequest id; // 0 if the slot is unused
+	WorkerResponseCode expectedCode;
+	bool done;
+	int err;
+	WorkerResponse resp;
+	union {
+		macAddr* mac;
+		int* mtu;
+		struct {
+			bool* supported;
+			const char** failReason;
+		} mtuSupported;
+		nodeId* hostCount;
+	} result;
+} PendingRequest;
+
+// Tickets for the orders affecting a node
+typedef struct {
+	WorkTicket created;
+	WorkTicket* modified; // Latest modification performed by each worker
+	guint modifiedCount;
+} NodeTickets;
+
+// Storage for an order in a slab. Unused slots form a linked list.
+typedef union OrderSlot OrderSlot;
+union OrderSlot {
+	OrderSlot* next;
+	WorkerOrder order;
+};
+
 // Module state for the main process
 static struct {
 	GMutex lock;
 
 	guint poolSize;
 	Workplace* workplaces;
+	bool useThreads; // Workers are threads of the main process
+	bool sharedControl; // workControl is in shared memory
 
 	// State for handling outgoing orders:
 
-	GAsyncQueue* orderQueue;
-
 	uint32_t unsentOrders;
 	GCond allOrdersSent;
+	uint32_t maxUnsentOrders; // High-water mark for unsentOrders
+	GCond queueSpace;         // Signaled when unsentOrders drops below the mark
+
+	// Recycled order structures. Protected by slabLock rather than the main lock
+	// because they are released by the send threads.
+	GMutex slabLock;
+	OrderSlot* freeOrders;
+	OrderSlot** slabs;
+	size_t slabCount;
+	size_t slabCap;
 
 	// State for responses from the child processes:
 
 	bool receivedError;
 	int errorCode;
 
-	bool responseQueued;
+	// Outstanding requests. Slots are reused after requests are awaited.
+	PendingRequest* requests;
+	size_t requestCount;
+	size_t requestCap;
+	workRequest nextRequest;
 	GCond receivedResponse;
-	WorkerResponse response;
 
 	guint pongsExpected;
 	GCond pongsFinished;
+
+	// State for tracking dependencies between orders:
+
+	GCond progress; // Signaled when a worker reports finished orders
+
+	NodeTickets* nodes; // Indexed by node identifier. Used only by the main thread
+	size_t nodeCount;
+	size_t nodeCap;
+
+	WorkTicket systemTicket; // Last system-wide configuration order
+
+	guint firstNodeLane; // Index of the first workplace that can own nodes
+	guint nextLane;      // Starting point when searching for the least loaded lane
 } workMain;
 
+// State shared between the main process and all workers. If shared memory is
+// not available, each process has a private copy; orders are then only
+// cancelled by the process that observed the error.
+typedef struct {
+	uint32_t cancelEpoch; // Orders stamped with an earlier epoch are stale
+} WorkControl;
+static WorkControl* workControl;
+
+// Epoch for orders that are never cancelled
+static const uint32_t NoCancelEpoch = UINT32_MAX;
+
+// Module state for a child process
+static struct {
+	chReader orders;
+	chWriter responses;
+
+	// Log output waiting to be sent to the main process. The first logComplete
+	// bytes are whole lines; the rest is the line currently being printed.
+	char* logBatch;
+	size_t logLen;
+	size_t logCap;
+	size_t logComplete;
+} workChild;
+
+// Module state for a worker thread in the thread backend
+static __thread struct {
+	Workplace* wp; // NULL for other threads
+} workThread;
+
+// Capacity of the shared memory rings in each direction
+static const size_t RingCapacity = 1024 * 1024;
+
 // Memory clearing functions to prevent irrelevant alerts from debuggers
 #ifdef DEBUG
 #define ZERO_ORDER(order) do{ memset((order), 0, sizeof(WorkerOrder)); }while(0)
@@ -255,110 +464,506 @@ static struct {
 #define ZERO_RESPONSE(resp) do{}while(0)
 #endif
 
+// Children send their buffered log lines once this many bytes accumulate, even
+// if they have no other responses to deliver
+static const size_t LogBatchLimit = 16 * 1024;
+
+// Workers report their progress after finishing this many orders, even if they
+// still have more work to do
+static const uint32_t ProgressInterval = 32;
+
+// Number of orders allocated at once when the free list runs out
+static const size_t OrdersPerSlab = 256;
+
+// Fraction of the memory limit that may be used by undelivered orders, and the
+// minimum number of undelivered orders allowed regardless of the limit
+static const double OrderMemoryFraction = 1.0 / 16.0;
+static const uint32_t MinUnsentOrders = 1024;
+
+// Called by main process. Takes an order structure from the free list.
+static WorkerOrder* allocOrder(void) {
+	g_mutex_lock(&workMain.slabLock);
+	if (workMain.freeOrders == NULL) {
+		OrderSlot* slab = eamalloc(OrdersPerSlab, sizeof(OrderSlot), 0);
+		for (size_t i = 0; i < OrdersPerSlab; ++i) {
+			slab[i].next = (i+1 < OrdersPerSlab ? &slab[i+1] : NULL);
+		}
+		workMain.freeOrders = slab;
+		flexBufferGrow((void**)&workMain.slabs, workMain.slabCount, &workMain.slabCap, 1, sizeof(OrderSlot*));
+		flexBufferAppend(workMain.slabs, &workMain.slabCount, &slab, 1, sizeof(OrderSlot*));
+	}
+	OrderSlot* slot = workMain.freeOrders;
+	workMain.freeOrders = slot->next;
+	g_mutex_unlock(&workMain.slabLock);
+	return &slot->order;
+}
+
+static void freeOrderContents(WorkerOrder* order);
+
+// Called by main process. Releases an order and its contents, returning the
+// structure to the free list.
+static void releaseOrder(gpointer data) {
+	WorkerOrder* order = data;
+	freeOrderContents(order);
+	OrderSlot* slot = (OrderSlot*)order;
+	g_mutex_lock(&workMain.slabLock);
+	slot->next = workMain.freeOrders;
+	workMain.freeOrders = slot;
+	g_mutex_unlock(&workMain.slabLock);
+}
+
 static WorkerOrder* newOrder(WorkerOrderCode code) {
-	WorkerOrder* order = emalloc(sizeof(WorkerOrder));
+	WorkerOrder* order = allocOrder();
 	ZERO_ORDER(order);
 	order->code = code;
+	order->seq = 0;
+	order->epoch = NoCancelEpoch;
+	order->deps = NULL;
+	order->depCount = 0;
 	return order;
 }
 
-static bool writeAll(int fd, const void* data, size_t len) {
-	const char* p = data;
-	ssize_t toWrite = (ssize_t)len;
-	while (toWrite > 0) {
-		ssize_t written = write(fd, p, (size_t)toWrite);
-		if (written <= 0) return false;
-		toWrite -= written;
-		p += written;
+// Releases memory associated with an order (but not the order itself)
+static void freeOrderContents(WorkerOrder* order) {
+	free(order->deps);
+	order->deps = NULL;
+	order->depCount = 0;
+	if (order->code == WorkerConfigure) {
+		free(order->configure.nsPrefix);
+		free(order->configure.ovsDir);
+		free(order->configure.ovsSchema);
+	} else if (order->code == WorkerAddRoutes) {
+		free(order->addRoutes.routes);
 	}
-	return true;
 }
 
-static bool readAll(int fd, void* data, size_t len) {
-	char* p = data;
-	ssize_t toRead = (ssize_t)len;
-	while (toRead > 0) {
-		ssize_t readBytes = read(fd, p, (size_t)toRead);
-		if (readBytes <= 0) return false;
-		toRead -= readBytes;
-		p += readBytes;
+// Locates the portion of an order that is meaningful for its code. Only these
+// bytes are serialized, so that small orders do not pay for the size of the
+// largest union member.
+static void* orderBody(WorkerOrder* order, size_t* size) {
+	switch (order->code) {
+	case WorkerConfigure: *size = sizeof(order->configure); return &order->configure;
+	case WorkerGetEdgeRemoteMac: *size = sizeof(order->getEdgeRemoteMac); return &order->getEdgeRemoteMac;
+	case WorkerGetEdgeLocalMac: *size = sizeof(order->getEdgeLocalMac); return &order->getEdgeLocalMac;
+	case WorkerGetInterfaceMtu: *size = sizeof(order->getInterfaceMtu); return &order->getInterfaceMtu;
+	case WorkerMtuSupported: *size = sizeof(order->mtuSupported); return &order->mtuSupported;
+	case WorkerAddRoot: *size = sizeof(order->addRoot); return &order->addRoot;
+	case WorkerAddEdgeInterface: *size = sizeof(order->addEdgeInterface); return &order->addEdgeInterface;
+	case WorkerAddHost: *size = sizeof(order->addHost); return &order->addHost;
+	case WorkerSetSelfLink: *size = sizeof(order->setSelfLink); return &order->setSelfLink;
+	case WorkerEnsureSystemScaling: *size = sizeof(order->ensureSystemScaling); return &order->ensureSystemScaling;
+	case WorkerAddLink: *size = sizeof(order->addLink); return &order->addLink;
+	case WorkerAddRoutes: *size = sizeof(order->addRoutes); return &order->addRoutes;
+	case WorkerAddClientRoutes: *size = sizeof(order->addClientRoutes); return &order->addClientRoutes;
+	case WorkerAddClientFlows: *size = sizeof(order->addClientFlows); return &order->addClientFlows;
+	case WorkerAddEdgeRoutes: *size = sizeof(order->addEdgeRoutes); return &order->addEdgeRoutes;
+	case WorkerCountHosts: *size = sizeof(order->countHosts); return &order->countHosts;
+	default: *size = 0; return order;
 	}
-	return true;
 }
 
-// Releases memory associated with an order (but not the order itself)
-static void freeOrderContents(WorkerOrder* order) {
+// Same as orderBody, but for responses
+static void* responseBody(WorkerResponse* resp, size_t* size) {
+	switch (resp->code) {
+	case ResponseError: *size = sizeof(resp->error); return &resp->error;
+	case ResponseGotMac: *size = sizeof(resp->gotMac); return &resp->gotMac;
+	case ResponseGotMtu: *size = sizeof(resp->gotMtu); return &resp->gotMtu;
+	case ResponseGotMtuSupported: *size = sizeof(resp->gotMtuSupported); return &resp->gotMtuSupported;
+	case ResponseGotHostCount: *size = sizeof(resp->gotHostCount); return &resp->gotHostCount;
+	case ResponseProgress: *size = sizeof(resp->progress); return &resp->progress;
+	default: *size = 0; return resp;
+	}
+}
+
+// Serializes a work order into a frame. The frame may remain buffered in the
+// writer until it is flushed.
+static bool writeOrder(WorkerOrder* order, chWriter* writer) {
+	struct iovec parts[6];
+	int partCount = 3;
+	parts[0].iov_base = &order->seq;
+	parts[0].iov_len = sizeof(order->seq);
+	parts[1].iov_base = &order->epoch;
+	parts[1].iov_len = sizeof(order->epoch);
+	parts[2].iov_base = orderBody(order, &parts[2].iov_len);
+
+	// Append extraneous buffers
 	if (order->code == WorkerConfigure) {
-		free(order->configure.nsPrefix);
-		free(order->configure.ovsDir);
-		free(order->configure.ovsSchema);
+		parts[3].iov_base = order->configure.nsPrefix;
+		parts[3].iov_len = order->configure.nsPrefixLen;
+		parts[4].iov_base = order->configure.ovsDir;
+		parts[4].iov_len = order->configure.ovsDirLen;
+		parts[5].iov_base = order->configure.ovsSchema;
+		parts[5].iov_len = order->configure.ovsSchemaLen;
+		partCount = 6;
+	} else if (order->code == WorkerAddRoutes) {
+		parts[3].iov_base = order->addRoutes.routes;
+		parts[3].iov_len = order->addRoutes.routeCount * sizeof(TopoRoute);
+		partCount = 4;
 	}
+	return chWriteFrame(writer, (uint32_t)order->code, parts, partCount);
 }
 
-// Serializes a work order and sends it through the pipe to a child process
+// Serializes a work order and immediately sends it to a child process. This
+// must only be used while the send thread for the workplace is idle.
 static bool writeOrderToWorkplace(WorkerOrder* order, Workplace* wp) {
 	lprintf(LogDebug, "Sending order code %d to child in workplace %p\n", order->code, wp);
-	if (!writeAll(wp->ordersFd, order, sizeof(WorkerOrder))) goto fail;
-
-	// Write extraneous buffers
-	if (order->code == WorkerConfigure) {
-		if (!writeAll(wp->ordersFd, order->configure.nsPrefix, order->configure.nsPrefixLen)) goto fail;
-		else if (!writeAll(wp->ordersFd, order->configure.ovsDir, order->configure.ovsDirLen)) goto fail;
-		else if (!writeAll(wp->ordersFd, order->configure.ovsSchema, order->configure.ovsSchemaLen)) goto fail;
+	chWriter writer;
+	chWriterInit(&writer, wp->ordersFd, wp->orderRing);
+	bool success = (writeOrder(order, &writer) && chFlush(&writer));
+	chWriterFree(&writer);
+	if (!success) {
+		lprintf(LogError, "Failed to send worker order code %d to child in workplace %p\n", order->code, wp);
 	}
-	return true;
-fail:
-	lprintf(LogError, "Failed to send worker order code %d to child in workplace %p\n", order->code, wp);
-	return false;
+	return success;
 }
 
 // Deserializes a work order from stdin
 static bool readOrder(WorkerOrder* order) {
-	if (!readAll(STDIN_FILENO, order, sizeof(WorkerOrder))) return false;
+	uint32_t code;
+	const void* frame;
+	size_t frameLen;
+	if (!chReadFrame(&workChild.orders, &code, &frame, &frameLen)) return false;
+
+	order->code = (WorkerOrderCode)code;
+	order->deps = NULL;
+	order->depCount = 0;
+	if (frameLen < sizeof(order->seq) + sizeof(order->epoch)) return false;
+	memcpy(&order->seq, frame, sizeof(order->seq));
+	frame = (const char*)frame + sizeof(order->seq);
+	memcpy(&order->epoch, frame, sizeof(order->epoch));
+	frame = (const char*)frame + sizeof(order->epoch);
+	frameLen -= sizeof(order->seq) + sizeof(order->epoch);
+
+	size_t bodyLen;
+	void* body = orderBody(order, &bodyLen);
+	if (frameLen < bodyLen) return false;
+	memcpy(body, frame, bodyLen);
 
 	// Read extraneous buffers
 	if (order->code == WorkerConfigure) {
+		const char* extra = (const char*)frame + bodyLen;
+		if (frameLen - bodyLen != order->configure.nsPrefixLen + order->configure.ovsDirLen + order->configure.ovsSchemaLen) return false;
+
 		order->configure.nsPrefix = ecalloc(order->configure.nsPrefixLen+1, 1);
 		order->configure.ovsDir  = ecalloc(order->configure.ovsDirLen+1, 1);
 		order->configure.ovsSchema = ecalloc(order->configure.ovsSchemaLen+1, 1);
 
-		bool failed = false;
-		if (!readAll(STDIN_FILENO, order->configure.nsPrefix, order->configure.nsPrefixLen)) failed = true;
-		else if (!readAll(STDIN_FILENO, order->configure.ovsDir, order->configure.ovsDirLen)) failed = true;
-		else if (!readAll(STDIN_FILENO, order->configure.ovsSchema, order->configure.ovsSchemaLen)) failed = true;
-		if (failed) {
-			freeOrderContents(order);
-			return false;
-		}
+		memcpy(order->configure.nsPrefix, extra, order->configure.nsPrefixLen);
+		extra += order->configure.nsPrefixLen;
+		memcpy(order->configure.ovsDir, extra, order->configure.ovsDirLen);
+		extra += order->configure.ovsDirLen;
+		memcpy(order->configure.ovsSchema, extra, order->configure.ovsSchemaLen);
+	} else if (order->code == WorkerAddRoutes) {
+		if ((frameLen - bodyLen) / sizeof(TopoRoute) != order->addRoutes.routeCount || (frameLen - bodyLen) % sizeof(TopoRoute) != 0) return false;
+		order->addRoutes.routes = eamalloc(order->addRoutes.routeCount, sizeof(TopoRoute), 0);
+		memcpy(order->addRoutes.routes, (const char*)frame + bodyLen, frameLen - bodyLen);
 	}
 	return true;
 }
 
+static void handleResponse(Workplace* wp, const WorkerResponse* resp);
+
+// Called by child process. Sends all complete log lines to the main process in
+// a single frame. The frame is NUL-terminated so that the main process can
+// print it in place.
+static void sendLogBatch(void) {
+	if (workChild.logComplete == 0) return;
+	struct iovec parts[2];
+	parts[0].iov_base = workChild.logBatch;
+	parts[0].iov_len = workChild.logComplete;
+	parts[1].iov_base = (void*)(uintptr_t)"";
+	parts[1].iov_len = 1;
+	chWriteFrame(&workChild.responses, ResponseLogPrint, parts, 2);
+
+	size_t partial = workChild.logLen - workChild.logComplete;
+	memmove(workChild.logBatch, &workChild.logBatch[workChild.logComplete], partial);
+	workChild.logLen = partial;
+	workChild.logComplete = 0;
+}
+
+// Called by child process or worker thread. Queues a response for the main
+// process. Responses are delivered when the child runs out of work, unless
+// flush is true. Worker threads handle their responses immediately.
+static void respond(WorkerResponse* resp, bool flush) {
+	if (workThread.wp != NULL) {
+		handleResponse(workThread.wp, resp);
+		return;
+	}
+
+	// Log lines are sent first so that they appear in the order that they
+	// were printed relative to the response
+	sendLogBatch();
+	struct iovec part;
+	part.iov_base = responseBody(resp, &part.iov_len);
+	chWriteFrame(&workChild.responses, (uint32_t)resp->code, &part, 1);
+	if (flush) chFlush(&workChild.responses);
+}
+
+// Determines whether an order was submitted before a failure, in which case it
+// should not be executed
+static bool orderCancelled(const WorkerOrder* order) {
+	if (order->epoch == NoCancelEpoch) return false;
+	return order->epoch < __atomic_load_n(&workControl->cancelEpoch, __ATOMIC_ACQUIRE);
+}
+
+// Called by child process or worker thread. Makes all orders submitted before
+// (or alongside) a failed order stale.
+static void cancelOrders(const WorkerOrder* failed) {
+	if (failed->epoch == NoCancelEpoch) return;
+	uint32_t current = __atomic_load_n(&workControl->cancelEpoch, __ATOMIC_ACQUIRE);
+	while (current <= failed->epoch) {
+		if (__atomic_compare_exchange_n(&workControl->cancelEpoch, &current, failed->epoch + 1, false, __ATOMIC_SEQ_CST, __ATOMIC_ACQUIRE)) break;
+	}
+}
+
 static void waitForSending(void) {
 	g_mutex_lock(&workMain.lock);
-	lprintln(LogDebug, "Waiting until all orders are sent to child processes");
+	lprintln(LogDebug, "Waiting until all orders are delivered to workers");
 	while (workMain.unsentOrders > 0) {
 		g_cond_wait(&workMain.allOrdersSent, &workMain.lock);
 	}
 	g_mutex_unlock(&workMain.lock);
 }
 
-// Called by main process => main thread. The caller must hold workMain.lock
-static int waitForResponse(WorkerResponseCode expectedCode) {
-	lprintln(LogDebug, "Waiting for response from worker pool");
-	while (!workMain.receivedError && !workMain.responseQueued) {
-		g_cond_wait(&workMain.receivedResponse, &workMain.lock);
+// Called by main process => main thread. Allocates a slot for a new request.
+// The caller must fill in the result pointers.
+static PendingRequest* newRequest(WorkerResponseCode expectedCode) {
+	g_mutex_lock(&workMain.lock);
+	PendingRequest* req = NULL;
+	for (size_t i = 0; i < workMain.requestCount; ++i) {
+		if (workMain.requests[i].id == 0) {
+			req = &workMain.requests[i];
+			break;
+		}
 	}
-	int err = 0;
-	if (workMain.receivedError) {
-		err = workMain.errorCode;
-	} else if (workMain.response.code != expectedCode) {
-		lprintf(LogError, "Unexpected response code %d from worker pool\n", workMain.response.code);
-		err = 1;
+	if (req == NULL) {
+		flexBufferGrow((void**)&workMain.requests, workMain.requestCount, &workMain.requestCap, 1, sizeof(PendingRequest));
+		req = &workMain.requests[workMain.requestCount++];
+	}
+
+	// Identifiers are never reused, so late responses for abandoned requests
+	// cannot be mistaken for responses to newer ones
+	if (workMain.nextRequest == 0) ++workMain.nextRequest;
+	req->id = workMain.nextRequest++;
+	req->expectedCode = expectedCode;
+	req->done = false;
+	req->err = 0;
+	g_mutex_unlock(&workMain.lock);
+	return req;
+}
+
+// Called by main process. Finds an outstanding request. The caller must hold
+// workMain.lock.
+static PendingRequest* findRequest(workRequest id) {
+	if (id == 0) return NULL;
+	for (size_t i = 0; i < workMain.requestCount; ++i) {
+		if (workMain.requests[i].id == id) return &workMain.requests[i];
+	}
+	return NULL;
+}
+
+// Called by main process => response thread. Stores the response to a request.
+// The caller must hold workMain.lock.
+static void completeRequest(const WorkerResponse* resp) {
+	workRequest id;
+	switch (resp->code) {
+	case ResponseGotMac: id = resp->gotMac.request; break;
+	case ResponseGotMtu: id = resp->gotMtu.request; break;
+	case ResponseGotMtuSupported: id = resp->gotMtuSupported.request; break;
+	case ResponseGotHostCount: id = resp->gotHostCount.request; break;
+	default: id = 0; break;
+	}
+	PendingRequest* req = findRequest(id);
+	if (req == NULL) {
+		lprintf(LogWarning, "Ignoring response code %d for unknown request %u\n", resp->code, id);
+		return;
+	}
+	if (resp->code != req->expectedCode) {
+		lprintf(LogError, "Unexpected response code %d for request %u\n", resp->code, id);
+		req->err = 1;
 	} else {
-		workMain.responseQueued = false;
+		req->resp = *resp;
+	}
+	req->done = true;
+	g_cond_broadcast(&workMain.receivedResponse);
+}
+
+// Called by main process => main thread. Queues an order for a specific
+// workplace.
+static int sendOrderTo(WorkerOrder* order, Workplace* wp) {
+	order->seq = wp->nextSeq++;
+	g_mutex_lock(&workMain.lock);
+	if (workMain.unsentOrders >= workMain.maxUnsentOrders) {
+		lprintf(LogDebug, "%u orders are waiting for delivery; waiting for workers to catch up\n", workMain.unsentOrders);
+		while (workMain.unsentOrders >= workMain.maxUnsentOrders) {
+			g_cond_wait(&workMain.queueSpace, &workMain.lock);
+		}
+	}
+	++workMain.unsentOrders;
+	g_async_queue_push(wp->orderQueue, order);
+	g_mutex_unlock(&workMain.lock);
+
+	return 0;
+}
+
+// Determines which workplace owns the namespace for a node. Node identifiers
+// are usually assigned sequentially, so they are scrambled with a
+// multiplicative hash before being mapped onto the pool.
+static Workplace* nodeOwner(nodeId id) {
+	uint32_t hash = (uint32_t)id * UINT32_C(2654435761);
+	guint lanes = workMain.poolSize - workMain.firstNodeLane;
+	return &workMain.workplaces[workMain.firstNodeLane + hash % lanes];
+}
+
+// Returns the workplace that executes all orders involving the root switch
+static Workplace* switchLane(void) {
+	return &workMain.workplaces[0];
+}
+
+// Returns the less loaded of two workplaces
+static Workplace* lessLoaded(Workplace* a, Workplace* b) {
+	if (a == b) return a;
+	return (g_async_queue_length(b->orderQueue) < g_async_queue_length(a->orderQueue) ? b : a);
+}
+
+// Called by main process => main thread. Selects the workplace that should
+// execute an order.
+static Workplace* orderAffinity(const WorkerOrder* order) {
+	switch (order->code) {
+	case WorkerAddHost: return nodeOwner(order->addHost.id);
+	case WorkerSetSelfLink: return nodeOwner(order->setSelfLink.id);
+	case WorkerAddClientRoutes: return nodeOwner(order->addClientRoutes.clientId);
+	case WorkerAddLink: return lessLoaded(nodeOwner(order->addLink.sourceId), nodeOwner(order->addLink.targetId));
+	case WorkerAddRoutes: return nodeOwner(order->addRoutes.id);
+	case WorkerAddEdgeInterface:
+	case WorkerGetEdgeLocalMac:
+	case WorkerAddClientFlows:
+	case WorkerAddEdgeRoutes:
+		return switchLane();
+	default: break;
+	}
+
+	// Ties are common (e.g., when the queues are all empty), so the search
+	// starts at a different lane each time in order to spread out the work
+	guint lanes = workMain.poolSize - workMain.firstNodeLane;
+	guint start = workMain.nextLane++;
+	Workplace* best = NULL;
+	for (guint i = 0; i < lanes; ++i) {
+		Workplace* wp = &workMain.workplaces[workMain.firstNodeLane + (start + i) % lanes];
+		if (!wp->established) continue;
+		if (best == NULL) best = wp;
+		else best = lessLoaded(best, wp);
+	}
+	return best;
+}
+
+// Called by main process => main thread. Returns the ticket table for a node,
+// growing the table if needed.
+static NodeTickets* nodeTickets(nodeId id) {
+	if ((size_t)id >= workMain.nodeCount) {
+		size_t newCount = (size_t)id + 1;
+		flexBufferGrow((void**)&workMain.nodes, workMain.nodeCount, &workMain.nodeCap, newCount - workMain.nodeCount, sizeof(NodeTickets));
+		memset(&workMain.nodes[workMain.nodeCount], 0, (newCount - workMain.nodeCount) * sizeof(NodeTickets));
+		workMain.nodeCount = newCount;
+	}
+	return &workMain.nodes[id];
+}
+
+// Adds a dependency to an order. Orders in the same queue are executed in FIFO
+// order, so dependencies on the target worker are dropped. Only the latest
+// ticket for each worker is retained.
+static void addDep(WorkerOrder* order, Workplace* wp, WorkTicket ticket) {
+	if (ticket.seq == 0) return;
+	if (&workMain.workplaces[ticket.worker] == wp) return;
+	for (guint i = 0; i < order->depCount; ++i) {
+		if (order->deps[i].worker == ticket.worker) {
+			if (ticket.seq > order->deps[i].seq) order->deps[i].seq = ticket.seq;
+			return;
+		}
+	}
+	order->deps = earealloc(order->deps, order->depCount + 1, sizeof(WorkTicket), 0);
+	order->deps[order->depCount++] = ticket;
+}
+
+static void addModifiedDeps(WorkerOrder* order, Workplace* wp, nodeId id) {
+	NodeTickets* node = nodeTickets(id);
+	for (guint i = 0; i < node->modifiedCount; ++i) {
+		addDep(order, wp, node->modified[i]);
+	}
+}
+
+// Called by main process => main thread. Determines the orders that must be
+// finished before the given order can be executed.
+static void addOrderDeps(WorkerOrder* order, Workplace* wp) {
+	switch (order->code) {
+	case WorkerAddHost:
+		addDep(order, wp, workMain.systemTicket);
+		break;
+	case WorkerSetSelfLink:
+		addDep(order, wp, nodeTickets(order->setSelfLink.id)->created);
+		break;
+	case WorkerAddLink:
+		addDep(order, wp, workMain.systemTicket);
+		addDep(order, wp, nodeTickets(order->addLink.sourceId)->created);
+		addDep(order, wp, nodeTickets(order->addLink.targetId)->created);
+		break;
+	case WorkerAddRoutes:
+		// Routes need the links to the neighbors, which are among the
+		// modifications made to the node
+		addModifiedDeps(order, wp, order->addRoutes.id);
+		break;
+	case WorkerAddClientRoutes:
+		addDep(order, wp, nodeTickets(order->addClientRoutes.clientId)->created);
+		break;
+	case WorkerAddClientFlows:
+		// The switch ports for the client are created along with the host
+		addDep(order, wp, nodeTickets(order->addClientFlows.clientId)->created);
+		break;
+	case WorkerAddEdgeInterface:
+	case WorkerGetEdgeLocalMac:
+	case WorkerAddEdgeRoutes:
+		// These are serialized by the switch lane
+		break;
+	default:
+		addDep(order, wp, workMain.systemTicket);
+		break;
+	}
+}
+
+static void recordModification(nodeId id, WorkTicket ticket) {
+	NodeTickets* node = nodeTickets(id);
+	for (guint i = 0; i < node->modifiedCount; ++i) {
+		if (node->modified[i].worker == ticket.worker) {
+			node->modified[i].seq = ticket.seq;
+			return;
+		}
+	}
+	node->modified = earealloc(node->modified, node->modifiedCount + 1, sizeof(WorkTicket), 0);
+	node->modified[node->modifiedCount++] = ticket;
+}
+
+// Called by main process => main thread. Records the ticket of a submitted
+// order so that later orders can depend on it.
+static void recordOrderTicket(const WorkerOrder* order, Workplace* wp) {
+	WorkTicket ticket;
+	ticket.worker = (guint)(wp - workMain.workplaces);
+	ticket.seq = order->seq;
+
+	switch (order->code) {
+	case WorkerAddHost:
+		nodeTickets(order->addHost.id)->created = ticket;
+		recordModification(order->addHost.id, ticket);
+		break;
+	case WorkerAddLink:
+		recordModification(order->addLink.sourceId, ticket);
+		recordModification(order->addLink.targetId, ticket);
+		break;
+	case WorkerEnsureSystemScaling:
+		workMain.systemTicket = ticket;
+		break;
+	default:
+		break;
 	}
-	return err;
 }
 
 // Called by main process => main thread
@@ -369,22 +974,54 @@ static int sendOrder(WorkerOrder* order, bool ignoreErrors) {
 		if (workMain.receivedError) abort = true;
 		g_mutex_unlock(&workMain.lock);
 	}
-	if (abort) return workMain.errorCode;
+	if (abort) {
+		releaseOrder(order);
+		return workMain.errorCode;
+	}
 
-	g_mutex_lock(&workMain.lock);
-	++workMain.unsentOrders;
-	g_async_queue_push(workMain.orderQueue, order);
-	g_mutex_unlock(&workMain.lock);
+	order->epoch = __atomic_load_n(&workControl->cancelEpoch, __ATOMIC_ACQUIRE);
+	Workplace* wp = orderAffinity(order);
+	addOrderDeps(order, wp);
+	int err = sendOrderTo(order, wp);
+	recordOrderTicket(order, wp);
+	return err;
+}
 
-	return 0;
+// Called by main process => main thread. Makes a copy of an order for another
+// worker thread, which releases it independently.
+static WorkerOrder* cloneOrder(const WorkerOrder* order) {
+	WorkerOrder* copy = allocOrder();
+	*copy = *order;
+	copy->seq = 0;
+	copy->epoch = NoCancelEpoch;
+	copy->deps = NULL;
+	copy->depCount = 0;
+	if (order->code == WorkerConfigure) {
+		copy->configure.nsPrefix = strdup(order->configure.nsPrefix);
+		copy->configure.ovsDir = strdup(order->configure.ovsDir);
+		copy->configure.ovsSchema = strdup(order->configure.ovsSchema);
+	}
+	return copy;
 }
 
 // Called by main process => main thread
 static bool broadcastOrder(WorkerOrder* order) {
+	// Worker threads take orders from their queues, so each one gets a copy
+	// behind the orders that it already has
+	if (workMain.useThreads) {
+		lprintf(LogDebug, "Broadcasting order code %d to all worker threads\n", order->code);
+		for (guint i = 0; i < workMain.poolSize; ++i) {
+			sendOrderTo(cloneOrder(order), &workMain.workplaces[i]);
+		}
+		return true;
+	}
+
 	// Make sure that all sender threads are blocked reading from the queue
 	waitForSending();
 
 	lprintf(LogDebug, "Broadcasting order code %d to all child processes\n", order->code);
+	order->seq = 0;
+	order->epoch = NoCancelEpoch;
 
 	// Send the order directly to each child process
 	bool success = true;
@@ -398,111 +1035,409 @@ static bool broadcastOrder(WorkerOrder* order) {
 	return success;
 }
 
+// Called by main process => send thread or worker thread. Records that orders
+// have left the queues.
+static void ordersDelivered(uint32_t count) {
+	g_mutex_lock(&workMain.lock);
+	workMain.unsentOrders -= count;
+	if (workMain.unsentOrders == 0) g_cond_signal(&workMain.allOrdersSent);
+	if (workMain.unsentOrders < workMain.maxUnsentOrders) g_cond_signal(&workMain.queueSpace);
+	g_mutex_unlock(&workMain.lock);
+}
+
+// Called by main process => send thread. Delivers all batched orders to the
+// child process.
+static void flushOrders(Workplace* wp) {
+	if (wp->batchedOrders == 0) return;
+	if (!chFlush(&wp->orders)) {
+		lprintf(LogError, "Failed to send %u worker orders to child in workplace %p\n", wp->batchedOrders, wp);
+	}
+	ordersDelivered(wp->batchedOrders);
+	wp->batchedOrders = 0;
+}
+
+// Called by main process => response thread, send thread, or worker thread.
+// Records the last order finished by a worker and wakes up anyone waiting for
+// it. Reports never move backwards (see workJoin).
+static void setFinishedSeq(Workplace* wp, uint64_t seq) {
+	g_mutex_lock(&workMain.lock);
+	if (seq > wp->finishedSeq) wp->finishedSeq = seq;
+	g_cond_broadcast(&workMain.progress);
+	g_mutex_unlock(&workMain.lock);
+}
+
+// Called by main process => send thread or worker thread. Blocks until all of
+// the dependencies of an order have been finished by other workers. Returns
+// false if the order was cancelled, in which case it must not be executed.
+// Stale orders do not wait, because their dependencies may have been discarded.
+static bool waitForDeps(Workplace* wp, const WorkerOrder* order) {
+	if (orderCancelled(order)) return false;
+	if (order->depCount == 0) return true;
+
+	bool ready = true;
+	g_mutex_lock(&workMain.lock);
+	for (guint i = 0; i < order->depCount; ++i) {
+		if (workMain.workplaces[order->deps[i].worker].finishedSeq < order->deps[i].seq) {
+			ready = false;
+			break;
+		}
+	}
+	g_mutex_unlock(&workMain.lock);
+	if (ready) return true;
+
+	// Give our worker everything that we have so far so that it does not sit
+	// idle (and so that others that are waiting on it can make progress)
+	flushOrders(wp);
+
+	lprintf(LogDebug, "Order %lu for workplace %p is waiting for orders in other workplaces\n", order->seq, wp);
+	g_mutex_lock(&workMain.lock);
+	for (guint i = 0; i < order->depCount && !orderCancelled(order); ++i) {
+		Workplace* other = &workMain.workplaces[order->deps[i].worker];
+		while (other->finishedSeq < order->deps[i].seq && !orderCancelled(order)) {
+			g_cond_wait(&workMain.progress, &workMain.lock);
+		}
+	}
+	g_mutex_unlock(&workMain.lock);
+	return !orderCancelled(order);
+}
+
 // The entry point for the send threads in the main process
 static void* sendThread(gpointer data) {
 	Workplace* wp = data;
+	bool discarding = false;
 
 	bool loop = true;
 	while (loop) {
-		gpointer item = g_async_queue_pop(workMain.orderQueue);
+		gpointer item = g_async_queue_try_pop(wp->orderQueue);
+		if (item == NULL) {
+			// The queue is empty, so deliver the batch before waiting for more
+			flushOrders(wp);
+			item = g_async_queue_pop(wp->orderQueue);
+		}
 		WorkerOrder* order = item;
 		if (order->code == WorkerTerminate) {
 			loop = false;
+		} else if (!waitForDeps(wp, order)) {
+			if (!discarding) {
+				lprintf(LogDebug, "Discarding stale orders for workplace %p after a failure\n", wp);
+				discarding = true;
+			}
+			// The child never sees the order, so we report it as finished.
+			// Otherwise, an order stamped just before the failure was noticed
+			// could wait for it forever. Earlier orders that may still be
+			// running belong to the failed work, so nothing valid depends on
+			// them.
+			if (order->seq != 0) setFinishedSeq(wp, order->seq);
 		} else {
-			writeOrderToWorkplace(order, wp);
+			discarding = false;
+			lprintf(LogDebug, "Sending order code %d to child in workplace %p\n", order->code, wp);
+			if (!writeOrder(order, &wp->orders)) {
+				lprintf(LogError, "Failed to send worker order code %d to child in workplace %p\n", order->code, wp);
+			}
 		}
-		freeOrderContents(order);
-		free(order);
-
-		g_mutex_lock(&workMain.lock);
-		--workMain.unsentOrders;
-		if (workMain.unsentOrders == 0) g_cond_signal(&workMain.allOrdersSent);
-		g_mutex_unlock(&workMain.lock);
+		releaseOrder(order);
+		++wp->batchedOrders;
 	}
+	flushOrders(wp);
+	chShutdown(&wp->orders);
 
 	lprintf(LogDebug, "Order sending thread for workplace %p shutting down\n", wp);
 	close(wp->ordersFd);
 	return NULL;
 }
 
+// Called by main process => response thread or worker thread. Reports the
+// order behind an error response immediately, rather than waiting for the main
+// thread to notice the error.
+static void logOrderFailure(Workplace* wp, const WorkerResponse* resp) {
+	char nodes[64] = "";
+	if (resp->error.nodeCount == 1) {
+		snprintf(nodes, sizeof(nodes), " involving node %u", resp->error.nodes[0]);
+	} else if (resp->error.nodeCount == 2) {
+		snprintf(nodes, sizeof(nodes), " involving nodes %u and %u", resp->error.nodes[0], resp->error.nodes[1]);
+	}
+	lprintf(LogError, "Worker in workplace %p failed order code %d%s (error code %d); cancelling pending work\n", wp, resp->error.order, nodes, resp->error.code);
+}
+
+// Called by main process => response thread or worker thread. Handles a
+// response from a worker, other than log messages.
+static void handleResponse(Workplace* wp, const WorkerResponse* resp) {
+	switch (resp->code) {
+	case ResponsePong:
+		g_mutex_lock(&workMain.lock);
+		--workMain.pongsExpected;
+		if (workMain.pongsExpected == 0) g_cond_signal(&workMain.pongsFinished);
+		g_mutex_unlock(&workMain.lock);
+		break;
+	case ResponseProgress:
+		setFinishedSeq(wp, resp->progress.seq);
+		break;
+	case ResponseError:
+		logOrderFailure(wp, resp);
+
+		g_mutex_lock(&workMain.lock);
+		workMain.errorCode = resp->error.code;
+		workMain.receivedError = true;
+
+		PendingRequest* req = findRequest(resp->error.request);
+		if (req != NULL) {
+			req->err = resp->error.code;
+			req->done = true;
+		}
+
+		// We need to signal other conditions just in case an error occurred
+		// while we were waiting for something else. Normally, we just
+		// handle errors asynchronously.
+		g_cond_broadcast(&workMain.receivedResponse);
+		g_cond_signal(&workMain.pongsFinished);
+		g_cond_broadcast(&workMain.progress); // Stale orders stop waiting
+
+		g_mutex_unlock(&workMain.lock);
+		break;
+	default:
+		g_mutex_lock(&workMain.lock);
+		completeRequest(resp);
+		g_mutex_unlock(&workMain.lock);
+	}
+}
+
 // The entry point for the response threads in the main process
 static void* responseThread(gpointer data) {
 	Workplace* wp = data;
 
 	while (true) {
+		uint32_t code;
+		const void* frame;
+		size_t frameLen;
+		if (!chReadFrame(&wp->responses, &code, &frame, &frameLen)) break;
+
 		WorkerResponse resp;
-		if (!readAll(wp->responsesFd, &resp, sizeof(WorkerResponse))) break;
-
-		switch (resp.code) {
-		case ResponsePong:
-			g_mutex_lock(&workMain.lock);
-			--workMain.pongsExpected;
-			if (workMain.pongsExpected == 0) g_cond_signal(&workMain.pongsFinished);
-			g_mutex_unlock(&workMain.lock);
-			break;
-		case ResponseLogPrint:
-			flexBufferGrow((void**)&wp->logBuffer, wp->logLen, &wp->logCap, resp.logMessage.len, 1);
-			if (!readAll(wp->responsesFd, &wp->logBuffer[wp->logLen], resp.logMessage.len)) goto done;
-			wp->logLen += resp.logMessage.len;
-			break;
-		case ResponseLogEnd:
-			flexBufferGrowAppendStr((void**)&wp->logBuffer, &wp->logLen, &wp->logCap, "");
-			lprintRaw(wp->logBuffer);
-			wp->logLen = 0;
-			break;
-		case ResponseError:
-			g_mutex_lock(&workMain.lock);
-			workMain.errorCode = resp.error.code;
-			workMain.receivedError = true;
-
-			// We need to signal other conditions just in case an error occurred
-			// while we were waiting for something else. Normally, we just
-			// handle errors asynchronously.
-			g_cond_signal(&workMain.receivedResponse);
-			g_cond_signal(&workMain.pongsFinished);
-
-			g_mutex_unlock(&workMain.lock);
-			break;
-		default:
-			g_mutex_lock(&workMain.lock);
-			workMain.response = resp;
-			workMain.responseQueued = true;
-			g_cond_signal(&workMain.receivedResponse);
-			g_mutex_unlock(&workMain.lock);
+		ZERO_RESPONSE(&resp);
+		resp.code = (WorkerResponseCode)code;
+		if (resp.code == ResponseLogPrint) {
+			// Batches of whole lines, already formatted by the child
+			if (frameLen == 0 || ((const char*)frame)[frameLen-1] != '\0') {
+				lprintf(LogError, "Malformed log output from child in workplace %p\n", wp);
+				break;
+			}
+			lprintRaw(frame);
+		} else {
+			size_t bodyLen;
+			void* body = responseBody(&resp, &bodyLen);
+			if (frameLen != bodyLen) {
+				lprintf(LogError, "Malformed response code %d from child in workplace %p\n", resp.code, wp);
+				break;
+			}
+			memcpy(body, frame, bodyLen);
+			handleResponse(wp, &resp);
 		}
 	}
 
-done:
 	lprintf(LogDebug, "Response thread for workplace %p shutting down\n", wp);
+
+	// Make sure that nobody waits forever for orders that will never finish
+	setFinishedSeq(wp, UINT64_MAX);
+
 	close(wp->responsesFd);
 	return NULL;
 }
 
-// Called by child process
+// Called by child process. Accumulates log output locally; a NULL message ends
+// the current line.
 static void childLogPrint(const char* msg) {
-	WorkerResponse resp;
-	ZERO_RESPONSE(&resp);
 	if (msg == NULL) {
-		resp.code = ResponseLogEnd;
+		workChild.logComplete = workChild.logLen;
+		if (workChild.logComplete >= LogBatchLimit) sendLogBatch();
 	} else {
-		resp.code = ResponseLogPrint;
-		resp.logMessage.len = strlen(msg);
+		size_t len = strlen(msg);
+		flexBufferGrow((void**)&workChild.logBatch, workChild.logLen, &workChild.logCap, len, 1);
+		flexBufferAppend(workChild.logBatch, &workChild.logLen, msg, len, 1);
 	}
-	resp.code = (msg == NULL ? ResponseLogEnd : ResponseLogPrint);
-	writeAll(STDOUT_FILENO, &resp, sizeof(WorkerResponse));
-	if (msg != NULL) {
-		writeAll(STDOUT_FILENO, msg, resp.logMessage.len);
+}
+
+// Called by child process. Informs the main process about the last order that
+// was finished, if this has changed since the last report.
+static void reportProgress(uint64_t finishedSeq, uint64_t* reportedSeq) {
+	if (finishedSeq == *reportedSeq) return;
+	WorkerResponse resp;
+	ZERO_RESPONSE(&resp);
+	resp.code = ResponseProgress;
+	resp.progress.seq = finishedSeq;
+	respond(&resp, true);
+	*reportedSeq = finishedSeq;
+}
+
+// Returns the request identifier associated with an order, or 0 if the order
+// does not produce a result
+static workRequest orderRequest(const WorkerOrder* order) {
+	switch (order->code) {
+	case WorkerGetEdgeRemoteMac: return order->getEdgeRemoteMac.request;
+	case WorkerGetEdgeLocalMac: return order->getEdgeLocalMac.request;
+	case WorkerGetInterfaceMtu: return order->getInterfaceMtu.request;
+	case WorkerMtuSupported: return order->mtuSupported.request;
+	default: return 0;
 	}
 }
 
-// Called by child process
-static void respondError(int code) {
+// Finds the nodes that an order operates on. Returns the number of nodes.
+static guint orderNodes(const WorkerOrder* order, nodeId nodes[2]) {
+	switch (order->code) {
+	case WorkerAddHost: nodes[0] = order->addHost.id; return 1;
+	case WorkerSetSelfLink: nodes[0] = order->setSelfLink.id; return 1;
+	case WorkerAddClientRoutes: nodes[0] = order->addClientRoutes.clientId; return 1;
+	case WorkerAddClientFlows: nodes[0] = order->addClientFlows.clientId; return 1;
+	case WorkerAddLink:
+		nodes[0] = order->addLink.sourceId;
+		nodes[1] = order->addLink.targetId;
+		return 2;
+	case WorkerAddRoutes: nodes[0] = order->addRoutes.id; return 1;
+	default: return 0;
+	}
+}
+
+// Called by child process or worker thread. Cancels the pending work and
+// reports the failure of an order. Errors are delivered immediately so that the
+// main process learns about failures as soon as possible.
+static void respondError(int code, const WorkerOrder* order) {
+	cancelOrders(order);
+
 	lprintf(LogDebug, "Sending error code %d to parent process\n", code);
 	WorkerResponse resp;
 	ZERO_RESPONSE(&resp);
 	resp.code = ResponseError;
+	resp.error.request = orderRequest(order);
 	resp.error.code = code;
-	writeAll(STDOUT_FILENO, &resp, sizeof(WorkerResponse));
+	resp.error.order = order->code;
+	resp.error.nodeCount = orderNodes(order, resp.error.nodes);
+	respond(&resp, true);
+}
+
+// Called by child process or worker thread. Performs a work order and responds
+// to it. initialized tracks whether the worker has been configured.
+static void executeOrder(WorkerOrder* order, bool* initialized) {
+	// The worker must only be initialized once
+	if (*initialized && (order->code == WorkerConfigure)) {
+		lprintln(LogError, "Attempted duplicate worker initialization");
+		respondError(1, order);
+	} else if (!*initialized && !(order->code == WorkerConfigure || order->code == WorkerPing)) {
+		lprintf(LogError, "Invalid order code for uninitialized worker: %d\n", order->code);
+		respondError(1, order);
+	} else {
+		int err = 0;
+		switch (order->code) {
+		case WorkerPing: {
+			WorkerResponse resp;
+			ZERO_RESPONSE(&resp);
+			resp.code = ResponsePong;
+			respond(&resp, false);
+			break;
+		}
+		case WorkerConfigure: {
+			// Worker threads share the log settings of the main process
+			if (workThread.wp == NULL) {
+				logSetColorize(order->configure.logColorize);
+				logSetThreshold(order->configure.logThreshold);
+			}
+			lprintf(LogDebug, "Configuring worker\n");
+			err = workerInit(order->configure.nsPrefix, order->configure.ovsDir, order->configure.ovsSchema, order->configure.softMemCap);
+			if (err == 0) {
+				*initialized = true;
+			} else {
+				lprintln(LogError, "Failed to initialize worker due to configuration order");
+			}
+			break;
+		}
+		case WorkerGetEdgeRemoteMac: {
+			WorkerResponse resp;
+			ZERO_RESPONSE(&resp);
+			resp.code = ResponseGotMac;
+			resp.gotMac.request = order->getEdgeRemoteMac.request;
+
+			err = workerGetEdgeRemoteMac(order->getEdgeRemoteMac.intfName, order->getEdgeRemoteMac.ip, &resp.gotMac.mac);
+			if (err == 0) respond(&resp, false);
+			break;
+		}
+		case WorkerGetEdgeLocalMac: {
+			WorkerResponse resp;
+			ZERO_RESPONSE(&resp);
+			resp.code = ResponseGotMac;
+			resp.gotMac.request = order->getEdgeLocalMac.request;
+
+			err = workerGetEdgeLocalMac(order->getEdgeLocalMac.intfName, &resp.gotMac.mac);
+			if (err == 0) respond(&resp, false);
+			break;
+		}
+		case WorkerGetInterfaceMtu: {
+			WorkerResponse resp;
+			ZERO_RESPONSE(&resp);
+			resp.code = ResponseGotMtu;
+			resp.gotMtu.request = order->getInterfaceMtu.request;
+
+			err = workerGetInterfaceMtu(order->getInterfaceMtu.intfName, &resp.gotMtu.mtu);
+			if (err == 0) respond(&resp, false);
+			break;
+		}
+		case WorkerMtuSupported: {
+			WorkerResponse resp;
+			ZERO_RESPONSE(&resp);
+			resp.code = ResponseGotMtuSupported;
+			resp.gotMtuSupported.request = order->mtuSupported.request;
+
+			err = workerMtuSupported(order->mtuSupported.mtu, &resp.gotMtuSupported.supported, &resp.gotMtuSupported.failReason);
+			if (err == 0) respond(&resp, false);
+			break;
+		}
+		case WorkerAddRoot:
+			err = workerAddRoot(order->addRoot.addrSelf, order->addRoot.addrOther, order->addRoot.mtu, order->addRoot.useInitNs, order->addRoot.existing);
+			break;
+		case WorkerAddEdgeInterface: {
+			err = workerAddEdgeInterface(order->addEdgeInterface.intfName);
+			break;
+		}
+		case WorkerAddHost:
+			err = workerAddHost(order->addHost.id, order->addHost.ip, order->addHost.macs, order->addHost.mtu, &order->addHost.node, order->addHost.replace);
+			break;
+		case WorkerSetSelfLink:
+			err = workerSetSelfLink(order->setSelfLink.id, &order->setSelfLink.link);
+			break;
+		case WorkerEnsureSystemScaling:
+			err = workerEnsureSystemScaling(order->ensureSystemScaling.linkCount, order->ensureSystemScaling.nodeCount, order->ensureSystemScaling.clientNodes);
+			break;
+		case WorkerAddLink:
+			err = workerAddLink(order->addLink.sourceId, order->addLink.targetId, order->addLink.sourceIp, order->addLink.targetIp, order->addLink.macs, order->addLink.mtu, &order->addLink.link, order->addLink.replace);
+			break;
+		case WorkerAddRoutes:
+			err = workerAddRoutes(order->addRoutes.id, order->addRoutes.routes, order->addRoutes.routeCount);
+			break;
+		case WorkerAddClientRoutes:
+			err = workerAddClientRoutes(order->addClientRoutes.clientId, &order->addClientRoutes.subnet, order->addClientRoutes.replace);
+			break;
+		case WorkerAddClientFlows:
+			err = workerAddClientFlows(order->addClientFlows.clientId, order->addClientFlows.clientMacs, &order->addClientFlows.subnet, order->addClientFlows.edgePort, order->addClientFlows.clientPorts, order->addClientFlows.replace);
+			break;
+		case WorkerAddEdgeRoutes:
+			err = workerAddEdgeRoutes(&order->addEdgeRoutes.edgeSubnet, order->addEdgeRoutes.edgePort, &order->addEdgeRoutes.edgeLocalMac, &order->addEdgeRoutes.edgeRemoteMac);
+			break;
+		case WorkerDestroyHosts:
+			err = workerDestroyHosts();
+			break;
+		case WorkerCountHosts: {
+			WorkerResponse resp;
+			ZERO_RESPONSE(&resp);
+			resp.code = ResponseGotHostCount;
+			resp.gotHostCount.request = order->countHosts.request;
+
+			err = workerCountHosts(&resp.gotHostCount.count);
+			if (err == 0) respond(&resp, false);
+			break;
+		}
+		default:
+			lprintf(LogError, "Unknown order code %d\n", order->code);
+			err = 1;
+			break;
+		}
+		if (err != 0) respondError(err, order);
+	}
 }
 
 // The entry point for child processes
@@ -510,136 +1445,97 @@ static int childProcess(guint id) {
 	char prefix[20];
 	snprintf(prefix, 20, " [W%u]", id);
 
+	flexBufferInit((void**)&workChild.logBatch, &workChild.logLen, &workChild.logCap);
+	workChild.logComplete = 0;
+
 	bool parentColorized = logColorized();
 	logSetCallback(&childLogPrint);
 	logSetColorize(parentColorized);
 	logSetPrefix(prefix);
 
 	bool initialized = false;
+	uint64_t finishedSeq = 0;
+	uint64_t reportedSeq = 0;
+	uint32_t unreportedOrders = 0;
 
 	while (true) {
+		// Deliver queued responses before we block waiting for more orders
+		if (!chHasFrame(&workChild.orders)) {
+			reportProgress(finishedSeq, &reportedSeq);
+			sendLogBatch();
+			chFlush(&workChild.responses);
+		}
+
 		WorkerOrder order;
 		if (!readOrder(&order)) break;
-		lprintf(LogDebug, "Received order code %d\n", order.code);
-
-		// The worker must only be initialized once
-		if (initialized && (order.code == WorkerConfigure)) {
-			lprintln(LogError, "Attempted duplicate worker initialization");
-			respondError(1);
-		} else if (!initialized && !(order.code == WorkerConfigure || order.code == WorkerPing)) {
-			lprintf(LogError, "Invalid order code for uninitialized worker: %d\n", order.code);
-			respondError(1);
+		if (orderCancelled(&order)) {
+			lprintf(LogDebug, "Skipping stale order code %d\n", order.code);
 		} else {
-			int err = 0;
-			switch (order.code) {
-			case WorkerPing: {
-				WorkerResponse resp;
-				ZERO_RESPONSE(&resp);
-				resp.code = ResponsePong;
-				writeAll(STDOUT_FILENO, &resp, sizeof(WorkerResponse));
-				break;
-			}
-			case WorkerConfigure: {
-				logSetColorize(order.configure.logColorize);
-				logSetThreshold(order.configure.logThreshold);
-				lprintf(LogDebug, "Configuring worker process\n");
-				err = workerInit(order.configure.nsPrefix, order.configure.ovsDir, order.configure.ovsSchema, order.configure.softMemCap);
-				if (err == 0) {
-					initialized = true;
-				} else {
-					lprintln(LogError, "Failed to initialize worker due to configuration order");
-				}
-				break;
-			}
-			case WorkerGetEdgeRemoteMac: {
-				WorkerResponse resp;
-				ZERO_RESPONSE(&resp);
-				resp.code = ResponseGotMac;
+			lprintf(LogDebug, "Received order code %d\n", order.code);
+			executeOrder(&order, &initialized);
+		}
+		freeOrderContents(&order);
 
-				err = workerGetEdgeRemoteMac(order.getEdgeRemoteMac.intfName, order.getEdgeRemoteMac.ip, &resp.gotMac.mac);
-				if (err == 0) writeAll(STDOUT_FILENO, &resp, sizeof(WorkerResponse));
-				break;
+		if (order.seq != 0) {
+			finishedSeq = order.seq;
+			if (++unreportedOrders >= ProgressInterval) {
+				reportProgress(finishedSeq, &reportedSeq);
+				unreportedOrders = 0;
 			}
-			case WorkerGetEdgeLocalMac: {
-				WorkerResponse resp;
-				ZERO_RESPONSE(&resp);
-				resp.code = ResponseGotMac;
+		}
+	}
+	lprintln(LogDebug, "Child process terminating");
+	int err = 0;
+	if (initialized) {
+		err = workerCleanup();
+	}
+	sendLogBatch();
+	chShutdown(&workChild.responses);
+	flexBufferFree((void**)&workChild.logBatch, &workChild.logLen, &workChild.logCap);
+	return err;
+}
 
-				err = workerGetEdgeLocalMac(order.getEdgeLocalMac.intfName, &resp.gotMac.mac);
-				if (err == 0) writeAll(STDOUT_FILENO, &resp, sizeof(WorkerResponse));
-				break;
-			}
-			case WorkerGetInterfaceMtu: {
-				WorkerResponse resp;
-				ZERO_RESPONSE(&resp);
-				resp.code = ResponseGotMtu;
+// The entry point for worker threads in the thread backend
+static void* threadWorker(gpointer data) {
+	Workplace* wp = data;
+	workThread.wp = wp;
 
-				err = workerGetInterfaceMtu(order.getInterfaceMtu.intfName, &resp.gotMtu.mtu);
-				if (err == 0) writeAll(STDOUT_FILENO, &resp, sizeof(WorkerResponse));
-				break;
-			}
-			case WorkerMtuSupported: {
-				WorkerResponse resp;
-				ZERO_RESPONSE(&resp);
-				resp.code = ResponseGotMtuSupported;
+	char prefix[20];
+	snprintf(prefix, 20, " [W%u]", (guint)(wp - workMain.workplaces));
+	logSetPrefix(prefix);
 
-				err = workerMtuSupported(order.mtuSupported.mtu, &resp.gotMtuSupported.supported, &resp.gotMtuSupported.failReason);
-				if (err == 0) writeAll(STDOUT_FILENO, &resp, sizeof(WorkerResponse));
-				break;
-			}
-			case WorkerAddRoot:
-				err = workerAddRoot(order.addRoot.addrSelf, order.addRoot.addrOther, order.addRoot.mtu, order.addRoot.useInitNs, order.addRoot.existing);
-				break;
-			case WorkerAddEdgeInterface: {
-				err = workerAddEdgeInterface(order.addEdgeInterface.intfName);
-				break;
-			}
-			case WorkerAddHost:
-				err = workerAddHost(order.addHost.id, order.addHost.ip, order.addHost.macs, order.addHost.mtu, &order.addHost.node);
-				break;
-			case WorkerSetSelfLink:
-				err = workerSetSelfLink(order.setSelfLink.id, &order.setSelfLink.link);
-				break;
-			case WorkerEnsureSystemScaling:
-				err = workerEnsureSystemScaling(order.ensureSystemScaling.linkCount, order.ensureSystemScaling.nodeCount, order.ensureSystemScaling.clientNodes);
-				break;
-			case WorkerAddLink:
-				err = workerAddLink(order.addLink.sourceId, order.addLink.targetId, order.addLink.sourceIp, order.addLink.targetIp, order.addLink.macs, order.addLink.mtu, &order.addLink.link);
-				break;
-			case WorkerAddInternalRoutes:
-				err = workerAddInternalRoutes(order.addInternalRoutes.id1, order.addInternalRoutes.id2, order.addInternalRoutes.ip1, order.addInternalRoutes.ip2, &order.addInternalRoutes.subnet1, &order.addInternalRoutes.subnet2);
-				break;
-			case WorkerAddClientRoutes:
-				err = workerAddClientRoutes(order.addClientRoutes.clientId, order.addClientRoutes.clientMacs, &order.addClientRoutes.subnet, order.addClientRoutes.edgePort, order.addClientRoutes.clientPorts);
-				break;
-			case WorkerAddEdgeRoutes:
-				err = workerAddEdgeRoutes(&order.addEdgeRoutes.edgeSubnet, order.addEdgeRoutes.edgePort, &order.addEdgeRoutes.edgeLocalMac, &order.addEdgeRoutes.edgeRemoteMac);
-				break;
-			case WorkerDestroyHosts:
-				err = workerDestroyHosts();
-				break;
-			default:
-				lprintf(LogError, "Unknown order code %d\n", order.code);
-				err = 1;
-				break;
-			}
-			if (err != 0) respondError(err);
+	bool initialized = false;
+	while (true) {
+		WorkerOrder* order = g_async_queue_pop(wp->orderQueue);
+		ordersDelivered(1);
+		if (order->code == WorkerTerminate) {
+			releaseOrder(order);
+			break;
 		}
-		freeOrderContents(&order);
+		if (waitForDeps(wp, order)) {
+			lprintf(LogDebug, "Received order code %d\n", order->code);
+			executeOrder(order, &initialized);
+		} else {
+			lprintf(LogDebug, "Skipping stale order code %d\n", order->code);
+		}
+		uint64_t seq = order->seq;
+		releaseOrder(order);
+
+		if (seq != 0) setFinishedSeq(wp, seq);
 	}
-	lprintln(LogDebug, "Child process terminating");
-	if (initialized) {
-		return workerCleanup();
+	lprintln(LogDebug, "Worker thread terminating");
+	if (initialized && workerCleanup() != 0) {
+		lprintln(LogWarning, "Failed to clean up worker thread");
 	}
-	return 0;
+	setFinishedSeq(wp, UINT64_MAX);
+	logSetPrefix(NULL);
+	return NULL;
 }
 
 // Called by main process => main thread
 static bool initWorkplaceMainForks(Workplace* wpm, guint id) {
 	int pipefd[2];
 
-	flexBufferInit((void**)&wpm->logBuffer, &wpm->logLen, &wpm->logCap);
-
 	if (pipe(pipefd) != 0) return false;
 	int childOrdersFd = pipefd[0];
 	wpm->ordersFd = pipefd[1];
@@ -648,6 +1544,16 @@ static bool initWorkplaceMainForks(Workplace* wpm, guint id) {
 	wpm->responsesFd = pipefd[0];
 	int childResponsesFd = pipefd[1];
 
+	// Prefer shared memory for carrying data. The pipes are still used to
+	// detect when either side dies.
+	wpm->orderRing = chNewRing(RingCapacity);
+	wpm->responseRing = (wpm->orderRing == NULL ? NULL : chNewRing(RingCapacity));
+	if (wpm->responseRing == NULL && wpm->orderRing != NULL) {
+		chFreeRing(wpm->orderRing);
+		wpm->orderRing = NULL;
+	}
+	lprintf(LogDebug, "Workplace %p is using %s for communication\n", wpm, (wpm->orderRing != NULL ? "shared memory rings" : "pipes"));
+
 	pid_t pid = fork();
 	if (pid == 0) { // Child process
 		// Close all file descriptors meant for the main process
@@ -667,6 +1573,9 @@ static bool initWorkplaceMainForks(Workplace* wpm, guint id) {
 		close(childResponsesFd);
 		close(STDERR_FILENO);
 
+		chReaderInit(&workChild.orders, STDIN_FILENO, wpm->orderRing);
+		chWriterInit(&workChild.responses, STDOUT_FILENO, wpm->responseRing);
+
 		exit(childProcess(id));
 	} else if (pid == -1) goto forkAbort;
 
@@ -677,9 +1586,19 @@ static bool initWorkplaceMainForks(Workplace* wpm, guint id) {
 
 	lprintf(LogDebug, "Child process with PID %u created for workplace %p\n", pid, wpm);
 
+	chWriterInit(&wpm->orders, wpm->ordersFd, wpm->orderRing);
+	chReaderInit(&wpm->responses, wpm->responsesFd, wpm->responseRing);
+	wpm->batchedOrders = 0;
+	wpm->nextSeq = 1;
+	wpm->finishedSeq = 0;
+
 	return true;
 
 forkAbort:
+	if (wpm->orderRing != NULL) {
+		chFreeRing(wpm->orderRing);
+		chFreeRing(wpm->responseRing);
+	}
 	close(wpm->responsesFd);
 	close(childResponsesFd);
 pipeAbort:
@@ -695,28 +1614,70 @@ static void initWorkplaceMainThreads(Workplace* wp) {
 	wp->responseThread = g_thread_new("ResponseThread", &responseThread, wp);
 }
 
+// Called by main process => main thread
+static void initWorkplaceMainWorker(Workplace* wp) {
+	wp->batchedOrders = 0;
+	wp->nextSeq = 1;
+	wp->finishedSeq = 0;
+
+	lprintf(LogDebug, "Launching worker thread for workplace %p\n", wp);
+	wp->workerThread = g_thread_new("WorkerThread", &threadWorker, wp);
+}
+
 // Called by main process => main thread
 static void freeWorkplaceMain(Workplace* wpm) {
-	flexBufferFree((void**)&wpm->logBuffer, &wpm->logLen, &wpm->logCap);
+	if (workMain.useThreads) return;
+	chWriterFree(&wpm->orders);
+	chReaderFree(&wpm->responses);
+	if (wpm->orderRing != NULL) {
+		chFreeRing(wpm->orderRing);
+		chFreeRing(wpm->responseRing);
+	}
 }
 
 // Called by main process => main thread
-int workInit(void) {
+int workInit(bool useThreads) {
 	if (!workerHaveCap()) {
 		lprintln(LogError, "The process does not have the necessary capabilities for constructing the network. The process must be run as root.");
 		return 1;
 	}
 
 	workMain.poolSize = g_get_num_processors();
+	workMain.useThreads = useThreads;
+
+	// The control block must exist before the workers are created
+	workControl = chNewShared(sizeof(WorkControl));
+	workMain.sharedControl = (workControl != NULL);
+	if (!workMain.sharedControl) {
+		lprintln(LogDebug, "Shared memory is not available; failures will only cancel orders within each worker");
+		workControl = ecalloc(1, sizeof(WorkControl));
+	}
 	workMain.workplaces = eamalloc(workMain.poolSize, sizeof(Workplace), 0);
-	workMain.orderQueue = g_async_queue_new_full(&g_free);
 	workMain.unsentOrders = 0;
-	workMain.responseQueued = false;
-
-	lprintf(LogDebug, "Initializing %u worker processes\n", workMain.poolSize);
+	workMain.maxUnsentOrders = UINT32_MAX; // Set properly by workConfigure
+	workMain.freeOrders = NULL;
+	flexBufferInit((void**)&workMain.slabs, &workMain.slabCount, &workMain.slabCap);
+	flexBufferInit((void**)&workMain.requests, &workMain.requestCount, &workMain.requestCap);
+	workMain.nextRequest = 1;
+	flexBufferInit((void**)&workMain.nodes, &workMain.nodeCount, &workMain.nodeCap);
+	workMain.systemTicket.seq = 0;
+	workMain.firstNodeLane = (workMain.poolSize > 1 ? 1 : 0);
+	workMain.nextLane = 0;
+
+	lprintf(LogDebug, "Initializing %u worker %s\n", workMain.poolSize, (useThreads ? "threads" : "processes"));
 
 	for (guint i = 0; i < workMain.poolSize; ++i) {
 		workMain.workplaces[i].established = false;
+		workMain.workplaces[i].orderQueue = g_async_queue_new_full(&releaseOrder);
+	}
+
+	// Worker threads cannot fail to start (GLib aborts instead)
+	if (useThreads) {
+		for (guint i = 0; i < workMain.poolSize; ++i) {
+			initWorkplaceMainWorker(&workMain.workplaces[i]);
+			workMain.workplaces[i].established = true;
+		}
+		return 0;
 	}
 
 	// First, spawn the child processes
@@ -752,6 +1713,8 @@ int workInit(void) {
 int workConfigure(LogLevel logThreshold, bool logColorize, const char* nsPrefix, const char* ovsDir, const char* ovsSchema, uint64_t softMemCap) {
 	WorkerOrder order;
 	order.code = WorkerConfigure;
+	order.deps = NULL;
+	order.depCount = 0;
 	order.configure.logThreshold = logThreshold;
 	order.configure.logColorize = logColorize;
 	order.configure.nsPrefixLen = strlen(nsPrefix);
@@ -763,6 +1726,15 @@ int workConfigure(LogLevel logThreshold, bool logColorize, const char* nsPrefix,
 	order.configure.ovsSchema = strdup(ovsSchema == NULL ? "" : ovsSchema);
 	bool success = broadcastOrder(&order);
 	freeOrderContents(&order);
+
+	double maxOrders = (double)softMemCap * OrderMemoryFraction / (double)sizeof(OrderSlot);
+	uint32_t maxUnsent = (maxOrders >= (double)UINT32_MAX ? UINT32_MAX : (uint32_t)maxOrders);
+	if (maxUnsent < MinUnsentOrders) maxUnsent = MinUnsentOrders;
+	lprintf(LogDebug, "Limiting the number of undelivered worker orders to %u\n", maxUnsent);
+	g_mutex_lock(&workMain.lock);
+	workMain.maxUnsentOrders = maxUnsent;
+	g_mutex_unlock(&workMain.lock);
+
 	return success ? 0 : 1;
 }
 
@@ -777,13 +1749,13 @@ int workCleanup(void) {
 	}
 	g_mutex_unlock(&workMain.lock);
 
-	// Send enough WorkerTerminate orders to stop all order threads. This will
-	// cause the processes to exit, which will cause the response threads to
-	// exit.
+	// Send a WorkerTerminate order to each order thread. This will cause the
+	// processes to exit, which will cause the response threads to exit. In the
+	// thread backend, the worker threads exit directly.
 	lprintln(LogDebug, "Sending termination orders to worker threads");
 	for (guint i = 0; i < workMain.poolSize; ++i) {
 		if (!workMain.workplaces[i].established) continue;
-		res = sendOrder(newOrder(WorkerTerminate), true);
+		res = sendOrderTo(newOrder(WorkerTerminate), &workMain.workplaces[i]);
 		if (err == 0) err = res;
 	}
 
@@ -791,19 +1763,38 @@ int workCleanup(void) {
 	waitForSending();
 	for (guint i = 0; i < workMain.poolSize; ++i) {
 		if (!workMain.workplaces[i].established) continue;
-		g_thread_join(workMain.workplaces[i].sendThread);
-		g_thread_join(workMain.workplaces[i].responseThread);
+		if (workMain.useThreads) {
+			g_thread_join(workMain.workplaces[i].workerThread);
+		} else {
+			g_thread_join(workMain.workplaces[i].sendThread);
+			g_thread_join(workMain.workplaces[i].responseThread);
+		}
 	}
 
 	// Everything is terminated, so we can release the resources
 	lprintln(LogDebug, "Releasing resources for worker subsystem");
 	if (err == 0) err = res;
 	for (guint i = 0; i < workMain.poolSize; ++i) {
+		g_async_queue_unref(workMain.workplaces[i].orderQueue);
 		if (!workMain.workplaces[i].established) continue;
 		freeWorkplaceMain(&workMain.workplaces[i]);
 	}
 	free(workMain.workplaces);
-	g_async_queue_unref(workMain.orderQueue);
+	for (size_t i = 0; i < workMain.nodeCount; ++i) {
+		free(workMain.nodes[i].modified);
+	}
+	flexBufferFree((void**)&workMain.nodes, &workMain.nodeCount, &workMain.nodeCap);
+	flexBufferFree((void**)&workMain.requests, &workMain.requestCount, &workMain.requestCap);
+	for (size_t i = 0; i < workMain.slabCount; ++i) {
+		free(workMain.slabs[i]);
+	}
+	flexBufferFree((void**)&workMain.slabs, &workMain.slabCount, &workMain.slabCap);
+	workMain.freeOrders = NULL;
+	if (workControl != NULL) {
+		if (workMain.sharedControl) chFreeShared(workControl, sizeof(WorkControl));
+		else free(workControl);
+		workControl = NULL;
+	}
 	return err;
 }
 
@@ -836,6 +1827,17 @@ int workJoin(bool resetError) {
 	}
 	int err = 0;
 	if (workMain.receivedError) err = workMain.errorCode;
+
+	// Every order submitted before the join has now either finished or been
+	// discarded as stale. Discarded orders are reported as finished when they
+	// are skipped, but we also make sure here that later orders never wait for
+	// anything submitted before the join.
+	if (workMain.pongsExpected == 0) {
+		for (guint i = 0; i < workMain.poolSize; ++i) {
+			Workplace* wp = &workMain.workplaces[i];
+			if (wp->finishedSeq < wp->nextSeq - 1) wp->finishedSeq = wp->nextSeq - 1;
+		}
+	}
 	g_mutex_unlock(&workMain.lock);
 
 	lprintln(LogDebug, "Worker pool has finished all of its work");
@@ -845,73 +1847,108 @@ int workJoin(bool resetError) {
 // All of the following functions expose worker functionality to the main thread
 // of the main process
 
-int workGetEdgeRemoteMac(const char* intfName, ip4Addr ip, macAddr* edgeRemoteMac) {
-	WorkerOrder* order = newOrder(WorkerGetEdgeRemoteMac);
-	strncpy(order->getEdgeRemoteMac.intfName, intfName, INTERFACE_BUF_LEN);
-	order->getEdgeRemoteMac.ip = ip;
-	int err = sendOrder(order, false);
-	if (err != 0) return err;
-
+int workAwait(workRequest request) {
 	g_mutex_lock(&workMain.lock);
-	err = waitForResponse(ResponseGotMac);
+	PendingRequest* req = findRequest(request);
+	if (req == NULL) {
+		g_mutex_unlock(&workMain.lock);
+		lprintf(LogError, "BUG: awaited unknown work request %u\n", request);
+		return 1;
+	}
+	lprintf(LogDebug, "Waiting for response to request %u from worker pool\n", request);
+	while (!req->done && !workMain.receivedError) {
+		g_cond_wait(&workMain.receivedResponse, &workMain.lock);
+		req = findRequest(request);
+	}
+	int err = (req->done ? req->err : workMain.errorCode);
 	if (err == 0) {
-		memcpy(edgeRemoteMac->octets, workMain.response.gotMac.mac.octets, MAC_ADDR_BYTES);
-	} else {
-		char ipStr[IP4_ADDR_BUFLEN];
-		ip4AddrToString(ip, ipStr);
-		lprintf(LogError, "Could not find the MAC address for edge node with IP %s on interface '%s'. Ensure that the edge node is online, or manually specify the MAC address in the setup file or command arguments.\n", ipStr, intfName);
+		switch (req->expectedCode) {
+		case ResponseGotMac:
+			memcpy(req->result.mac->octets, req->resp.gotMac.mac.octets, MAC_ADDR_BYTES);
+			break;
+		case ResponseGotMtu:
+			*req->result.mtu = req->resp.gotMtu.mtu;
+			break;
+		case ResponseGotMtuSupported:
+			*req->result.mtuSupported.supported = req->resp.gotMtuSupported.supported;
+			*req->result.mtuSupported.failReason = req->resp.gotMtuSupported.failReason;
+			break;
+		case ResponseGotHostCount:
+			*req->result.hostCount = req->resp.gotHostCount.count;
+			break;
+		default: break;
+		}
 	}
+	req->id = 0;
 	g_mutex_unlock(&workMain.lock);
 	return err;
 }
 
-int workGetEdgeLocalMac(const char* intfName, macAddr* edgeLocalMac) {
-	WorkerOrder* order = newOrder(WorkerGetEdgeLocalMac);
-	strncpy(order->getEdgeLocalMac.intfName, intfName, INTERFACE_BUF_LEN);
-	int err = sendOrder(order, false);
-	if (err != 0) return err;
-
+void workCancel(workRequest request) {
 	g_mutex_lock(&workMain.lock);
-	err = waitForResponse(ResponseGotMac);
-	if (err == 0) {
-		memcpy(edgeLocalMac->octets, workMain.response.gotMac.mac.octets, MAC_ADDR_BYTES);
-	}
+	PendingRequest* req = findRequest(request);
+	if (req != NULL) req->id = 0;
 	g_mutex_unlock(&workMain.lock);
-	return err;
 }
 
-int workGetInterfaceMtu(const char* intfName, int* mtu) {
-	WorkerOrder* order = newOrder(WorkerGetInterfaceMtu);
-	strncpy(order->getInterfaceMtu.intfName, intfName, INTERFACE_BUF_LEN);
+// Sends the order that fulfills a request. If the order cannot be sent, the
+// request is released, since it will never receive a response.
+static int sendRequestOrder(WorkerOrder* order, workRequest* request) {
 	int err = sendOrder(order, false);
-	if (err != 0) return err;
-
-	g_mutex_lock(&workMain.lock);
-	err = waitForResponse(ResponseGotMtu);
-	if (err == 0) {
-		*mtu = workMain.response.gotMtu.mtu;
+	if (err != 0) {
+		workCancel(*request);
+		*request = 0;
 	}
-	g_mutex_unlock(&workMain.lock);
 	return err;
 }
 
-int workMtuSupported(int mtu, bool* supported, const char** failReason) {
+int workRequestEdgeRemoteMac(const char* intfName, ip4Addr ip, macAddr* edgeRemoteMac, workRequest* request) {
+	PendingRequest* req = newRequest(ResponseGotMac);
+	req->result.mac = edgeRemoteMac;
+	*request = req->id;
+
+	WorkerOrder* order = newOrder(WorkerGetEdgeRemoteMac);
+	order->getEdgeRemoteMac.request = *request;
+	strncpy(order->getEdgeRemoteMac.intfName, intfName, INTERFACE_BUF_LEN);
+	order->getEdgeRemoteMac.ip = ip;
+	return sendRequestOrder(order, request);
+}
+
+int workRequestEdgeLocalMac(const char* intfName, macAddr* edgeLocalMac, workRequest* request) {
+	PendingRequest* req = newRequest(ResponseGotMac);
+	req->result.mac = edgeLocalMac;
+	*request = req->id;
+
+	WorkerOrder* order = newOrder(WorkerGetEdgeLocalMac);
+	order->getEdgeLocalMac.request = *request;
+	strncpy(order->getEdgeLocalMac.intfName, intfName, INTERFACE_BUF_LEN);
+	return sendRequestOrder(order, request);
+}
+
+int workRequestInterfaceMtu(const char* intfName, int* mtu, workRequest* request) {
+	PendingRequest* req = newRequest(ResponseGotMtu);
+	req->result.mtu = mtu;
+	*request = req->id;
+
+	WorkerOrder* order = newOrder(WorkerGetInterfaceMtu);
+	order->getInterfaceMtu.request = *request;
+	strncpy(order->getInterfaceMtu.intfName, intfName, INTERFACE_BUF_LEN);
+	return sendRequestOrder(order, request);
+}
+
+int workRequestMtuSupported(int mtu, bool* supported, const char** failReason, workRequest* request) {
+	PendingRequest* req = newRequest(ResponseGotMtuSupported);
+	req->result.mtuSupported.supported = supported;
+	req->result.mtuSupported.failReason = failReason;
+	*request = req->id;
+
 	WorkerOrder* order = newOrder(WorkerMtuSupported);
+	order->mtuSupported.request = *request;
 	order->mtuSupported.mtu = mtu;
-	int err = sendOrder(order, false);
-	if (err != 0) return err;
-
-	g_mutex_lock(&workMain.lock);
-	err = waitForResponse(ResponseGotMtuSupported);
-	if (err == 0) {
-		*supported = workMain.response.gotMtuSupported.supported;
-		*failReason = workMain.response.gotMtuSupported.failReason;
-	}
-	g_mutex_unlock(&workMain.lock);
-	return err;
+	return sendRequestOrder(order, request);
 }
 
-int workAddRoot(ip4Addr addrSelf, ip4Addr addrOther, int mtu, bool useInitNs) {
+int workAddRoot(ip4Addr addrSelf, ip4Addr addrOther, int mtu, bool useInitNs, bool existing) {
 	WorkerOrder* loadOrder = newOrder(WorkerAddRoot);
 	loadOrder->addRoot.addrSelf = addrSelf;
 	loadOrder->addRoot.addrOther = addrOther;
@@ -919,21 +1956,20 @@ int workAddRoot(ip4Addr addrSelf, ip4Addr addrOther, int mtu, bool useInitNs) {
 	loadOrder->addRoot.useInitNs = useInitNs;
 	loadOrder->addRoot.existing = true;
 
-	WorkerOrder* createOrder = emalloc(sizeof(WorkerOrder));
-	*createOrder = *loadOrder;
-	createOrder->addRoot.existing = false;
-
 	// First, instruct any one worker to create the root namespace
-	int err = sendOrder(createOrder, false);
-	if (err != 0) return err;
-
-	err = workJoin(false);
-	if (err != 0) return err;
+	int err = 0;
+	if (!existing) {
+		WorkerOrder* createOrder = allocOrder();
+		*createOrder = *loadOrder;
+		createOrder->addRoot.existing = false;
+		err = sendOrder(createOrder, false);
+		if (err == 0) err = workJoin(false);
+	}
 
 	// Next, make sure that all workers load root namespace contexts
-	bool success = broadcastOrder(loadOrder);
-	free(loadOrder);
-	return (success ? 0 : 1);
+	if (err == 0 && !broadcastOrder(loadOrder)) err = 1;
+	releaseOrder(loadOrder);
+	return err;
 }
 
 int workAddEdgeInterface(const char* intfName) {
@@ -942,7 +1978,7 @@ int workAddEdgeInterface(const char* intfName) {
 	return sendOrder(order, false);
 }
 
-int workAddHost(nodeId id, ip4Addr ip, macAddr macs[], int mtu, const TopoNode* node) {
+int workAddHost(nodeId id, ip4Addr ip, macAddr macs[], int mtu, const TopoNode* node, bool replace) {
 	WorkerOrder* order = newOrder(WorkerAddHost);
 	order->addHost.id = id;
 	order->addHost.ip = ip;
@@ -953,6 +1989,7 @@ int workAddHost(nodeId id, ip4Addr ip, macAddr macs[], int mtu, const TopoNode*
 	}
 	order->addHost.mtu = mtu;
 	order->addHost.node = *node;
+	order->addHost.replace = replace;
 	return sendOrder(order, false);
 }
 
@@ -971,7 +2008,7 @@ int workEnsureSystemScaling(uint64_t linkCount, nodeId nodeCount, nodeId clientN
 	return sendOrder(order, false);
 }
 
-int workAddLink(nodeId sourceId, nodeId targetId, ip4Addr sourceIp, ip4Addr targetIp, macAddr macs[], int mtu, const TopoLink* link) {
+int workAddLink(nodeId sourceId, nodeId targetId, ip4Addr sourceIp, ip4Addr targetIp, macAddr macs[], int mtu, const TopoLink* link, bool replace) {
 	WorkerOrder* order = newOrder(WorkerAddLink);
 	order->addLink.sourceId = sourceId;
 	order->addLink.targetId = targetId;
@@ -982,31 +2019,40 @@ int workAddLink(nodeId sourceId, nodeId targetId, ip4Addr sourceIp, ip4Addr targ
 	}
 	order->addLink.mtu = mtu;
 	order->addLink.link = *link;
+	order->addLink.replace = replace;
 	return sendOrder(order, false);
 }
 
-int workAddInternalRoutes(nodeId id1, nodeId id2, ip4Addr ip1, ip4Addr ip2, const ip4Subnet* subnet1, const ip4Subnet* subnet2) {
-	WorkerOrder* order = newOrder(WorkerAddInternalRoutes);
-	order->addInternalRoutes.id1 = id1;
-	order->addInternalRoutes.id2 = id2;
-	order->addInternalRoutes.ip1 = ip1;
-	order->addInternalRoutes.ip2 = ip2;
-	order->addInternalRoutes.subnet1 = *subnet1;
-	order->addInternalRoutes.subnet2 = *subnet2;
+int workAddRoutes(nodeId id, const TopoRoute routes[], size_t routeCount) {
+	WorkerOrder* order = newOrder(WorkerAddRoutes);
+	order->addRoutes.id = id;
+	order->addRoutes.routeCount = routeCount;
+	order->addRoutes.routes = eamalloc(routeCount, sizeof(TopoRoute), 0);
+	memcpy(order->addRoutes.routes, routes, routeCount * sizeof(TopoRoute));
 	return sendOrder(order, false);
 }
 
-int workAddClientRoutes(nodeId clientId, macAddr clientMacs[], const ip4Subnet* subnet, uint32_t edgePort, uint32_t nextOvsPort) {
+int workAddClientRoutes(nodeId clientId, macAddr clientMacs[], const ip4Subnet* subnet, uint32_t edgePort, uint32_t nextOvsPort, bool replace) {
+	// The namespace routes and the switch flows are independent, so they are
+	// executed by different workers
 	WorkerOrder* order = newOrder(WorkerAddClientRoutes);
 	order->addClientRoutes.clientId = clientId;
+	order->addClientRoutes.subnet = *subnet;
+	order->addClientRoutes.replace = replace;
+	int err = sendOrder(order, false);
+	if (err != 0) return err;
+
+	order = newOrder(WorkerAddClientFlows);
+	order->addClientFlows.clientId = clientId;
 	for (int i = 0; i < NEEDED_MACS_CLIENT; ++i) {
-		memcpy(order->addClientRoutes.clientMacs[i].octets, clientMacs[i].octets, MAC_ADDR_BYTES);
+		memcpy(order->addClientFlows.clientMacs[i].octets, clientMacs[i].octets, MAC_ADDR_BYTES);
 	}
 	for (int i = 0; i < NEEDED_PORTS_CLIENT; ++i) {
-		order->addClientRoutes.clientPorts[i] = nextOvsPort++;
+		order->addClientFlows.clientPorts[i] = nextOvsPort++;
 	}
-	order->addClientRoutes.subnet = *subnet;
-	order->addClientRoutes.edgePort = edgePort;
+	order->addClientFlows.subnet = *subnet;
+	order->addClientFlows.edgePort = edgePort;
+	order->addClientFlows.replace = replace;
 	return sendOrder(order, false);
 }
 
@@ -1019,6 +2065,16 @@ int workAddEdgeRoutes(const ip4Subnet* edgeSubnet, uint32_t edgePort, const macA
 	return sendOrder(order, false);
 }
 
+int workRequestHostCount(nodeId* hostCount, workRequest* request) {
+	PendingRequest* req = newRequest(ResponseGotHostCount);
+	req->result.hostCount = hostCount;
+	*request = req->id;
+
+	WorkerOrder* order = newOrder(WorkerCountHosts);
+	order->countHosts.request = *request;
+	return sendRequestOrder(order, request);
+}
+
 int workDestroyHosts(void) {
 	return sendOrder(newOrder(WorkerDestroyHosts), false);
 }
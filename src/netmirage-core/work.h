@@ -30,6 +30,11 @@
 // return value indicates that no error was queued. If an error occurs while one
 // is already queued, one of the errors will be dropped, so the caller is
 // expected to cease all work operations after encountering an error.
+//
+// Orders that operate on the same nodes are executed in the order in which they
+// were submitted, as are all orders that use Open vSwitch. For example, routes
+// between two nodes are only added after the link between them exists. Callers
+// therefore only need to join when they require all work to be finished.
 
 #include <stdbool.h>
 #include <stdint.h>
@@ -43,8 +48,10 @@
 #define NEEDED_PORTS_CLIENT 2
 
 // Initializes the work subsystem. Free resources with workCleanup.
-// workConfigure must be called before sending any work commands.
-int workInit(void);
+// workConfigure must be called before sending any work commands. If useThreads
+// is true, the workers are threads of the calling process rather than child
+// processes.
+int workInit(bool useThreads);
 
 // Sends configuration values to the initialized work subsystem.
 int workConfigure(LogLevel logThreshold, bool logColorize, const char* nsPrefix, const char* ovsDir, const char* ovsSchema, uint64_t softMemCap);
@@ -53,41 +60,59 @@ int workConfigure(LogLevel logThreshold, bool logColorize, const char* nsPrefix,
 // automatically joins before cleaning up.
 int workCleanup(void);
 
+// Identifies an outstanding request for information from the workers. Requests
+// are submitted asynchronously like all other orders; the results are stored in
+// the caller's buffers once the request has been fulfilled. The caller must not
+// access the buffers until workAwait returns. Many requests may be outstanding
+// at the same time.
+typedef uint32_t workRequest;
+
+// Waits until a request has been fulfilled. If the request failed (or if another
+// error occurred in the meantime), the error is returned and the contents of
+// the result buffers are undefined. Each request must be awaited or cancelled
+// once. Requests whose functions return an error were never issued, and are
+// set to 0.
+int workAwait(workRequest request);
+
+// Abandons a request instead of awaiting it, for example when the caller gives
+// up after an error. The result buffers are never written after this returns.
+// Requests that were already awaited or cancelled, and requests that were not
+// issued (0), are ignored.
+void workCancel(workRequest request);
+
 // Determines the MAC address of an edge node connected to a physical interface.
-// The semantics are the same as netGetMacAddr. Since this function returns a
-// response, it automatically joins.
-int workGetEdgeRemoteMac(const char* intfName, ip4Addr ip, macAddr* edgeRemoteMac);
+// The semantics are the same as netGetMacAddr.
+int workRequestEdgeRemoteMac(const char* intfName, ip4Addr ip, macAddr* edgeRemoteMac, workRequest* request);
 
 // Determines the MAC address of a physical interface connected to an edge node.
 // Assumes that the interface has already been moved into the root namespace.
-// Since this function returns a response, it automatically joins.
-int workGetEdgeLocalMac(const char* intfName, macAddr* edgeLocalMac);
+int workRequestEdgeLocalMac(const char* intfName, macAddr* edgeLocalMac, workRequest* request);
 
 // Determines the MTU of a physical interface. Assumes that the interface is in
-// the default namespace. Since this function returns a response, it
-// automatically joins.
-int workGetInterfaceMtu(const char* intfName, int* mtu);
+// the default namespace.
+int workRequestInterfaceMtu(const char* intfName, int* mtu, workRequest* request);
 
 // Determines if a requested MTU size is supported by the system configuration.
-// Since this function returns a response, it automatically joins.
-int workMtuSupported(int mtu, bool* supported, const char** failReason);
+int workRequestMtuSupported(int mtu, bool* supported, const char** failReason, workRequest* request);
 
 // Creates a network namespace called the "root", which provides connectivity to
-// the external world.
-int workAddRoot(ip4Addr addrSelf, ip4Addr addrOther, int mtu, bool useInitNs);
+// the external world. If existing is true, the root was created by an earlier
+// run and the workers only connect to it.
+int workAddRoot(ip4Addr addrSelf, ip4Addr addrOther, int mtu, bool useInitNs, bool existing);
 
 // Adds an external interface to the root namespace. This removes it from the
 // init namespace, so it will appear to vanish from a simple "ifconfig" listing.
 // The interface is added to the switch, thereby connecting it to to virtual
-// network. Port numbers are assigned on a first-come-first-served basis, so the
-// caller should ensure that workJoin is called between workAddEdgeInterface
-// calls.
+// network. Port numbers are assigned on a first-come-first-served basis, in the
+// order in which the calls are made.
 int workAddEdgeInterface(const char* intfName);
 
 // Creates a new virtual host in its own network namespace. If the node is a
 // client, then it is connected to the root. If the node is a client, then macs
-// should contain NeededMacsClient unique addresses.
-int workAddHost(nodeId id, ip4Addr ip, macAddr macs[], int mtu, const TopoNode* node);
+// should contain NeededMacsClient unique addresses. If replace is true, the host
+// may have been partially created by an interrupted run, and any leftovers are
+// reused or removed.
+int workAddHost(nodeId id, ip4Addr ip, macAddr macs[], int mtu, const TopoNode* node, bool replace);
 
 // Applies traffic shaping parameters to a client node's "self" link.
 int workSetSelfLink(nodeId id, const TopoLink* link);
@@ -97,12 +122,14 @@ int workSetSelfLink(nodeId id, const TopoLink* link);
 int workEnsureSystemScaling(uint64_t linkCount, nodeId nodeCount, nodeId clientNodes);
 
 // Adds a virtual connection between two hosts. macs should contain
-// NeededMacsLink unique addresses.
-int workAddLink(nodeId sourceId, nodeId targetId, ip4Addr sourceIp, ip4Addr targetIp, macAddr macs[], int mtu, const TopoLink* link);
+// NeededMacsLink unique addresses. replace has the same meaning as for
+// workAddHost.
+int workAddLink(nodeId sourceId, nodeId targetId, ip4Addr sourceIp, ip4Addr targetIp, macAddr macs[], int mtu, const TopoLink* link, bool replace);
 
-// Adds static routing paths for internal links. Node 1 will route packets for
-// subnet2 through node 2. The reverse path is also set up.
-int workAddInternalRoutes(nodeId id1, nodeId id2, ip4Addr ip1, ip4Addr ip2, const ip4Subnet* subnet1, const ip4Subnet* subnet2);
+// Adds static routes to the routing table of a node. The links to the
+// neighbors used by the routes must already have been requested. The routes are
+// copied, and each subnet should only be routed once per node.
+int workAddRoutes(nodeId id, const TopoRoute routes[], size_t routeCount);
 
 // Adds static routing paths between a client node and the root. The subnet is
 // the range that the client node is responsible for. This also adds the
@@ -110,16 +137,19 @@ int workAddInternalRoutes(nodeId id1, nodeId id2, ip4Addr ip1, ip4Addr ip2, cons
 // have the same value as the call to workAddHost. edgePort is the port
 // identifier for the associated edge node interface, as assigned during the
 // workAddEdgeInterface call. nextOvsPort should be the next available port in
-// the switch. This call will add NEEDED_PORTS_CLIENT ports to the switch. The
-// caller should join between calls in order to prevent port number races.
-int workAddClientRoutes(nodeId clientId, macAddr clientMacs[], const ip4Subnet* subnet, uint32_t edgePort, uint32_t nextOvsPort);
+// the switch. This call will add NEEDED_PORTS_CLIENT ports to the switch.
+// replace has the same meaning as for workAddHost.
+int workAddClientRoutes(nodeId clientId, macAddr clientMacs[], const ip4Subnet* subnet, uint32_t edgePort, uint32_t nextOvsPort, bool replace);
 
 // Adds egression routes for an edge node to the switch in the root namespace.
 // edgeLocalMac should be the MAC address associated with the edge interface,
 // and edgeRemoteMac should be the MAC address of the remote edge node, as
-// returned by workGetEdgeMac and workGetEdgeLocalMac.
+// returned by workRequestEdgeRemoteMac and workRequestEdgeLocalMac.
 int workAddEdgeRoutes(const ip4Subnet* edgeSubnet, uint32_t edgePort, const macAddr* edgeLocalMac, const macAddr* edgeRemoteMac);
 
+// Counts the hosts that currently exist with the network prefix.
+int workRequestHostCount(nodeId* hostCount, workRequest* request);
+
 // Destroys all hosts created with the network prefix. If an Open vSwitch
 // instance is running for a root namespace, it is shut down and deleted. If
 // deletedHosts is not NULL, the number of deleted hosts is stored. If an error
@@ -44,23 +44,23 @@
 #include "ovs.h"
 #include "topology.h"
 
-static char ovsDir[PATH_MAX+1] = {0};
-static char ovsSchema[PATH_MAX+1] = {0};
+static __thread char ovsDir[PATH_MAX+1] = {0};
+static __thread char ovsSchema[PATH_MAX+1] = {0};
 
-static bool ovsSupportsJumboPackets = false;
+static __thread bool ovsSupportsJumboPackets = false;
 
-static netCache* nc = NULL;
+static __thread netCache* nc = NULL;
 
 // We keep these outside of the cache because they are used frequently:
-static netContext* defaultNet = NULL;
-static netContext* rootNet = NULL;
+static __thread netContext* defaultNet = NULL;
+static __thread netContext* rootNet = NULL;
 
 // We need to have two IP addresses for the root due to policy routing problems
 // in kernel 3 (see workerAddClientRoutes for details)
-static ip4Addr rootIpSelf;
-static ip4Addr rootIpOther;
+static __thread ip4Addr rootIpSelf;
+static __thread ip4Addr rootIpOther;
 
-static ovsContext* rootSwitch = NULL;
+static __thread ovsContext* rootSwitch = NULL;
 
 // Converts a node identifier into a namespace name. buffer should be large
 // enough to hold the identifier in decimal representation and the NUL
@@ -355,7 +355,7 @@ int workerAddEdgeInterface(const char* intfName) {
 	err = netSetInterfaceUp(rootNet, intfName, true);
 	if (err != 0) return err;
 
-	err = ovsAddPort(rootSwitch, RootBridgeName, intfName);
+	err = ovsAddPort(rootSwitch, RootBridgeName, intfName, false);
 	if (err != 0) return err;
 
 	macAddr intfMac;
@@ -376,15 +376,29 @@ static void sprintRootUpIntf(char* buf, nodeId id) {
 	sprintf(buf, "%s-%u", NodeLinkPrefix, id);
 }
 
-int workerAddHost(nodeId id, ip4Addr ip, macAddr macs[], int mtu, const TopoNode* node) {
+// Deletes an interface left behind by an interrupted setup, if it exists
+static int removeStaleInterface(netContext* net, const char* intfName) {
+	int err = netDeleteInterface(net, intfName, true);
+	return (err == ENODEV ? 0 : err);
+}
+
+int workerAddHost(nodeId id, ip4Addr ip, macAddr macs[], int mtu, const TopoNode* node, bool replace) {
 	char nodeName[MAX_NODE_ID_BUFLEN];
 	idToNsName(id, nodeName);
 
 	lprintf(LogDebug, "Creating host %s\n", nodeName);
 
+	// When replacing, we reuse the namespace if it exists. Deleting it would
+	// release its interfaces asynchronously, so we remove them ourselves.
 	int err;
-	netContext* net = ncOpenNamespace(nc, id, nodeName, true, true, &err);
+	netContext* net = ncOpenNamespace(nc, id, nodeName, true, !replace, &err);
 	if (net == NULL) return err;
+	if (replace && node->client) {
+		err = removeStaleInterface(net, SelfLinkPrefix);
+		if (err != 0) return err;
+		err = removeStaleInterface(net, RootLinkPrefix);
+		if (err != 0) return err;
+	}
 
 	err = applyNamespaceParams();
 	if (err != 0) return err;
@@ -495,7 +509,7 @@ int workerEnsureSystemScaling(uint64_t linkCount, nodeId nodeCount, nodeId clien
 	return 0;
 }
 
-int workerAddLink(nodeId sourceId, nodeId targetId, ip4Addr sourceIp, ip4Addr targetIp, macAddr macs[], int mtu, const TopoLink* link) {
+int workerAddLink(nodeId sourceId, nodeId targetId, ip4Addr sourceIp, ip4Addr targetIp, macAddr macs[], int mtu, const TopoLink* link, bool replace) {
 	char sourceName[MAX_NODE_ID_BUFLEN];
 	char targetName[MAX_NODE_ID_BUFLEN];
 	netContext* sourceNet;
@@ -509,6 +523,12 @@ int workerAddLink(nodeId sourceId, nodeId targetId, ip4Addr sourceIp, ip4Addr ta
 
 	lprintf(LogDebug, "Creating virtual connection from host %s to host %s\n", sourceName, targetName);
 
+	if (replace) {
+		// Deleting one end of the pair also deletes the other
+		err = removeStaleInterface(sourceNet, sourceIntf);
+		if (err != 0) return err;
+	}
+
 	int sourceIntfIdx, targetIntfIdx;
 
 	err = buildVethPair(sourceNet, targetNet, sourceIntf, targetIntf, sourceIp, targetIp, &macs[0], &macs[1], mtu, &sourceIntfIdx, &targetIntfIdx);
@@ -527,46 +547,43 @@ int workerAddLink(nodeId sourceId, nodeId targetId, ip4Addr sourceIp, ip4Addr ta
 	return 0;
 }
 
-int workerAddInternalRoutes(nodeId id1, nodeId id2, ip4Addr ip1, ip4Addr ip2, const ip4Subnet* subnet1, const ip4Subnet* subnet2) {
-	char name1[MAX_NODE_ID_BUFLEN];
-	char name2[MAX_NODE_ID_BUFLEN];
-	netContext* net1;
-	netContext* net2;
-	char intf1[INTERFACE_BUF_LEN];
-	char intf2[INTERFACE_BUF_LEN];
+int workerAddRoutes(nodeId id, const TopoRoute routes[], size_t routeCount) {
+	lprintf(LogDebug, "Adding %lu internal routes to node %u\n", routeCount, id);
 
-	int err;
-	err = workGetLinkEndpoints(id1, id2, name1, name2, &net1, &net2, intf1, intf2);
-	if (err != 0) return err;
+	char name[MAX_NODE_ID_BUFLEN];
+	idToNsName(id, name);
 
-	if (PASSES_LOG_THRESHOLD(LogDebug)) {
-		char ip1Str[IP4_ADDR_BUFLEN];
-		char ip2Str[IP4_ADDR_BUFLEN];
-		char subnet1Str[IP4_CIDR_BUFLEN];
-		char subnet2Str[IP4_CIDR_BUFLEN];
-		ip4AddrToString(ip1, ip1Str);
-		ip4AddrToString(ip2, ip2Str);
-		ip4SubnetToString(subnet1, subnet1Str);
-		ip4SubnetToString(subnet2, subnet2Str);
-		lprintf(LogDebug, "Adding internal routes from %u / %s (for %s) to %u / %s (for %s)\n", id1, ip1Str, subnet1Str, id2, ip2Str, subnet2Str);
-	}
+	int err;
+	netContext* net = ncOpenNamespace(nc, id, name, false, false, &err);
+	if (net == NULL) return err;
 
-	int intfIdx1 = netGetInterfaceIndex(net1, intf1, &err);
-	if (intfIdx1 == -1) return err;
-	int intfIdx2 = netGetInterfaceIndex(net2, intf2, &err);
-	if (intfIdx2 == -1) return err;
+	// Consecutive routes often use the same neighbor, so we only look up the
+	// interface when the neighbor changes
+	nodeId intfNode = INVALID_NODE_ID;
+	int intfIdx = -1;
+	for (size_t i = 0; i < routeCount; ++i) {
+		const TopoRoute* route = &routes[i];
+		if (route->via != intfNode) {
+			char intf[INTERFACE_BUF_LEN];
+			sprintf(intf, "%s-%u", NodeLinkPrefix, route->via);
+			intfIdx = netGetInterfaceIndex(net, intf, &err);
+			if (intfIdx == -1) return err;
+			intfNode = route->via;
+		}
 
-	// We allow "route exists" errors because we might try to add routes to the
-	// same internal nodes multiple times. In practice, this is rare.
-	err = netModifyRoute(net1, false, netGetTableId(TableMain), ScopeGlobal, CreatorAdmin, subnet2->addr, subnet2->prefixLen, ip2, intfIdx1, true);
-	if (err != 0 && err != EEXIST) return err;
-	err = netModifyRoute(net2, false, netGetTableId(TableMain), ScopeGlobal, CreatorAdmin, subnet1->addr, subnet1->prefixLen, ip1, intfIdx2, true);
-	if (err != 0 && err != EEXIST) return err;
+		if (PASSES_LOG_THRESHOLD(LogDebug)) {
+			char subnetStr[IP4_CIDR_BUFLEN];
+			ip4SubnetToString(&route->subnet, subnetStr);
+			lprintf(LogDebug, "Routing %s from node %u through node %u\n", subnetStr, id, route->via);
+		}
 
+		err = netModifyRoute(net, false, netGetTableId(TableMain), ScopeGlobal, CreatorAdmin, route->subnet.addr, route->subnet.prefixLen, route->gateway, intfIdx, true);
+		if (err != 0) return err;
+	}
 	return 0;
 }
 
-int workerAddClientRoutes(nodeId clientId, macAddr clientMacs[], const ip4Subnet* subnet, uint32_t edgePort, uint32_t clientPorts[]) {
+int workerAddClientRoutes(nodeId clientId, const ip4Subnet* subnet, bool replace) {
 	lprintf(LogDebug, "Adding routes to root namespace for client node %u\n", clientId);
 
 	// We have two objectives: packets for the subnet from other clients must be
@@ -599,9 +616,17 @@ int workerAddClientRoutes(nodeId clientId, macAddr clientMacs[], const ip4Subnet
 	err = netModifyRoute(net, false, netGetTableId(TableMain), ScopeGlobal, CreatorAdmin, subnet->addr, subnet->prefixLen, rootIpOther, downIdx, true);
 	if (err != 0) return err;
 
-	// Alternative route for packets from within the same subnet
-	err = netModifyRule(net, false, subnet, SelfLinkPrefix, CustomTableId, CreatorAdmin, CustomTablePriority, true);
-	if (err != 0) return err;
+	// Alternative route for packets from within the same subnet. Routes are
+	// replaced automatically, but the kernel would accept a duplicate rule.
+	bool ruleExists = false;
+	if (replace) {
+		err = netRuleExists(net, CustomTablePriority, &ruleExists);
+		if (err != 0) return err;
+	}
+	if (!ruleExists) {
+		err = netModifyRule(net, false, subnet, SelfLinkPrefix, CustomTableId, CreatorAdmin, CustomTablePriority, true);
+		if (err != 0) return err;
+	}
 	// In kernel 4, we would assign the root only one IP address. We would set
 	// the link route to be through the self interface in the custom table, and
 	// the up/down interface in the main table. However, kernel 3 will not parse
@@ -613,21 +638,25 @@ int workerAddClientRoutes(nodeId clientId, macAddr clientMacs[], const ip4Subnet
 	err = netModifyRoute(net, false, CustomTableId, ScopeGlobal, CreatorAdmin, subnet->addr, subnet->prefixLen, rootIpSelf, selfIdx, true);
 	if (err != 0) return err;
 
-	// At this point, the client namespace is fully set up. Now we add flow
-	// rules to the root switch
+	return 0;
+}
+
+int workerAddClientFlows(nodeId clientId, macAddr clientMacs[], const ip4Subnet* subnet, uint32_t edgePort, uint32_t clientPorts[], bool replace) {
+	lprintf(LogDebug, "Adding flow rules to the root switch for client node %u\n", clientId);
 
+	int err;
 	char intfBuf[INTERFACE_BUF_LEN];
 
 	// Incoming "self" link for intra-client communication
 	sprintRootSelfIntf(intfBuf, clientId);
-	err = ovsAddPort(rootSwitch, RootBridgeName, intfBuf);
+	err = ovsAddPort(rootSwitch, RootBridgeName, intfBuf, replace);
 	if (err != 0) return err;
 	err = ovsAddIpFlow(rootSwitch, RootBridgeName, edgePort, subnet, subnet, &clientMacs[MAC_ROOT_SELF], &clientMacs[MAC_CLIENT_SELF], clientPorts[0], OvsPrioritySelf);
 	if (err != 0) return err;
 
 	// Incoming uplink for inter-client communication
 	sprintRootUpIntf(intfBuf, clientId);
-	err = ovsAddPort(rootSwitch, RootBridgeName, intfBuf);
+	err = ovsAddPort(rootSwitch, RootBridgeName, intfBuf, replace);
 	if (err != 0) return err;
 	err = ovsAddIpFlow(rootSwitch, RootBridgeName, edgePort, subnet, NULL, &clientMacs[MAC_ROOT_OTHER], &clientMacs[MAC_CLIENT_OTHER], clientPorts[1], OvsPriorityIn);
 	if (err != 0) return err;
@@ -676,6 +705,17 @@ static int workerRestoreInterface(const char* name, int idx, void* userData) {
 	return 0;
 }
 
+static int workerCountNamespace(const char* name, void* userData) {
+	nodeId* hostCount = userData;
+	if (strcmp(name, RootName) != 0) ++*hostCount;
+	return 0;
+}
+
+int workerCountHosts(nodeId* hostCount) {
+	*hostCount = 0;
+	return netEnumNamespaces(&workerCountNamespace, hostCount);
+}
+
 static int workerDestroyNamespace(const char* name, void* userData) {
 	uint32_t* deletedHosts = userData;
 	if (deletedHosts != NULL) ++*deletedHosts;
@@ -22,7 +22,9 @@
 // This is the portion of the work system that actually performs system calls.
 // Each worker is meant to operate in its own process, in order to have its own
 // active namespace, and to isolate administrative privileges from the main I/O
-// portion of the program.
+// portion of the program. All worker state is thread-local, so workers may
+// alternatively run as threads of the main process, since the active namespace
+// is a per-thread property.
 
 #include <stdbool.h>
 #include <stdint.h>
@@ -41,7 +43,7 @@ bool workerDropCap(void);
 // Drops all effective capabilities of the thread.
 bool workerDropAllCap(void);
 
-// Initialize the current process as a worker process.
+// Initialize the current process (or thread) as a worker.
 int workerInit(const char* nsPrefix, const char* ovsDirArg, const char* ovsSchemaArg, uint64_t softMemCap);
 
 int workerCleanup(void);
@@ -53,11 +55,13 @@ int workerGetInterfaceMtu(const char* intfName, int* mtu);
 int workerMtuSupported(int mtu, bool* supported, const char** failReason);
 int workerAddRoot(ip4Addr addrSelf, ip4Addr addrOther, int mtu, bool useInitNs, bool existing);
 int workerAddEdgeInterface(const char* intfName);
-int workerAddHost(nodeId id, ip4Addr ip, macAddr macs[], int mtu, const TopoNode* node);
+int workerAddHost(nodeId id, ip4Addr ip, macAddr macs[], int mtu, const TopoNode* node, bool replace);
 int workerSetSelfLink(nodeId id, const TopoLink* link);
 int workerEnsureSystemScaling(uint64_t linkCount, nodeId nodeCount, nodeId clientNodes);
-int workerAddLink(nodeId sourceId, nodeId targetId, ip4Addr sourceIp, ip4Addr targetIp, macAddr macs[], int mtu, const TopoLink* link);
-int workerAddInternalRoutes(nodeId id1, nodeId id2, ip4Addr ip1, ip4Addr ip2, const ip4Subnet* subnet1, const ip4Subnet* subnet2);
-int workerAddClientRoutes(nodeId clientId, macAddr clientMacs[], const ip4Subnet* subnet, uint32_t edgePort, uint32_t clientPorts[]);
+int workerAddLink(nodeId sourceId, nodeId targetId, ip4Addr sourceIp, ip4Addr targetIp, macAddr macs[], int mtu, const TopoLink* link, bool replace);
+int workerAddRoutes(nodeId id, const TopoRoute routes[], size_t routeCount);
+int workerAddClientRoutes(nodeId clientId, const ip4Subnet* subnet, bool replace);
+int workerAddClientFlows(nodeId clientId, macAddr clientMacs[], const ip4Subnet* subnet, uint32_t edgePort, uint32_t clientPorts[], bool replace);
 int workerAddEdgeRoutes(const ip4Subnet* edgeSubnet, uint32_t edgePort, const macAddr* edgeLocalMac, const macAddr* edgeRemoteMac);
 int workerDestroyHosts(void);
+int workerCountHosts(nodeId* hostCount);
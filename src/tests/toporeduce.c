@@ -0,0 +1,320 @@
+/*******************************************************************************
+ * Copyright © 2018 Nik Unger, Ian Goldberg, Qatar University, and the Qatar
+ * Foundation for Education, Science and Community Development.
+ *
+ * This file is part of NetMirage.
+ *
+ * NetMirage is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * NetMirage is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Affero General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with NetMirage. If not, see <http://www.gnu.org/licenses/>.
+ *******************************************************************************/
+
+// Tests for the topology reductions in toporeduce.c. The program exits with a
+// nonzero status if any test fails.
+
+#include <math.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#include "log.h"
+#include "toporeduce.h"
+
+static int failures = 0;
+
+#define CHECK(cond) do{ \
+		if (!(cond)) { \
+			fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+			++failures; \
+		} \
+	} while(0)
+
+#define CHECK_NEAR(a, b) CHECK(fabs((double)(a) - (double)(b)) < 1e-6)
+
+// A link whose latency equals its routing weight
+#define LINK(from, to, w) { .source = (from), .target = (to), .weight = (w), .t.latency = (w) }
+
+// Returns the link between two nodes, in either direction, or NULL if there is
+// none
+static const TopoEdge* findLink(const TopoEdge links[], size_t linkCount, nodeId a, nodeId b) {
+	for (size_t i = 0; i < linkCount; ++i) {
+		if ((links[i].source == a && links[i].target == b) || (links[i].source == b && links[i].target == a)) {
+			return &links[i];
+		}
+	}
+	return NULL;
+}
+
+// Returns true if the links connect two nodes. Only small graphs are supported.
+static bool connected(const TopoEdge links[], size_t linkCount, nodeId a, nodeId b) {
+	enum { MaxNodes = 32 };
+	bool reached[MaxNodes] = { false };
+	reached[a] = true;
+	for (bool changed = true; changed;) {
+		changed = false;
+		for (size_t i = 0; i < linkCount; ++i) {
+			if (reached[links[i].source] != reached[links[i].target]) {
+				reached[links[i].source] = reached[links[i].target] = true;
+				changed = true;
+			}
+		}
+	}
+	return reached[b];
+}
+
+// Checks that all link endpoints are valid after renumbering
+static void checkEndpoints(const TopoEdge links[], size_t linkCount, nodeId remaining) {
+	for (size_t i = 0; i < linkCount; ++i) {
+		CHECK(links[i].source < remaining);
+		CHECK(links[i].target < remaining);
+	}
+}
+
+// A zero-cost chain of two transit nodes leading to a client must collapse into
+// the client, even though the transit nodes are merged with each other first.
+static void testZeroCostChain(void) {
+	enum { NodeCount = 5 };
+	const bool isClient[NodeCount] = { false, false, true, true, true };
+	TopoEdge links[] = {
+		LINK(0, 1, 0.f), // transit - transit
+		LINK(1, 2, 0.f), // transit - client
+		LINK(0, 3, 5.f),
+		LINK(0, 4, 3.f),
+	};
+	size_t linkCount = sizeof(links) / sizeof(links[0]);
+	nodeId nodeMap[NodeCount];
+
+	nodeId remaining = trReduce(NodeCount, isClient, links, &linkCount, nodeMap);
+	CHECK(remaining == 3);
+	CHECK(nodeMap[0] == INVALID_NODE_ID);
+	CHECK(nodeMap[1] == INVALID_NODE_ID);
+	CHECK(nodeMap[2] != INVALID_NODE_ID);
+	CHECK(linkCount == 2);
+	for (size_t i = 0; i < linkCount; ++i) {
+		CHECK(links[i].source == nodeMap[2] || links[i].target == nodeMap[2]);
+	}
+}
+
+// A chain of transit nodes between two clients becomes a single link that
+// carries the combined characteristics of the chain.
+static void testChainContraction(void) {
+	enum { NodeCount = 4 };
+	const bool isClient[NodeCount] = { true, false, false, true };
+	TopoEdge links[] = {
+		{ .source = 0, .target = 1, .weight = 2.f, .t = { .latency = 10.0, .packetLoss = 0.1, .jitter = 3.0, .queueLen = 5 } },
+		{ .source = 2, .target = 1, .weight = 3.f, .t = { .latency = 20.0, .packetLoss = 0.2, .jitter = 4.0, .queueLen = 7 } },
+		{ .source = 2, .target = 3, .weight = 1.f, .t = { .latency = 5.0, .packetLoss = 0.0, .jitter = 0.0, .queueLen = 1 } },
+	};
+	size_t linkCount = sizeof(links) / sizeof(links[0]);
+	nodeId nodeMap[NodeCount];
+
+	nodeId remaining = trReduce(NodeCount, isClient, links, &linkCount, nodeMap);
+	CHECK(remaining == 2);
+	CHECK(nodeMap[0] == 0);
+	CHECK(nodeMap[1] == INVALID_NODE_ID);
+	CHECK(nodeMap[2] == INVALID_NODE_ID);
+	CHECK(nodeMap[3] == 1);
+	CHECK(linkCount == 1);
+	const TopoEdge* link = findLink(links, linkCount, 0, 1);
+	CHECK(link != NULL);
+	if (link == NULL) return;
+	CHECK_NEAR(link->weight, 6.0);
+	CHECK_NEAR(link->t.latency, 35.0);
+	CHECK_NEAR(link->t.packetLoss, 1.0 - 0.9 * 0.8);
+	CHECK_NEAR(link->t.jitter, 5.0);
+	CHECK(link->t.queueLen == 13);
+}
+
+// Of two chains between the same nodes, only the cheaper one is contracted.
+// The other one remains unchanged.
+static void testParallelChains(void) {
+	enum { NodeCount = 6 };
+	const bool isClient[NodeCount] = { true, false, false, false, false, true };
+	TopoEdge links[] = {
+		LINK(0, 3, 2.f),
+		LINK(3, 4, 2.f),
+		LINK(4, 5, 2.f),
+		LINK(0, 1, 1.f),
+		LINK(1, 2, 1.f),
+		LINK(2, 5, 1.f),
+	};
+	size_t linkCount = sizeof(links) / sizeof(links[0]);
+	nodeId nodeMap[NodeCount];
+
+	nodeId remaining = trReduce(NodeCount, isClient, links, &linkCount, nodeMap);
+	CHECK(remaining == 4);
+	CHECK(nodeMap[0] == 0);
+	CHECK(nodeMap[1] == INVALID_NODE_ID);
+	CHECK(nodeMap[2] == INVALID_NODE_ID);
+	CHECK(nodeMap[3] == 1);
+	CHECK(nodeMap[4] == 2);
+	CHECK(nodeMap[5] == 3);
+	CHECK(linkCount == 4);
+	checkEndpoints(links, linkCount, remaining);
+	const TopoEdge* link = findLink(links, linkCount, 0, 3);
+	CHECK(link != NULL);
+	if (link != NULL) CHECK_NEAR(link->weight, 3.0);
+	CHECK(findLink(links, linkCount, 0, 1) != NULL);
+	CHECK(findLink(links, linkCount, 1, 2) != NULL);
+	CHECK(findLink(links, linkCount, 2, 3) != NULL);
+}
+
+// A chain is not contracted if its ends are already linked, since the new link
+// would duplicate the existing one.
+static void testChainDuplicatesLink(void) {
+	enum { NodeCount = 4 };
+	const bool isClient[NodeCount] = { true, false, false, true };
+	TopoEdge links[] = {
+		LINK(0, 3, 10.f),
+		LINK(0, 1, 1.f),
+		LINK(1, 2, 1.f),
+		LINK(2, 3, 1.f),
+	};
+	size_t linkCount = sizeof(links) / sizeof(links[0]);
+	nodeId nodeMap[NodeCount];
+
+	nodeId remaining = trReduce(NodeCount, isClient, links, &linkCount, nodeMap);
+	CHECK(remaining == 4);
+	CHECK(linkCount == 4);
+	for (nodeId id = 0; id < NodeCount; ++id) {
+		CHECK(nodeMap[id] == id);
+	}
+	const TopoEdge* link = findLink(links, linkCount, 0, 3);
+	CHECK(link != NULL);
+	if (link != NULL) CHECK_NEAR(link->weight, 10.0);
+}
+
+// Isolated rings of transit nodes, and loops that start and end at the same
+// node, are left alone.
+static void testRings(void) {
+	enum { NodeCount = 7 };
+	const bool isClient[NodeCount] = { true, true, false, false, false, false, false };
+	TopoEdge links[] = {
+		LINK(0, 1, 1.f),
+		LINK(2, 3, 1.f), // Isolated ring
+		LINK(3, 4, 1.f),
+		LINK(4, 2, 1.f),
+		LINK(0, 5, 1.f), // Loop through a client
+		LINK(5, 6, 1.f),
+		LINK(6, 0, 1.f),
+	};
+	size_t linkCount = sizeof(links) / sizeof(links[0]);
+	nodeId nodeMap[NodeCount];
+
+	nodeId remaining = trReduce(NodeCount, isClient, links, &linkCount, nodeMap);
+	CHECK(remaining == NodeCount);
+	CHECK(linkCount == 7);
+	for (nodeId id = 0; id < NodeCount; ++id) {
+		CHECK(nodeMap[id] == id);
+	}
+}
+
+// Pruning removes branches that are not on a shortest path between clients,
+// but keeps the self links of clients.
+static void testPruneBranch(void) {
+	enum { NodeCount = 5 };
+	const bool isClient[NodeCount] = { true, false, true, false, false };
+	TopoEdge links[] = {
+		LINK(0, 1, 1.f),
+		LINK(1, 2, 1.f),
+		LINK(1, 3, 1.f), // Branch
+		LINK(3, 4, 1.f),
+		LINK(0, 0, 2.f), // Client self link
+		LINK(3, 3, 2.f), // Transit self link
+	};
+	size_t linkCount = sizeof(links) / sizeof(links[0]);
+	nodeId nodeMap[NodeCount];
+
+	nodeId remaining = trPrune(NodeCount, isClient, links, &linkCount, nodeMap);
+	CHECK(remaining == 3);
+	CHECK(nodeMap[0] == 0);
+	CHECK(nodeMap[1] == 1);
+	CHECK(nodeMap[2] == 2);
+	CHECK(nodeMap[3] == INVALID_NODE_ID);
+	CHECK(nodeMap[4] == INVALID_NODE_ID);
+	CHECK(linkCount == 3);
+	checkEndpoints(links, linkCount, remaining);
+	CHECK(findLink(links, linkCount, 0, 0) != NULL);
+	CHECK(findLink(links, linkCount, 0, 1) != NULL);
+	CHECK(findLink(links, linkCount, 1, 2) != NULL);
+}
+
+// If there are several shortest paths between two clients, at least one of
+// them must remain.
+static void testPruneEqualCost(void) {
+	enum { NodeCount = 5 };
+	const bool isClient[NodeCount] = { true, false, false, true, false };
+	TopoEdge links[] = {
+		LINK(0, 1, 1.f),
+		LINK(1, 3, 1.f),
+		LINK(0, 2, 1.f),
+		LINK(2, 3, 1.f),
+		LINK(0, 4, 2.f), // Longer path
+		LINK(4, 3, 2.f),
+	};
+	size_t linkCount = sizeof(links) / sizeof(links[0]);
+	nodeId nodeMap[NodeCount];
+
+	nodeId remaining = trPrune(NodeCount, isClient, links, &linkCount, nodeMap);
+	CHECK(remaining >= 3 && remaining <= 4);
+	CHECK(nodeMap[0] != INVALID_NODE_ID);
+	CHECK(nodeMap[3] != INVALID_NODE_ID);
+	CHECK(nodeMap[4] == INVALID_NODE_ID);
+	checkEndpoints(links, linkCount, remaining);
+	if (nodeMap[0] != INVALID_NODE_ID && nodeMap[3] != INVALID_NODE_ID) {
+		CHECK(connected(links, linkCount, nodeMap[0], nodeMap[3]));
+	}
+}
+
+// Clients that cannot reach each other are kept, but the transit nodes that
+// only lead to unreachable clients are removed.
+static void testPruneUnreachable(void) {
+	enum { NodeCount = 4 };
+	const bool isClient[NodeCount] = { true, true, true, false };
+	TopoEdge links[] = {
+		LINK(0, 1, 1.f),
+		LINK(2, 3, 1.f),
+		LINK(2, 2, 1.f),
+	};
+	size_t linkCount = sizeof(links) / sizeof(links[0]);
+	nodeId nodeMap[NodeCount];
+
+	nodeId remaining = trPrune(NodeCount, isClient, links, &linkCount, nodeMap);
+	CHECK(remaining == 3);
+	CHECK(nodeMap[2] == 2);
+	CHECK(nodeMap[3] == INVALID_NODE_ID);
+	CHECK(linkCount == 2);
+	checkEndpoints(links, linkCount, remaining);
+	CHECK(findLink(links, linkCount, 0, 1) != NULL);
+	CHECK(findLink(links, linkCount, 2, 2) != NULL);
+}
+
+int main(void) {
+	logSetStream(stderr);
+	logSetThreshold(LogWarning);
+
+	testZeroCostChain();
+	testChainContraction();
+	testParallelChains();
+	testChainDuplicatesLink();
+	testRings();
+	testPruneBranch();
+	testPruneEqualCost();
+	testPruneUnreachable();
+
+	if (failures > 0) {
+		fprintf(stderr, "%d checks failed\n", failures);
+		return 1;
+	}
+	printf("All tests passed\n");
+	return 0;
+}